@@ -33,6 +33,7 @@ def main():
 		'build'		: exampleBuild,
 		'callback'	: exampleCallback,
 		'client'	: exampleClient,
+		'compact'	: exampleCompact,
 		'date'		: exampleDate,
 		'encode'	: exampleEncode,
 		'exception'	: exampleException,
@@ -42,7 +43,17 @@ def main():
 		'nbClient'	: exampleNbClient,
 		'postpone'	: examplePostpone,
 		'requestExit'	: exampleRequestExit,
-		'server'	: exampleServer
+		'server'	: exampleServer,
+		'streaming'	: exampleStreaming,
+		'chunked'	: exampleChunked,
+		'workers'	: exampleWorkers,
+		'fork'		: exampleFork,
+		'maxConns'	: exampleMaxConns,
+		'pool'		: examplePool,
+		'poolFail'	: examplePoolFail,
+		'pipeline'	: examplePipeline,
+		'pipelineClose'	: examplePipelineClose,
+		'numbers'	: exampleNumbers
 	}
 
 	xmlrpc.setLogLevel(LOGLEVEL)
@@ -312,6 +323,343 @@ def exampleEncode():
 	print('encoded is:\n', xmlrpc.encode(r))
 	print('decoded is:', xmlrpc.decode(xmlrpc.encode(r)))
 
+def exampleCompact():
+	r = {'list': ['hum', 3242, {'de': 1.5}], 'empty': []}
+	e = xmlrpc.encode(r, 1)
+	print('compact encoded is:', e)
+	if '\n' in e or '\t' in e:
+		raise Exception('compact encoding has whitespace')
+	if xmlrpc.decode(e)[0] != r:
+		raise Exception('compact encoding does not decode')
+	response = xmlrpc.buildResponse(r, {}, 1)
+	if len(response) >= len(xmlrpc.buildResponse(r, {})):
+		raise Exception('compact response is not smaller')
+	if xmlrpc.parseResponse(response)[0] != r:
+		raise Exception('compact response does not parse')
+
+# a server that streams its responses, run in a thread next to the client
+#
+def exampleStreaming():
+	import threading
+	s = xmlrpc.server()
+	s.addMethods({'echo' : lambda serv, src, uri, meth, params: params})
+	s.setStreaming(1024)
+	s.bindAndListen(PORT + 1)
+	t = threading.Thread(target=s.work, args=(5.0,))
+	t.daemon = True
+	t.start()
+	r = [{'n': i, 'x': [i * 0.5, 'a&b' * i]} for i in range(2000)]
+	c = xmlrpc.client('localhost', PORT + 1, '/blah')
+	if c.execute('echo', r) != r or c.execute('echo', []) != []:
+		raise Exception('streamed response does not match')
+	print('streamed response is ok')
+
+# sends a request with a chunked body, the way a producer that does not
+# know the length of what it is sending up front would
+#
+def exampleChunked():
+	import threading
+	import socket
+	s = xmlrpc.server()
+	s.addMethods({'echo' : lambda serv, src, uri, meth, params: params})
+	s.setOnErr(lambda src, exc: xmlrpc.ONERR_KEEP_WORK)
+	s.bindAndListen(PORT + 2)
+	t = threading.Thread(target=s.work, args=(5.0,))
+	t.daemon = True
+	t.start()
+	r = [{'n': i, 'x': 'a&b' * i} for i in range(500)]
+	body = xmlrpc.buildRequest('/blah', 'echo', r).split('\r\n\r\n', 1)[1]
+	head = 'POST /blah HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n'
+	def send(req):
+		sock = socket.create_connection(('localhost', PORT + 2))
+		sock.sendall(req.encode('latin-1'))
+		resp = b''
+		while not resp.endswith(b'</methodResponse>\r\n'):
+			try:
+				data = sock.recv(65536)
+			except socket.error:
+				data = b''
+			if not data:
+				break
+			resp += data
+		sock.close()
+		return resp
+	req = head
+	for i in range(0, len(body), 1000):
+		req += ' %x ;x=1\r\n%s\r\n' % (len(body[i:i + 1000]), body[i:i + 1000])
+	req += '0\r\n\r\n'
+	resp = send(req)
+	if xmlrpc.parseResponse(str(resp.decode('latin-1')))[0] != r:
+		raise Exception('chunked request does not match')
+	# blanks inside the size would frame the body differently
+	size = '%x' % len(body)
+	req = head + '%s %s\r\n%s\r\n0\r\n\r\n' % (size[0], size[1:], body)
+	if send(req):
+		raise Exception('chunk size with a blank inside was accepted')
+	print('chunked request is ok')
+
+# runs the handlers on a pool of threads, so slow calls overlap
+#
+def exampleWorkers():
+	import threading
+	import time
+	def slow(serv, src, uri, meth, params):
+		time.sleep(0.3)
+		return params
+	errors = []
+	def onErr(src, exc):
+		errors.append(exc[1])
+		return xmlrpc.ONERR_KEEP_WORK
+	s = xmlrpc.server()
+	s.addMethods({'slow' : slow,
+		'bad' : lambda serv, src, uri, meth, params: ['a'] * 50 + [object()]})
+	s.setOnErr(onErr)
+	s.setStreaming(64)
+	s.setWorkers(6)
+	s.bindAndListen(PORT + 3)
+	t = threading.Thread(target=s.work, args=(5.0,))
+	t.daemon = True
+	t.start()
+	results = []
+	def call(i):
+		c = xmlrpc.client('localhost', PORT + 3, '/blah')
+		results.append(c.execute('slow', [i]))
+	start = time.time()
+	calls = [threading.Thread(target=call, args=(i,)) for i in range(6)]
+	for c in calls:
+		c.start()
+	for c in calls:
+		c.join()
+	elapsed = time.time() - start
+	if sorted(results) != [[i] for i in range(6)]:
+		raise Exception('worker results do not match')
+	if elapsed > 1.2:
+		raise Exception('workers did not overlap (%.2fs)' % elapsed)
+	# a streamed response that fails part way goes to onErr, and the
+	# server keeps working
+	try:
+		xmlrpc.client('localhost', PORT + 3, '/blah').execute('bad', [])
+	except:
+		pass
+	else:
+		raise Exception('a response that could not be encoded was sent')
+	if xmlrpc.client('localhost', PORT + 3, '/blah').execute('slow', [7]) != [7]:
+		raise Exception('server stopped after a failed response')
+	if len(errors) != 1:
+		raise Exception('onErr got %d errors' % len(errors))
+	print('6 slow calls took %.2fs' % elapsed)
+
+# stops accepting while two connections are open
+#
+def exampleMaxConns():
+	import socket
+	s = xmlrpc.server()
+	s.setMaxConnections(2)
+	s.setAcceptBudget(1)
+	s.bindAndListen(PORT + 5)
+	socks = [socket.create_connection(('localhost', PORT + 5))
+		for i in range(6)]
+	for i in range(5):
+		s.work(0.1)
+	if s.stats()['connections'] != 2:
+		raise Exception('accepted %d connections' % s.stats()['connections'])
+	# pausing drops the listening source's hold on the server and
+	# resuming takes it again; while connections are still waiting,
+	# each round ends paused, so the count must come back the same
+	refs = sys.getrefcount(s._o)
+	for n in range(3, 6):
+		socks.pop(0).close()
+		for i in range(5):
+			s.work(0.1)
+		if s.stats()['connections'] != n:
+			raise Exception('accepted %d connections'
+				% s.stats()['connections'])
+		if sys.getrefcount(s._o) != refs:
+			raise Exception('server refcount went from %d to %d'
+				% (refs, sys.getrefcount(s._o)))
+	for sock in socks:
+		sock.close()
+	print('accepted a connection each time one was closed')
+
+# serves one port from two forked processes sharing the listening socket;
+# the parent only makes calls, so it must not be given a socket of its own
+#
+def exampleFork():
+	import os
+	import signal
+	s = xmlrpc.server()
+	s.addMethods({'pid' : lambda serv, src, uri, meth, params: os.getpid()})
+	s.bindAndListen(PORT + 4)
+	if s.fork(3) != 0:
+		while 1:
+			s.work(-1)
+	pids = {}
+	for i in range(30):
+		c = xmlrpc.client('localhost', PORT + 4, '/blah')
+		pids[c.execute('pid', [])] = 1
+		c.close()
+	stats = s.stats()
+	for proc in stats['procs'][1:]:
+		os.kill(proc['pid'], signal.SIGTERM)
+		os.waitpid(proc['pid'], 0)
+	if stats['requests'] != 30 or len(stats['procs']) != 3:
+		raise Exception('stats do not add up: %s' % (stats,))
+	print('%d processes answered, stats are %s' % (len(pids), stats))
+
+# fans calls out over a pool of four connections to a forked server
+# which answers each of them slowly on a worker thread
+#
+def examplePool():
+	import os
+	import signal
+	import time
+	def slow(serv, src, uri, meth, params):
+		time.sleep(0.2)
+		return params
+	s = xmlrpc.server()
+	s.addMethods({'slow' : slow})
+	s.bindAndListen(PORT + 6)
+	if s.fork(2) != 0:
+		s.setWorkers(4)
+		while 1:
+			s.work(-1)
+	results = []
+	def done(pool, response, i):
+		results.append(xmlrpc.parseResponse(response)[0][0])
+	p = xmlrpc.pool('localhost', PORT + 6, '/blah', 4)
+	start = time.time()
+	for i in range(16):
+		p.nbExecute('slow', [i], done, i)
+	while p.pending():
+		p.work(5.0)
+	elapsed = time.time() - start
+	stats = s.stats()
+	for proc in stats['procs'][1:]:
+		os.kill(proc['pid'], signal.SIGTERM)
+		os.waitpid(proc['pid'], 0)
+	if sorted(results) != list(range(16)):
+		raise Exception('pool results do not match: %s' % (results,))
+	if stats['connections'] != 4:
+		raise Exception('pool used %d connections' % stats['connections'])
+	if elapsed > 1.6:
+		raise Exception('pool calls did not overlap (%.2fs)' % elapsed)
+	print('16 slow calls on 4 connections took %.2fs' % elapsed)
+
+# a pool with no server to talk to: every call still gets its callback,
+# with a fault, and a pool dropped with calls outstanding is collected
+#
+def examplePoolFail():
+	import gc
+	import weakref
+	class Marker(object):
+		pass
+	results = []
+	def done(pool, response, i):
+		try:
+			results.append((i, xmlrpc.parseResponse(response)[0]))
+		except xmlrpc.fault as f:
+			results.append((i, f.faultCode))
+	p = xmlrpc.pool('localhost', PORT + 9, '/blah', 2)
+	p.setOnErr(lambda src, exc: xmlrpc.ONERR_KEEP_WORK)
+	for i in range(6):
+		if i == 3:
+			p.nbExecute('echo', [object()], done, i)
+		else:
+			p.nbExecute('echo', [i], done, i)
+	for n in range(10):
+		if not p.pending():
+			break
+		p.work(0.5)
+	if p.pending() or sorted(results) != [(i, -1) for i in range(6)]:
+		raise Exception('failed pool calls got %s, %d pending'
+				% (results, p.pending()))
+	marker = Marker()
+	ref = weakref.ref(marker)
+	p = xmlrpc.pool('localhost', PORT + 9, '/blah', 1)
+	for i in range(3):
+		p.nbExecute('echo', [i], done, marker)
+	del p, marker
+	gc.collect()
+	if ref() is not None:
+		raise Exception('a pool with calls outstanding is never freed')
+	print('failed pool calls are answered with faults')
+
+# pipelines calls on one connection to a forked server: every request is
+# written before the first response is read
+#
+def examplePipeline():
+	import os
+	import signal
+	s = xmlrpc.server()
+	s.addMethods({'echo' : echoMethod})
+	s.bindAndListen(PORT + 7)
+	if s.fork(2) != 0:
+		while 1:
+			s.work(-1)
+	results = []
+	def done(client, response, i):
+		results.append((i, xmlrpc.parseResponse(response)[0]))
+	c = xmlrpc.client('localhost', PORT + 7, '/blah')
+	for i in range(20):
+		c.nbExecute('echo', [i], done, i)
+	while len(results) < 20:
+		c.work(5.0)
+	stats = s.stats()
+	for proc in stats['procs'][1:]:
+		os.kill(proc['pid'], signal.SIGTERM)
+		os.waitpid(proc['pid'], 0)
+	if results != [(i, [i]) for i in range(20)]:
+		raise Exception('pipelined results do not match: %s' % (results,))
+	if stats['connections'] != 1:
+		raise Exception('pipeline used %d connections' % stats['connections'])
+	print('20 pipelined calls answered in order on one connection')
+
+# a server that closes part way through a pipeline: the calls it did not
+# answer get a fault each through their own callbacks
+#
+def examplePipelineClose():
+	import socket
+	import threading
+	lsock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+	lsock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+	lsock.bind(('localhost', PORT + 8))
+	lsock.listen(1)
+	def serve(answer):
+		sock = lsock.accept()[0]
+		sock.settimeout(5.0)
+		data = b''
+		while data.count(b'</methodCall>') < 5:
+			data += sock.recv(65536)
+		if answer:
+			resp = xmlrpc.buildResponse([0], {'Connection': 'close'})
+			sock.sendall(resp.encode('latin-1'))
+		sock.close()
+	results = []
+	def done(client, response, i):
+		try:
+			results.append((i, xmlrpc.parseResponse(response)[0]))
+		except xmlrpc.fault as f:
+			results.append((i, f.faultCode))
+	for answer in (1, 0):
+		t = threading.Thread(target=serve, args=(answer,))
+		t.start()
+		del results[:]
+		c = xmlrpc.client('localhost', PORT + 8, '/blah')
+		c.setOnErr(lambda src, exc: xmlrpc.ONERR_KEEP_WORK)
+		for i in range(5):
+			c.nbExecute('echo', [i], done, i)
+		for n in range(10):
+			if len(results) == 5:
+				break
+			c.work(0.5)
+		t.join()
+		expect = [(i, -1) for i in range(5)]
+		if answer:
+			expect[0] = (0, [0])
+		if results != expect:
+			raise Exception('calls after the close got %s' % (results,))
+	print('calls cut off by a close are failed through their callbacks')
+
 def exampleException():
 	try:
 		ex = xmlrpc.fault()
@@ -327,6 +675,51 @@ def exampleException():
 		if ex.faultCode != 1 or ex.faultString != 'Panic':
 			raise Exception('xmlrpc.fault does not work')
 
+# numbers go out with the fewest digits that read back the same, and
+# come in with the same checks as python's own int() and float()
+#
+def exampleNumbers():
+	def value(tag, text):
+		return xmlrpc.decode('<value><%s>%s</%s></value>' % (tag, text, tag))[0]
+	doubles = [0.1, -0.0, 5e-324, 1e300, 1e16, 2.0 / 3, 123456789012.5,
+		-1.7976931348623157e308]
+	for d in doubles:
+		e = xmlrpc.encode(d)
+		text = e.split('<double>')[1].split('</double>')[0]
+		if 'e' in text or 'E' in text:
+			raise Exception('%r is encoded with an exponent: %s' % (d, text))
+		if repr(xmlrpc.decode(e)[0]) != repr(d):
+			raise Exception('%r reads back as %r' % (d, xmlrpc.decode(e)[0]))
+	ints = [0, 7, -7, 2 ** 31 - 1, -2 ** 31, sys.maxsize, -sys.maxsize - 1]
+	for i in ints:
+		if xmlrpc.decode(xmlrpc.encode(i))[0] != i:
+			raise Exception('%d does not read back' % i)
+	parsed = [
+		('double', '1.5E-3', 0.0015),
+		('double', '-1.5e+3', -1500.0),
+		('double', '+7', 7.0),
+		('double', '12345678901234567890123', 1.2345678901234568e22),
+		('double', '0.12345678901234567890123', 0.12345678901234568),
+		('int', '+7', 7),
+		('i4', '-7', -7),
+		('int', '12345678901234567890123', 12345678901234567890123),
+		('int', str(sys.maxsize + 1), sys.maxsize + 1),
+		('int', str(-sys.maxsize - 1), -sys.maxsize - 1),
+		('int', str(-sys.maxsize - 2), -sys.maxsize - 2)
+	]
+	for tag, text, v in parsed:
+		if value(tag, text) != v:
+			raise Exception('<%s>%s</%s> is %r' % (tag, text, tag,
+				value(tag, text)))
+	for tag, text in [('double', '1e'), ('double', '-'), ('double', 'e5'),
+			('int', '-'), ('int', '7x'), ('int', '')]:
+		try:
+			v = value(tag, text)
+		except:
+			continue
+		raise Exception('<%s>%s</%s> was read as %r' % (tag, text, tag, v))
+	print('%d numbers are ok' % (len(doubles) + len(ints) + len(parsed)))
+
 def exampleDate():
 	d = xmlrpc.dateTime(1999, 6, 12, 4, 32, 34)
 	print('date is', d)
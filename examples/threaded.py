@@ -12,6 +12,9 @@
 #
 # I'm not very adept at threading, so I hope I didn't screw anything up.
 #
+# Run with -w and the server runs every handler on a pool of WORKERS
+# threads itself (see server.setWorkers()); normalPing then keeps up
+# with simultaneous clients just like threadPing does.
 #
 
 
@@ -31,6 +34,7 @@ xmlrpc.setLogLevel(0)
 PORT = 9998
 TIME_WORK = 0.001
 TIME_SLEEP = 0.1
+WORKERS = 8
 
 
 def main():
@@ -41,6 +45,8 @@ def main():
 	responseLock = thread.allocate_lock()
 
 	server = xmlrpc.server()
+	if '-w' in sys.argv[1:]:
+		server.setWorkers(WORKERS)
 	server.bindAndListen(PORT)
 	server.addMethods({
 		'threadPing' : threadPingMethod,
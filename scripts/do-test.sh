@@ -29,7 +29,7 @@ run_tests() {
   done
 }
 
-run_tests base64 emptyString build amper date ascii encode exception
+run_tests base64 emptyString build amper date numbers ascii encode compact streaming chunked workers fork maxConns pool poolFail pipeline pipelineClose exception
 
 ${PYTHON_CMD} examples/examples.py server&
 sleep 1
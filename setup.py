@@ -12,7 +12,7 @@ if sys.platform == 'win32':
 	LIBS	= ['ws2_32']
 else:
 	MACROS	= {'define' : []}
-	LIBS	= []
+	LIBS	= ['pthread']
 
 # I think that there are some unresolved which force me
 # to go in this order...
@@ -24,8 +24,6 @@
 
 
 
-#define	READ_SIZE		4096
-
 #define	STATE_CONNECT		0
 #define	STATE_CONNECTING	1
 #define	STATE_WRITE		2
@@ -36,36 +34,39 @@
 #define	RETURN_ERR		0
 #define	RETURN_AGAIN		1
 #define	RETURN_DONE		2
-#define	RETURN_READ_MORE	3		/* only for chunked encoding */
 
 
-static	rpcClient	*rpcClientNewFromDisp(
-				char		*host,
-				int		port,
-				char		*url,
-				rpcDisp		*disp
-			);
 static	bool		connecting(rpcClient *cp);
-static	bool		writeRequest(rpcClient *cp, PyObject **toWritep);
-static	bool		readResponse(
+static	int		writeRequest(rpcClient *cp);
+static	int		readCall(rpcClient *cp, bool eof);
+static	bool		clientFailed(rpcClient *cp);
+static	int		clientTakeCalls(rpcClient *cp, rpcCall **callsp);
+static	bool		clientFailCalls(
+				rpcClient	*cp,
+				rpcCall		*calls,
+				int		ncalls,
+				char		*why
+			);
+static	void		clientDropCalls(rpcClient *cp);
+static	int		readResponse(
 				rpcClient	*cp,
-				PyObject	**bodyp,
-				long		blen
+				bool		eof,
+				long		hlen,
+				long		blen,
+				PyObject	**respp
 			);
-static	bool		readHeader(
+static	int		readHeader(
 				rpcClient 	*cp,
- 				PyObject	**headp,
-				PyObject	**bodyp,
+				bool		eof,
+				long		*hlen,
 				long		*blen,
 				bool		*chunked
 			);
-static	bool		nbRead(int fd, PyObject **buffpp, bool *eof);
 static	bool		executed(rpcClient *cp, PyObject *resp, PyObject *arg);
 static	PyObject	*pyRpcClientExecute(PyObject *self, PyObject *args);
 static	PyObject	*pyRpcClientGetAttr(rpcClient *cp, char *name);
 static	PyObject	*pyRpcClientWork(PyObject *self, PyObject *args);
 static	bool		clientConnect(rpcClient *cp);
-static	bool		cleanAndRetFalse(PyObject *listp);
 static	bool		pyClientCallback(
 				rpcClient	*cp,
 				PyObject	*resp,
@@ -82,15 +83,11 @@ static	bool		addAuthentication(
 				char		*name,
 				char		*pass
 			);
-static	bool		readChunks(
+static	int		readChunks(
 				rpcClient	*client,
-				PyObject	**bodyp,
-				PyObject	**chunkp
-			);
-static	int		processChunk(
-				rpcClient	*client,
-				PyObject	**bodyp,
-				PyObject	**chunkp
+				bool		eof,
+				long		hlen,
+				PyObject	**respp
 			);
 
 
@@ -117,7 +114,10 @@ rpcClientNewFromServer(char *host, int port, char *url, rpcServer *servp)
 }
 
 
-static rpcClient *
+/*
+ * a client whose calls are run by disp
+ */
+rpcClient *
 rpcClientNewFromDisp(char *host, int port, char *url, rpcDisp *disp)
 {
 	rpcClient	*cp;
@@ -138,6 +138,11 @@ rpcClientNewFromDisp(char *host, int port, char *url, rpcDisp *disp)
 	cp->port = port;
 	cp->disp = disp;
 	cp->execing = false;
+	cp->dispatching = false;
+	cp->encFlags = 0;
+	cp->ncalls = 0;
+	cp->callall = 0;
+	cp->calls = NULL;
 	Py_INCREF(disp);
 	sp = rpcSourceNew(-1);
 	if (sp == NULL)
@@ -161,9 +166,25 @@ rpcClientNewFromDisp(char *host, int port, char *url, rpcDisp *disp)
 void
 rpcClientClose(rpcClient *cp)
 {
-	if (cp->src->fd >= 0)
-		close(cp->src->fd);
-	cp->src->fd = -1;	/* make sure we don't use the fd again */
+	rpcSourceClose(cp->src);	/* make sure we don't use the fd again */
+}
+
+
+/*
+ * Close the client and forget its outstanding calls without running
+ * them, taking its source off the dispatcher; for when whatever the
+ * calls would report to is going away
+ */
+void
+rpcClientAbandon(rpcClient *cp)
+{
+	rpcSource	*sp;
+
+	sp = cp->src;
+	if (rpcDispDelSource(cp->disp, sp))
+		Py_CLEAR(sp->params);
+	rpcClientClose(cp);
+	clientDropCalls(cp);
 }
 
 
@@ -177,196 +198,98 @@ rpcClientDealloc(rpcClient *cp)
 	rpcClientClose(cp);
 	cp->host = NULL;
 	cp->url = NULL;
+	clientDropCalls(cp);
+	if (cp->calls)
+		free(cp->calls);
 	Py_DECREF(cp->src);
 	Py_DECREF(cp->disp);
 	PyObject_DEL(cp);
 }
 
 
+/*
+ * Run the client's calls along as far as they will go.  params is the
+ * client; where the connection is (conn.state) and what the header of
+ * the response being read said are kept in the source's conn.  Once
+ * connected, requests queued behind the first are written whenever
+ * there are any, even while earlier responses are being read.
+ */
 static bool
 execDispatch(rpcDisp *dp, rpcSource *sp, int actions, PyObject *params)
 {
-	bool		(*cfunc) (rpcClient *, PyObject *, PyObject *),
-			res;
-	PyObject	*head,
-			*body,
-			*chunk,
-			*args,
-			*nargs,
-			*strReq,
-			*pyfunc,	/* python string that holds func ptr */
-			*cleanup,	/* list of items to be DECREF'd */
-			*funcArgs;	/* args to the callback function */
 	rpcClient	*cp;
-	int		state,
-			nacts,
-			nstate,
+	rpcConn		*connp;
+	int		nacts,
 			r;
-	long		blen;
-	bool		chunked;
+	bool		eof;
 
-	nargs = NULL;				/* to appease the compiler */
-	r = -1;
-	cleanup = PyList_New(0);
-	if (cleanup == NULL)
-		return false;
-	unless (PyArg_ParseTuple(params, "OiSOO:execDispatch",
-				&cp, &state, &pyfunc, &funcArgs, &args))
-		return false;
+	cp = (rpcClient *)params;
+	connp = &sp->conn;
+	eof = false;
 	assert(Py_TYPE(cp) == &rpcClientType);
 	assert(cp->execing == true);
 
-	switch (state) {
-	case STATE_CONNECT:		/* args is request, but not touched */
-		if (cp->src->fd < 0 and not clientConnect(cp)) {
-			cp->execing = false;
-			return cleanAndRetFalse(cleanup);
-		}
-		nstate = STATE_CONNECTING;
-		nacts = ACT_OUTPUT;
-		nargs = args;
+	switch (connp->state) {
+	case STATE_CONNECT:		/* the requests are queued on the source */
+		if (cp->src->fd < 0 and not clientConnect(cp))
+			return clientFailed(cp);
+		connp->state = STATE_CONNECTING;
 		break;
 	case STATE_CONNECTING:
 		r = connecting(cp);
-		if (r == RETURN_ERR) {
-			cp->execing = false;
-			return cleanAndRetFalse(cleanup);
-		} else if (r == RETURN_AGAIN) {
-			nstate = STATE_CONNECTING;
-			nacts = ACT_OUTPUT;
-			nargs = args;
+		if (r == RETURN_ERR)
+			return clientFailed(cp);
+		else if (r == RETURN_AGAIN)
 			break;
-		}
 		assert(r == RETURN_DONE);
 		/* windows sucks. you can't trust SOL_ERROR being set to 0 *
 		 * meaning it is connected but select on write is ok       */
-		nstate = STATE_WRITE;
-		nacts = ACT_OUTPUT;
-		nargs = args;
+		connp->state = STATE_WRITE;
 		break;
-	case STATE_WRITE:		/* args is toWriteStr */
-		r = writeRequest(cp, &args);
-		if (r == RETURN_ERR) {
-			cp->execing = false;
-			return cleanAndRetFalse(cleanup);
-		} else if (r == RETURN_AGAIN) {
-			nstate = STATE_WRITE;
-			nacts = ACT_OUTPUT;
-			nargs = args;
-			if (PyList_Append(cleanup, args)) {
-				cp->execing = false;
-				return false;
-			}
-			break;
-		}
-		assert (r == RETURN_DONE);
-		args = PyString_FromString("");
-		if ((args == NULL)
-		or (PyList_Append(cleanup, args))) {
-				cp->execing = false;
-			return false;
-		}
-	case STATE_READ_HEADER:		/* args is buff */
-		head = args;
-		body = NULL;
-		r = readHeader(cp, &head, &body, &blen, &chunked);
-		if (r == RETURN_ERR) {
-			cp->execing = false;
-			return cleanAndRetFalse(cleanup);
-		} else if (r == RETURN_AGAIN) {
-			nstate = STATE_READ_HEADER;
-			nacts = ACT_INPUT;
-			nargs = head;
-			if (PyList_Append(cleanup, head)) {
-				cp->execing = false;
-				return false;
-			}
-			break;
-		}
-		assert (r == RETURN_DONE);
-		/* If we are reading a chunked response, the body becomes *
-		 * the first chunk to be parsed and the new body is empty */
-		if (chunked)
-			args = Py_BuildValue("(S,s,i,S,i)",
-			                     head, "", blen, body, 1);
-		else
-			args = Py_BuildValue("(S,S,i,s,i)",
-			                     head, body, blen, "", 0);
-		if ((args == NULL)
-		or  (PyList_Append(cleanup, args))) {
-			cp->execing = false;
-			return cleanAndRetFalse(cleanup);
-		}
-		Py_DECREF(head);
-		Py_DECREF(body);
-	case STATE_READ_BODY:	/* args is (head, body, blen, chunk, chunked) */
-		unless (PyArg_ParseTuple(args, "SSlSi:execDispatchReadBody",
-		                         &head, &body, &blen,
-		                         &chunk, &chunked)) {
-			cp->execing = false;
-			return cleanAndRetFalse(cleanup);
-		}
-		if (chunked)
-			r = readChunks(cp, &body, &chunk);
-		else
-			r = readResponse(cp, &body, blen);
-		if (r == RETURN_ERR) {
-			cp->execing = false;
-			return cleanAndRetFalse(cleanup);
-		} else if (r == RETURN_AGAIN) {
-			nstate = STATE_READ_BODY;
-			nacts = ACT_INPUT;
-			nargs = Py_BuildValue("(O,O,i,O,i)", head, body, blen, chunk, chunked);
-			Py_DECREF(body);
-			if (chunked) {
-				Py_DECREF(chunk);
-			}
-			if (nargs == NULL) {
-				cp->execing = false;
-				return cleanAndRetFalse(cleanup);
-			}
-			if (PyList_Append(cleanup, nargs)) {
-				cp->execing = false;
-				return false;
-			}
-			break;
-		}
-		if (chunked) {
-			Py_DECREF(chunk);	/* we no longer need this */
+	default:
+		if (rpcSourceOutLen(sp) > 0
+		and writeRequest(cp) == RETURN_ERR)
+			return clientFailed(cp);
+		if (connp->state == STATE_WRITE) {
+			if (rpcSourceOutLen(sp) > 0)
+				break;
+			connp->state = STATE_READ_HEADER;
 		}
- 		cp->execing = false;
-		assert (r == RETURN_DONE);
-		Py_INCREF(head);	/* hack so concat doesn't fail */
-		PyString_Concat(&head, body);
-		Py_DECREF(body);
-		if (head == NULL)
-			return false;
-		if (rpcLogLevel >= 9) {
-			strReq = PyObject_Repr(head);
-			if (strReq == NULL)
-				return false;
-			rpcLogSrc(9, cp->src, "server response is %s",
-					PyString_AS_STRING(strReq));
-			Py_DECREF(strReq);
+		unless (rpcSourceRead(sp, &eof))
+			return clientFailed(cp);
+		/* the callbacks may queue more calls; they are left to us */
+		cp->dispatching = true;
+		r = RETURN_DONE;
+		while (cp->ncalls > 0 and connp->state >= STATE_READ_HEADER) {
+			r = readCall(cp, eof);
+			if (r != RETURN_DONE)
+				break;
 		}
-		memcpy(&cfunc, PyString_AS_STRING(pyfunc), sizeof(cfunc));
-		res = cfunc(cp, head, funcArgs);
-		(void)cleanAndRetFalse(cleanup);
-		unless (doKeepAlive(head, TYPE_RESP))
-			rpcClientClose(cp);
-		Py_DECREF(head);
-		return res;
+		cp->dispatching = false;
+		if (r == RETURN_ERR)
+			return clientFailed(cp);
+		break;
+	}
+	if (cp->ncalls == 0)
+		return true;
+	switch (connp->state) {
+	case STATE_CONNECT:		/* closed by the server */
+		nacts = ACT_IMMEDIATE;
+		break;
+	case STATE_CONNECTING:
+	case STATE_WRITE:
+		nacts = ACT_OUTPUT;
+		break;
 	default:
-		PyErr_SetString(rpcError, "unknown state to execDispatch");
-		return cleanAndRetFalse(cleanup);
+		nacts = ACT_INPUT;
+		if (rpcSourceOutLen(sp) > 0)
+			nacts |= ACT_OUTPUT;
+		break;
 	}
 	sp->actImp = nacts;
 	sp->func = execDispatch;
-	sp->params = Py_BuildValue("(O,i,O,O,O)",
-			cp, nstate, pyfunc, funcArgs, nargs);
-	(void)cleanAndRetFalse(cleanup);
-	if (sp->params == NULL)
-		return false;
+	sp->params = params;
+	Py_INCREF(params);
 	unless (rpcDispAddSource(dp, sp))
 		return false;
 
@@ -375,24 +298,179 @@ execDispatch(rpcDisp *dp, rpcSource *sp, int actions, PyObject *params)
 
 
 /*
- * Doubly DECREF a list and return false
+ * Read the response to the oldest outstanding call from what is in the
+ * input buffer, and hand it to the call's callback.  A connection the
+ * server does not keep alive is closed first, so that the callback may
+ * execute again; the calls pipelined behind the response are then
+ * failed, each through its own callback.
  */
-bool cleanAndRetFalse(PyObject *listp)
+static int
+readCall(rpcClient *cp, bool eof)
 {
-	int		i;
-	PyObject	*item;
+	rpcSource	*sp;
+	rpcConn		*connp;
+	rpcCall		call,
+			*lost;
+	PyObject	*body,
+			*strReq;
+	bool		res;
+	int		r,
+			nlost;
 
-	assert(PyList_Check(listp));
-	for (i = 0; i < PyList_GET_SIZE(listp); ++i) {
-		item = PyList_GET_ITEM(listp, i);
-		Py_DECREF(item);
+	sp = cp->src;
+	connp = &sp->conn;
+	if (connp->state == STATE_READ_HEADER) {
+		r = readHeader(cp, eof, &connp->hlen, &connp->blen,
+				&connp->chunked);
+		if (r != RETURN_DONE)
+			return r;
+		/* The header stays at the front of the input buffer; a *
+		 * chunked body is de-chunked in place behind it        */
+		connp->state = STATE_READ_BODY;
 	}
-	Py_DECREF(listp);
+	if (connp->chunked)
+		r = readChunks(cp, eof, connp->hlen, &body);
+	else
+		r = readResponse(cp, eof, connp->hlen, connp->blen, &body);
+	if (r != RETURN_DONE)
+		return r;
+	if (rpcLogLevel >= 9) {
+		strReq = PyObject_Repr(body);
+		if (strReq == NULL)
+			return RETURN_ERR;
+		rpcLogSrc(9, sp, "server response is %s",
+				PyString_AS_STRING(strReq));
+		Py_DECREF(strReq);
+	}
+	call = cp->calls[0];
+	cp->ncalls--;
+	memmove(cp->calls, cp->calls + 1, cp->ncalls * sizeof(*cp->calls));
+	cp->execing = (cp->ncalls > 0);
+	lost = NULL;
+	nlost = 0;
+	if (sp->http.keepAlive) {
+		rpcHttpInit(&sp->http, TYPE_RESP);
+		connp->state = STATE_READ_HEADER;
+	} else {
+		nlost = clientTakeCalls(cp, &lost);
+		rpcClientClose(cp);
+	}
+	res = call.func(cp, body, call.funcArgs);
+	Py_DECREF(call.funcArgs);
+	Py_DECREF(body);
+	if (nlost > 0) {
+		rpcLogSrc(3, sp, "connection closed with %d calls outstanding",
+			nlost);
+		res = clientFailCalls(cp, lost, nlost,
+				"connection closed before the response") and res;
+	}
+
+	return res ? RETURN_DONE : RETURN_ERR;
+}
+
+
+/*
+ * A call failed: the connection is in no state to carry on, so it is
+ * closed and the calls pipelined on it are failed, each through its
+ * own callback, with the error as the fault string.  The error is then
+ * left set for the client's onErr handler.
+ */
+static bool
+clientFailed(rpcClient *cp)
+{
+	PyObject	*exc,
+			*v,
+			*tb,
+			*str;
+	rpcCall		*calls;
+	int		ncalls;
+
+	rpcClientClose(cp);
+	ncalls = clientTakeCalls(cp, &calls);
+	if (ncalls == 0)
+		return false;
+	PyErr_Fetch(&exc, &v, &tb);
+	str = PyObject_Str(v ? v : exc);
+	PyErr_Restore(exc, v, tb);
+	(void)clientFailCalls(cp, calls, ncalls,
+			str ? PyString_AS_STRING(str) : "connection failed");
+	Py_XDECREF(str);
 
 	return false;
 }
 
 
+/*
+ * Take the outstanding calls off the client, so that new ones can be
+ * queued while they are failed; returns how many there were
+ */
+static int
+clientTakeCalls(rpcClient *cp, rpcCall **callsp)
+{
+	int		ncalls;
+
+	ncalls = cp->ncalls;
+	*callsp = cp->calls;
+	cp->calls = NULL;
+	cp->ncalls = 0;
+	cp->callall = 0;
+	cp->execing = false;
+
+	return ncalls;
+}
+
+
+/*
+ * Hand each call a fault response carrying why, and free calls.  An
+ * error that is already set is kept aside meanwhile and wins over any
+ * the callbacks raise; of those the first is kept.  False if an error
+ * is set when done.
+ */
+static bool
+clientFailCalls(rpcClient *cp, rpcCall *calls, int ncalls, char *why)
+{
+	PyObject	*addInfo,
+			*resp,
+			*exc,
+			*v,
+			*tb;
+	int		i;
+
+	PyErr_Fetch(&exc, &v, &tb);
+	addInfo = PyDict_New();
+	for (i = 0; i < ncalls; ++i) {
+		resp = NULL;
+		if (addInfo != NULL)
+			resp = buildFault(-1, why, addInfo, cp->encFlags);
+		unless (resp and calls[i].func(cp, resp, calls[i].funcArgs)) {
+			if (exc == NULL)
+				PyErr_Fetch(&exc, &v, &tb);
+			else
+				PyErr_Clear();
+		}
+		Py_XDECREF(resp);
+		Py_DECREF(calls[i].funcArgs);
+	}
+	Py_XDECREF(addInfo);
+	if (calls)
+		free(calls);
+	PyErr_Restore(exc, v, tb);
+
+	return exc == NULL;
+}
+
+
+static void
+clientDropCalls(rpcClient *cp)
+{
+	while (cp->ncalls > 0) {
+		cp->ncalls--;
+		Py_DECREF(cp->calls[cp->ncalls].funcArgs);
+	}
+	cp->execing = false;
+}
+
+
 bool
 clientConnect(rpcClient *cp)
 {
@@ -419,7 +497,7 @@ clientConnect(rpcClient *cp)
 		return false;
 	}
 #endif /* MSWINDOWS */
-	cp->src->fd = fd;
+	rpcSourceSetFd(cp->src, fd);
 
 	sp = cp->src;
 	hp = gethostbyname(cp->host);
@@ -482,13 +560,12 @@ rpcClientNbExecute(
 			*addInfo,
 			*strReq;
 	rpcSource	*sp;
+	rpcCall		*calls;
+	int		nall;
+	bool		fresh;
 
-	
-	if (cp->execing) {
-		PyErr_SetString(rpcError, "client already executing");
-		return false;
-	}
 	sp = cp->src;
+	fresh = not cp->execing;
 	if (rpcLogLevel >= 5) {
 		strReq = PyObject_Str(params);
 		if (strReq == NULL)
@@ -509,7 +586,7 @@ rpcClientNbExecute(
 	if ((pyHost == NULL)
 	or  (PyDict_SetItemString(addInfo, "Host", pyHost)))
 		return false;
-	req = buildRequest(cp->url, method, params, addInfo);
+	req = buildRequest(cp->url, method, params, addInfo, cp->encFlags);
 	Py_DECREF(pyHost);
 	Py_DECREF(addInfo);
 	if (req == NULL)
@@ -522,22 +599,45 @@ rpcClientNbExecute(
 				PyString_AS_STRING(strReq));
 		Py_DECREF(strReq);
 	}
-	if (sp->fd < 0)
-		sp->params = Py_BuildValue("(O,i,s#,O,O)", cp, STATE_CONNECT,
-					&func, sizeof(func), funcArgs, req);
-	else
-		sp->params = Py_BuildValue("(O,i,s#,O,O)", cp, STATE_WRITE,
-					&func, sizeof(func), funcArgs, req);
-	Py_DECREF(req);
-	if (sp->params == NULL)
+	if (cp->ncalls == cp->callall) {
+		nall = max(2 * cp->callall, 4);
+		calls = ralloc(cp->calls, nall * sizeof(*calls));
+		if (calls == NULL) {
+			Py_DECREF(req);
+			return false;
+		}
+		cp->calls = calls;
+		cp->callall = nall;
+	}
+	if (fresh) {
+		rpcHttpInit(&sp->http, TYPE_RESP);
+		rpcSourceClearOut(sp);
+		rpcSourceClearConn(sp);
+		sp->conn.state = (sp->fd < 0) ? STATE_CONNECT : STATE_WRITE;
+	}
+	unless (rpcSourceQueue(sp, req)) {
+		Py_DECREF(req);
 		return false;
+	}
+	Py_DECREF(req);
+	cp->calls[cp->ncalls].func = func;
+	cp->calls[cp->ncalls].funcArgs = funcArgs;
+	Py_INCREF(funcArgs);
+	cp->ncalls++;
+	cp->execing = true;
+	if (cp->dispatching)		/* execDispatch() will see to it */
+		return true;
+	if (not fresh and rpcDispDelSource(cp->disp, sp)) {
+		/* waiting on earlier calls; write this one out too */
+		sp->actImp = ACT_IMMEDIATE;
+		return rpcDispAddSource(cp->disp, sp);
+	}
+	sp->params = (PyObject *)cp;
+	Py_INCREF(cp);
 	sp->actImp = ACT_IMMEDIATE;
 	sp->func = execDispatch;
-	unless (rpcDispAddSource(cp->disp, sp))
-		return false;
-	cp->execing = true;
 
-	return true;
+	return rpcDispAddSource(cp->disp, sp);
 }
 
 
@@ -606,35 +706,45 @@ rpcClientExecute(
 	bool		timedOut;
 	rpcDisp		*tmp;
 	PyObject	*result,
-			*response,
+			*holder,
 			*tuple;
 
+	if (cp->execing) {
+		PyErr_SetString(rpcError, "client already executing");
+		return NULL;
+	}
+	holder = PyList_New(0);
+	if (holder == NULL)
+		return NULL;
 	tmp = cp->disp;
 	cp->disp = rpcDispNew();
 	if (cp->disp == NULL) {
 		cp->disp = tmp;
+		Py_DECREF(holder);
 		return NULL;
 	}
 	unless ((rpcClientNbExecute(cp, method, params, executed,
-					Py_None, name, pass))
+					holder, name, pass))
 	and     (rpcDispWork(cp->disp, timeout, &timedOut))) {
 		Py_DECREF(cp->disp);
 		cp->disp = tmp;
-		cp->execing = false;
+		clientDropCalls(cp);
+		Py_DECREF(holder);
 		return NULL;
 	}
 	Py_DECREF((PyObject *)cp->disp);
 	cp->disp = tmp;
-	if (timedOut) {
-		cp->execing = false;
+	if (timedOut) {		/* the response may yet turn up */
+		clientDropCalls(cp);
+		rpcClientClose(cp);
+		Py_DECREF(holder);
 		set_errno(ETIMEDOUT);
 		PyErr_SetFromErrno(rpcError);
 		return NULL;
 	}
-	response = cp->src->params;
-	cp->src->params = NULL;
-	tuple = parseResponse(response);
-	Py_DECREF(response);
+	assert(PyList_GET_SIZE(holder) == 1);
+	tuple = parseResponse(PyList_GET_ITEM(holder, 0));
+	Py_DECREF(holder);
 	if (tuple == NULL)
 		return NULL;
 	assert(PyTuple_Check(tuple));
@@ -647,383 +757,163 @@ rpcClientExecute(
 }
 
 
+/*
+ * the callback of a blocking execute; args is a list to put resp in
+ */
 static bool
 executed(rpcClient *cp, PyObject *resp, PyObject *args)
 {
-	cp->src->params = resp;
-	Py_INCREF(resp);
-
-	return true;
+	return PyList_Append(args, resp) == 0;
 }
 
 
 /*
- * write some of a request
+ * write some of the request queued on the client's source
  */
 static int
-writeRequest(rpcClient *cp, PyObject **toWritep)
+writeRequest(rpcClient *cp)
 {
-	PyObject	*toWrite;
-	int		nb,
-			slen;
-
-	toWrite = *toWritep;
-	slen = PyString_GET_SIZE(toWrite);
-	nb = write(cp->src->fd, PyString_AS_STRING(toWrite), slen);
-	rpcLogSrc(7, cp->src, "client wrote %d of %d bytes", nb, slen);
-	if (nb < 0 and isBlocked(get_errno()))
-		nb = 0;
-	if (nb < 0) {
-		PyErr_SetFromErrno(rpcError);
+	long		left;
+	bool		done;
+
+	left = rpcSourceOutLen(cp->src);
+	unless (rpcSourceWrite(cp->src, &done))
 		return RETURN_ERR;
-	} else if (nb == slen) {
-		rpcLogSrc(7, cp->src, "client finished writing request");
-		return RETURN_DONE;
-	} else {
-		assert(slen > nb);
-		toWrite = PyString_FromStringAndSize(
-			PyString_AS_STRING(toWrite) + nb, slen - nb);
-		if (toWrite == NULL)
-			return RETURN_ERR;
-		*toWritep = toWrite;
+	rpcLogSrc(7, cp->src, "client wrote %ld of %ld bytes",
+		left - rpcSourceOutLen(cp->src), left);
+	unless (done)
 		return RETURN_AGAIN;
-	}
+	rpcLogSrc(7, cp->src, "client finished writing request");
+
+	return RETURN_DONE;
 }
 
 
 /*
- * Parse a header string to extract relevant information from it.
- *
- * The unparsed header comes in through **headp.  The header is
- * parsed, and separated into the body (*body), while several imporant
- * data points are extracted from it.  blen is the length of the body
- * if Content-length is specified, otherwise it is -1.  Chunked is
- * whether or not the encoding is chunked.
+ * Feed the client's input buffer to its header parser and extract the
+ * relevant information once the header is complete.
  *
- * Note: if this function returns RETURN_AGAIN, the caller takes ownership
- * of the headp pointer ONLY and must DECREF it.  If RETURN_DONE is
- * returned, the caller takes ownership of BOTH the header AND body and
- * must DECREF both of them.  If RETURN_ERR is returned, no ownership is
- * transferred.
+ * hlen is the length of the header including the blank line.  blen is
+ * the length of the body if Content-length is specified, otherwise it
+ * is -1.  Chunked is whether or not the encoding is chunked.  Nothing
+ * is consumed from the buffer.
  */
-static bool
+static int
 readHeader(
 	rpcClient	*client,
-	PyObject	**headp,
-	PyObject	**bodyp,
+	bool		eof,
+	long		*hlen,
 	long		*blen,
 	bool		*chunked
 )
 {
-	PyObject	*buff;
-	bool		eof;
-	char		*hp,		/* start of header */
-			*bp,		/* start of body */
-			*cp,		/* current position */
-			*ep,		/* end of string read */
-			*lp,		/* start of content-length value */
-			*te;		/* start of transfer-encoding */
-
-	*chunked = false;
-	buff = *headp;
-	unless (nbRead(client->src->fd, &buff, &eof))
+	rpcHttpHead	*hp;
+
+	hp = &client->src->http;
+	rpcLogSrc(9, client->src, "client read %ld bytes of header and body",
+			rpcSourceInLen(client->src));
+	switch (rpcHttpParse(hp, rpcSourceInData(client->src),
+				rpcSourceInLen(client->src))) {
+	case HTTP_ERR:
 		return RETURN_ERR;
-	bp = NULL;
-	lp = NULL;
-	te = NULL;
-	hp = PyString_AS_STRING(buff);
-	ep = hp + PyString_GET_SIZE(buff);
-	rpcLogSrc(9, client->src, "client read %d bytes of header and body",
-			(ep - hp));
-	for (cp = hp; (bp == NULL) and (cp < ep); ++cp) {
-		if ((ep - cp > 16)
-		and (strncasecmp(cp, "Content-length: ", 16) == 0))
-			lp = cp + 16;
-		if ((ep - cp > 19)
-		and (strncasecmp(cp, "Transfer-Encoding: ", 19) == 0))
-			te = cp + 19;
-		if ((ep - cp > 4)
-		and (strncmp(cp, "\r\n\r\n", 4) == 0))
-			bp = cp + 4;
-		if ((ep - cp > 2)
-		and (strncmp(cp, "\n\n", 2) == 0))
-			bp = cp + 2;
-	}
-	if (bp == NULL) {
+	case HTTP_AGAIN:
 		if (eof) {
-			Py_DECREF(buff);
 			PyErr_SetString(rpcError, "got EOS while reading");
-			return false;
+			return RETURN_ERR;
 		}
-		*headp = buff;
 		return RETURN_AGAIN;
 	}
-	if ((te != NULL)
-	and (strncasecmp(te, "chunked\r\n", 9) == 0)) {
-		*chunked = true;
-		*blen = -1;
-	} else if (lp == NULL) {
+	*chunked = hp->chunked;
+	*blen = hp->chunked ? -1 : hp->clen;
+	if (*blen < 0 and not *chunked) {
 		fprintf(rpcLogger, "No Content-length parameter found\n");
 		fprintf(rpcLogger, "reading to EOF...\n");
-		*blen = -1;
-	} else unless (decodeActLong(&lp, ep, blen)) {
-		Py_DECREF(buff);
-		PyErr_SetString(rpcError, "invalid Content-length");
-		return RETURN_ERR;
+		hp->keepAlive = false;
 	}
 	rpcLogSrc(9, client->src, "client finished reading header");
 	rpcLogSrc(9, client->src,
 	         "client bodylen should be %ld %s chunked mode",
 	         *blen, *chunked ? "in" : "not in");
-	*headp = PyString_FromStringAndSize(hp, bp-hp);
-	*bodyp = PyString_FromStringAndSize(bp, ep-bp);
-	if (*headp == NULL || *bodyp == NULL)
-		return RETURN_ERR;
-	Py_DECREF(buff);
+	*hlen = hp->hlen;
 
 	return (RETURN_DONE);
 }
 
 
 /*
- * IMPORTANT NOTE:
- * If this method returns anything but RETURN_ERR, it is the responsibility
- * of the caller takes ownership of the new body value and must DECREF it
- * appropriately.
+ * Once the header (hlen bytes) and the body are in the input buffer,
+ * set *respp to a string of the whole response and consume it.
  */
-static bool
-readResponse(rpcClient *cp, PyObject **bodyp, long blen)
+static int
+readResponse(rpcClient *cp, bool eof, long hlen, long blen, PyObject **respp)
 {
-	PyObject	*body;
-	bool		eof;
 	long		slen;
 
-	body = *bodyp;
-	unless (nbRead(cp->src->fd, &body, &eof))
-		return false;
-	slen = PyString_GET_SIZE(body);
+	slen = rpcSourceInLen(cp->src) - hlen;
 	rpcLogSrc(9, cp->src, "client read %ld of %d bytes of lbody",
 	          slen, blen);
 	if (blen < 0) {		/* we need to read to EOF */
-		*bodyp = body;
-		if (eof)
-			return RETURN_DONE;
-		else
+		unless (eof)
 			return RETURN_AGAIN;
-	}
-	if (slen >= blen) {
-		*bodyp = body;
-		return RETURN_DONE;
-	} else if (eof) {
-		Py_DECREF(body);
-		PyErr_SetString(rpcError, "unexpected EOF while reading");
-		return RETURN_ERR;
-	} else {
-		*bodyp = body;
-		return RETURN_AGAIN;
-	}
-}
-
-
-/*
- *
- * IMPORTANT NOTE:
- * If this method returns anything but RETURN_ERR, it is the responsibility
- * of the caller takes ownership of the new body and chunk values and must
- * DECREF them appropriately.
- *
- * We go through a bit of a song and dance to make sure that the reference
- * counting works out just right.  Note that XDECREF is used because we want
- * to check if the value is NULL first.
- */
-static bool
-readChunks(rpcClient *client, PyObject **bodyp, PyObject **chunkp)
-{
-	PyObject	*obody,
-			*ochunk;
-	bool		eof;
-	int		r;
-
-	unless (nbRead(client->src->fd, chunkp, &eof))
-		return RETURN_ERR;
-	obody = NULL;
-	ochunk = *chunkp;
-	while (true) {
-		r = processChunk(client, bodyp, chunkp);
-		Py_XDECREF(obody);
-		Py_XDECREF(ochunk);
-		if (r != RETURN_AGAIN)
-			break;
-		obody = *bodyp;
-		ochunk = *chunkp;
-	}
-	if (r == RETURN_READ_MORE) {
+		blen = slen;
+	} else if (slen < blen) {
 		if (eof) {
-			Py_XDECREF(obody);
-			Py_XDECREF(ochunk);
 			PyErr_SetString(rpcError, "unexpected EOF while reading");
 			return RETURN_ERR;
 		}
 		return RETURN_AGAIN;
 	}
-	return r;
+	*respp = PyString_FromStringAndSize(rpcSourceInData(cp->src),
+						hlen + blen);
+	if (*respp == NULL)
+		return RETURN_ERR;
+	rpcSourceConsume(cp->src, hlen + blen);
+
+	return RETURN_DONE;
 }
 
 
 /*
- * Read a single "chunked" response.
- *
- * A chunk consists of a hexidecimal length followed by that much data
- * followed by a CR LF i.e.:
- *
- * "18
- * abcdefghijklmnopqrstuvwxyz
- * "
- * (where the LF's are really CR-LF's)
- *
- * The last chunk is marked by a length of 0, and this can be followed by
- * a "trailer" which ends with a single emtpy CR-LF line
- *
- * This method returns the usual callback values, but may also return
- * the value RETURN_READ_MORE which means we should return to the select()
- * loop and read more information.
- *
- * IMPORTANT NOTE:
- * If this method returns anything but RETURN_ERR, it is the responsibility
- * of the caller takes ownership of the new body and chunk values and must
- * DECREF them appropriately.
+ * De-chunk as much of a chunked body as has arrived, in place behind
+ * the header (hlen bytes) at the front of the input buffer; see
+ * rpcHttpDechunk().  After the last chunk, set *respp to a string of
+ * the header and the de-chunked body and consume them.
  */
 static int
-processChunk(rpcClient *client, PyObject **bodyp, PyObject **chunkp)
+readChunks(rpcClient *client, bool eof, long hlen, PyObject **respp)
 {
-	long		clen;		/* chunk length */
-	char		*sp,		/* pointer to the start of the chunk */
-			*bp,		/* pointer to the body of the chunk */
-			*ep;		/* pointer to the end of the chunk */
-	PyObject	*nbody,		/* new body */
-			*nchunk,	/* new chunk */
-			*append;	/* string to append */
-
-	bp = PyString_AS_STRING(*chunkp);
-	sp = bp;
-	ep = bp + PyString_GET_SIZE(*chunkp);
-	rpcLogSrc(9, client->src, "client processing chunk %s", sp);
-	while (true) {
-		if (bp+1 >= ep) {
-			Py_INCREF(*bodyp);
-			Py_INCREF(*chunkp);
-			return RETURN_READ_MORE;
-		}
-		if (strncmp(bp, "\r\n", 2) == 0) {
-			bp += 2;
-			break;
-		}
-		bp++;
-	}
-	unless (decodeActLongHex(&sp, bp, &clen)) {
-		PyErr_SetString(rpcError, "invalid size in chunk");
+	rpcChunks	*chp;
+	char		*data;
+	long		len;
+
+	chp = &client->src->http.chunks;
+	data = rpcSourceInData(client->src);
+	len = rpcSourceInLen(client->src) - hlen;
+	switch (rpcHttpDechunk(&client->src->http, data + hlen, &len)) {
+	case HTTP_ERR:
 		return RETURN_ERR;
-	}
-	rpcLogSrc(7, client->src, "chunk length is %ld", clen);
-	if ((ep-bp) < (long)(clen+strlen("\r\n"))) {
-		Py_INCREF(*bodyp);
-		Py_INCREF(*chunkp);
-		return RETURN_READ_MORE;
-	}
-	if (clen == 0) {
-		rpcLogSrc(7, client->src, "client reading footer", clen);
-		while (sp < ep) {
-			if (ep-sp >= 4 and strncmp(sp, "\r\n\r\n", 4) == 0) {
-				Py_INCREF(*bodyp);
-				Py_INCREF(*chunkp);
-				return RETURN_DONE;
-			}
-			sp++;
+	case HTTP_AGAIN:
+		rpcSourceTruncate(client->src, hlen + len);
+		rpcLogSrc(9, client->src, "client de-chunked %ld body bytes",
+				chp->body);
+		if (eof) {
+			PyErr_SetString(rpcError, "unexpected EOF while reading");
+			return RETURN_ERR;
 		}
-		Py_INCREF(*bodyp);
-		Py_INCREF(*chunkp);
-		return RETURN_READ_MORE;
-	}
-	unless (strncmp(bp+clen, "\r\n", 2) == 0) {
-		PyErr_SetString(rpcError, "chunk did not end in CR LF");
-		return RETURN_ERR;
+		return RETURN_AGAIN;
 	}
-	rpcLogSrc(7, client->src, "client finished reading chunk", clen);
-	append = PyString_FromStringAndSize(bp, clen);
-	if (append == NULL)
+	rpcSourceTruncate(client->src, hlen + len);
+	rpcLogSrc(7, client->src, "client finished reading %ld chunked bytes",
+			chp->body);
+	*respp = PyString_FromStringAndSize(data, hlen + chp->body);
+	if (*respp == NULL)
 		return RETURN_ERR;
-	nbody = *bodyp;
-	Py_INCREF(nbody);
-	PyString_Concat(&nbody, append);
-	Py_DECREF(append);
-	sp = bp + clen + strlen("\r\n");	/* new chunk start */
-	nchunk = PyString_FromStringAndSize(sp, ep-sp);
-	if (nchunk == NULL)
-		return RETURN_ERR;
-	*bodyp = nbody;
-	*chunkp = nchunk;
-	return RETURN_AGAIN;
-}
+	rpcSourceConsume(client->src, hlen + chp->body);
 
-
-/*
- * returns number of bytes read, 
- *
- * NOTE: that buffpp ownership is given to the caller, and it is it's
- * responsiblity to DECREF it.
- */
-static bool
-nbRead(int fd, PyObject **buffpp, bool *eof)
-{
-	PyObject	*buffp;
-	ulong		bytesAv,
-			olen,
-			slen;
-	char		*cp;
-	int		res;
-	
-	*eof = false;
-	buffp = *buffpp;
-	assert(PyString_Check(buffp));
-	olen = PyString_GET_SIZE(buffp);
-	slen = olen;
-	bytesAv = slen + READ_SIZE;
-	cp = alloc(bytesAv);
-	if (cp == NULL)
-		return false;
-	memcpy(cp, PyString_AS_STRING(buffp), slen);
-	while (true) {
-		if (slen + READ_SIZE > bytesAv) {
-			bytesAv = max(bytesAv * 2, slen + READ_SIZE);
-			cp = ralloc(cp, bytesAv);
-			if (cp == NULL)
-				return false;
-		}
-		res = read(fd, cp + slen, READ_SIZE);
-		if (res > 0)
-			slen += res;
-		else if (res == 0) {
-			*eof = true;
-			break;
-		} else if (res < 0) {
-			 if (isBlocked(get_errno()))
-				break;
-			else {		/* bad error */
-				free(cp);
-				PyErr_SetFromErrno(rpcError);
-				return false;
-			}
-		}
-	}
-	buffp = PyString_FromStringAndSize(cp, slen);
-	if (buffp == NULL)
-		return false;
-	*buffpp = buffp;
-	free(cp);
-
-	return true;
+	return RETURN_DONE;
 }
 
+
 /*
  * Module procedure: execute a command on a rpc Server
  */
@@ -1065,7 +955,8 @@ pyRpcClientExecute(PyObject *self, PyObject *args)
 
 
 /*
- * queue up a function for later execution
+ * queue up a function for later execution; it is called with owner, the
+ * client itself if it is not given, the response and extArgs
  */
 static PyObject *
 pyRpcNbClientExecute(PyObject *self, PyObject *args)
@@ -1074,7 +965,8 @@ pyRpcNbClientExecute(PyObject *self, PyObject *args)
 	char		*method;
 	PyObject	*params,
 			*extArgs,
-			*pyfunc;
+			*pyfunc,
+			*owner;
 	PyObject	*pyName,
 			*pyPass;
 	char		*name,
@@ -1082,9 +974,12 @@ pyRpcNbClientExecute(PyObject *self, PyObject *args)
 	bool		res;
 
 	cp = (rpcClient *)self;
-	unless (PyArg_ParseTuple(args, "sOOOOO", &method, &params,
-				&pyfunc, &extArgs, &pyName, &pyPass))
+	owner = self;
+	unless (PyArg_ParseTuple(args, "sOOOOO|O", &method, &params,
+				&pyfunc, &extArgs, &pyName, &pyPass, &owner))
 		return NULL;
+	unless (PyCallable_Check(pyfunc))
+		return setPyErr("callback must be callable");
 	unless (PySequence_Check(params)) {
 		PyErr_SetString(rpcError, "execute params must be a sequence");
 		return NULL;
@@ -1101,8 +996,8 @@ pyRpcNbClientExecute(PyObject *self, PyObject *args)
 		pass = PyString_AS_STRING(pyPass);
 	else
 		return setPyErr("pass must be a string or None");
-	extArgs = Py_BuildValue("(O,O)", pyfunc, extArgs);
-	if (params == NULL)
+	extArgs = Py_BuildValue("(O,O,O)", pyfunc, extArgs, owner);
+	if (extArgs == NULL)
 		return NULL;
 	res = rpcClientNbExecute(cp, method, params, pyClientCallback,
 				extArgs, name, pass);
@@ -1118,24 +1013,21 @@ pyRpcNbClientExecute(PyObject *self, PyObject *args)
 static	bool
 pyClientCallback(rpcClient *cp, PyObject *resp, PyObject *args)
 {
-	PyObject	*params,
-			*pyfunc,
+	PyObject	*pyfunc,
 			*extArgs,
+			*owner,
 			*res;
 
-	unless (PyArg_ParseTuple(args, "OO:pyClientCallback",
-					&pyfunc, &extArgs)) {
-		return false;
-	}
-
+	assert(PyTuple_Check(args));
+	assert(PyTuple_GET_SIZE(args) == 3);
+	pyfunc = PyTuple_GET_ITEM(args, 0);
+	extArgs = PyTuple_GET_ITEM(args, 1);
+	owner = PyTuple_GET_ITEM(args, 2);
 	assert(PyCallable_Check(pyfunc));
-	params = Py_BuildValue("(O,O,O)", cp, resp, extArgs);
-	if (params == NULL)
-		return false;
-	res = PyObject_CallObject(pyfunc, params);
-	Py_DECREF(params);
+	res = PyObject_CallFunctionObjArgs(pyfunc, owner, resp, extArgs, NULL);
 	unless (res)
 		return false;
+	Py_DECREF(res);
 
 	return true;
 }
@@ -1187,6 +1079,28 @@ pyRpcClientSetOnErr(PyObject *self, PyObject *args)
 }
 
 
+/*
+ * Turn compact (unindented) encoding of requests on or off
+ */
+static PyObject *
+pyRpcClientSetCompact(PyObject *self, PyObject *args)
+{
+	rpcClient	*cp;
+	int		compact;
+
+	cp = (rpcClient *)self;
+	unless (PyArg_ParseTuple(args, "i", &compact))
+		return NULL;
+	if (compact)
+		cp->encFlags |= ENC_COMPACT;
+	else
+		cp->encFlags &= ~ENC_COMPACT;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
 /*
  * Set a handler for errors on the client
  */
@@ -1229,6 +1143,7 @@ static PyMethodDef pyRpcClientMethods[] = {
 	{ "close",	(PyCFunction)pyRpcClientClose,		1,	0 },
 	{ "execute",	(PyCFunction)pyRpcClientExecute,	1,	0 },
 	{ "nbexecute",	(PyCFunction)pyRpcNbClientExecute,	1,	0 },
+	{ "setCompact",	(PyCFunction)pyRpcClientSetCompact,	1,	0 },
 	{ "setOnErr",	(PyCFunction)pyRpcClientSetOnErr,	1,	0 },
 	{ "work",	(PyCFunction)pyRpcClientWork,		1,	0 },
 	{ NULL,		NULL},
@@ -19,17 +19,42 @@ extern	PyTypeObject	rpcClientType;
 
 
 
+struct _client;			/* to appease the compiler gods */
+
+
 /*
- * A new xmlrpc client
+ * a call whose response has not come in yet
  */
 typedef struct {
+	bool		(*func)(	/* called with the response */
+				struct _client	*cp,
+				PyObject	*resp,
+				PyObject	*funcArgs
+			);
+	PyObject	*funcArgs;	/* extra args for func */
+} rpcCall;
+
+
+/*
+ * A new xmlrpc client
+ *
+ * Calls may be queued while earlier ones are still outstanding; their
+ * requests are pipelined on the one connection and the responses,
+ * which come back in the same order, are matched up with calls.
+ */
+typedef struct _client {
 	PyObject_HEAD			/* python standard */
 	char		*host;
 	char		*url;
 	int		port;
 	rpcDisp		*disp;
 	rpcSource	*src;
-	bool		execing;
+	bool		execing,	/* are any calls outstanding? */
+			dispatching;	/* is a response being handled? */
+	int		encFlags,	/* ENC_* flags for requests */
+			ncalls,		/* outstanding calls */
+			callall;	/* size of calls */
+	rpcCall		*calls;		/* oldest first */
 } rpcClient;
 
 
@@ -40,6 +65,12 @@ rpcClient	*rpcClientNewFromServer(
 			char		*url,
 			rpcServer	*servp
 		);
+rpcClient	*rpcClientNewFromDisp(
+			char		*host,
+			int		port,
+			char		*url,
+			rpcDisp		*disp
+		);
 void		rpcClientDealloc(rpcClient *cp);
 bool		rpcClientNbExecute(
 			rpcClient	*cp,
@@ -63,6 +94,7 @@ PyObject	*rpcClientExecute(
 			char		*pass
 		);
 void		rpcClientClose(rpcClient *cp);
+void		rpcClientAbandon(rpcClient *cp);
 
 
 #endif /* _RPCCLIENT_H_ */
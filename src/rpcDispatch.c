@@ -5,7 +5,6 @@
 
 
 #include <assert.h>
-#include <math.h>
 #include "xmlrpc.h"
 #include "rpcInternal.h"
 
@@ -22,10 +21,15 @@
 
 
 #define	INIT_SOURCES	64
+#define	INIT_READY	64
 
 
 static	bool		dispNextEv(rpcDisp *dp, double timeOut);
-static	int		dispHandleError(rpcSource *srcp);
+static	bool		dispHasSource(rpcDisp *dp, rpcSource *sp);
+static	bool		dispGrowEvs(rpcDispEv **evs, uint *all, uint need);
+static	void		dispDropEvs(rpcDispEv *evs, uint from, uint to);
+static	bool		dispWatch(rpcDisp *dp, rpcSource *sp);
+static	void		dispUnwatch(rpcDisp *dp, rpcSource *sp);
 static	double		get_time(void);
 
 
@@ -45,6 +49,17 @@ rpcDispNew(void)
 	if (dp->srcs == NULL)
 		return NULL;
 	memset(dp->srcs, 0, dp->salloc * sizeof(*dp->srcs));
+	dp->poller = rpcPollerNew();
+	if (dp->poller == NULL)
+		return NULL;
+	dp->nready = 0;
+	dp->rall = INIT_READY;
+	dp->ready = alloc(dp->rall * sizeof(*dp->ready));
+	dp->nimm = 0;
+	dp->iall = INIT_READY;
+	dp->imms = alloc(dp->iall * sizeof(*dp->imms));
+	if (dp->ready == NULL or dp->imms == NULL)
+		return NULL;
 
 	return dp;
 }
@@ -55,9 +70,14 @@ rpcDispClear(rpcDisp *dp)
 {
 	uint	i;
 
-	for (i = 0; i < dp->scard; ++i)
+	for (i = 0; i < dp->scard; ++i) {
+		dispUnwatch(dp, dp->srcs[i]);
+		dp->srcs[i]->slot = -1;
 		Py_DECREF(dp->srcs[i]);
+	}
 	dp->scard = 0;
+	dispDropEvs(dp->imms, 0, dp->nimm);
+	dp->nimm = 0;
 }
 
 
@@ -68,6 +88,14 @@ rpcDispDealloc(rpcDisp *dp)
 		rpcDispClear(dp);
 		free(dp->srcs);
 	}
+	if (dp->poller)
+		rpcPollerFree(dp->poller);
+	if (dp->ready) {
+		dispDropEvs(dp->ready, 0, dp->nready);
+		free(dp->ready);
+	}
+	if (dp->imms)
+		free(dp->imms);
 	PyObject_DEL(dp);
 }
 
@@ -83,11 +111,23 @@ rpcDispAddSource(rpcDisp *dp, rpcSource *sp)
 		memset(dp->srcs + dp->scard, 0,
 			(dp->salloc - dp->scard) * sizeof(*dp->srcs));
 	}
+	unless (dispWatch(dp, sp))
+		return false;
 	Py_INCREF(sp);
 	sp->id = dp->maxid;
+	sp->slot = dp->scard;
 	dp->srcs[dp->scard] = sp;
 	dp->scard++;
 	dp->maxid++;
+	if (sp->actImp & ACT_IMMEDIATE) {
+		unless (dispGrowEvs(&dp->imms, &dp->iall, dp->nimm + 1))
+			return false;
+		Py_INCREF(sp);
+		dp->imms[dp->nimm].src = sp;
+		dp->imms[dp->nimm].id = sp->id;
+		dp->imms[dp->nimm].acts = ACT_IMMEDIATE;
+		dp->nimm++;
+	}
 
 	return true;
 }
@@ -99,20 +139,19 @@ rpcDispAddSource(rpcDisp *dp, rpcSource *sp)
 bool
 rpcDispDelSource(rpcDisp *dp, rpcSource *sp)
 {
-	bool		found;
-	uint		i;
+	rpcSource	*last;
 
-	found = false;
-	for (i = 0; i < dp->scard; ++i)
-		if (found)
-			dp->srcs[i - 1] = dp->srcs[i];
-		else if (dp->srcs[i]->id == sp->id)
-			found = true;
-	if (not found)
+	unless (dispHasSource(dp, sp))
 		return false;
-	Py_DECREF(sp);
+	/* move the last source into the hole */
 	dp->scard--;
+	last = dp->srcs[dp->scard];
+	dp->srcs[sp->slot] = last;
+	last->slot = sp->slot;
 	dp->srcs[dp->scard] = NULL;
+	sp->slot = -1;
+	dispUnwatch(dp, sp);
+	Py_DECREF(sp);
 
 	return true;
 }
@@ -164,19 +203,26 @@ rpcDispActiveFds(rpcDisp *dp)
 
 /*
  * dispatch events on the active file descriptors for some length of time
+ *
+ * Each round, dispNextEv() pushes the sources that are ready onto
+ * dp->ready above "base"; they are popped again once their callbacks
+ * have run.  Callbacks may call back into rpcDispWork() on the same
+ * dispatcher, in which case the nested call uses the space above ours.
+ * Nothing is allocated unless the ready list has to grow.
  */
 bool
 rpcDispWork(rpcDisp *dp, double timeout, bool *timedOut)
 {
-	rpcSource	**srcs,
-			*sp,
-			tp;
+	bool		(*func)(rpcDisp *, rpcSource *, int, PyObject *);
+	rpcSource	*sp;
+	PyObject	*params;
 	double		ct;
-	bool		found;
 	uint		i,
-			j,
-			scard;
-	int		res;
+			base,
+			end;
+	int		acts,
+			res;
+	bool		ok;
 	
 	*timedOut = false;
 	ct = 0.0;			/* to appease the compiler */
@@ -189,49 +235,43 @@ rpcDispWork(rpcDisp *dp, double timeout, bool *timedOut)
 		dp->etime = ct + timeout;
 	} else
 		dp->etime = -1.0;
+	base = dp->nready;
 	while (dp->scard != 0) {
 		unless (dispNextEv(dp, (dp->etime - ct)))
 			return false;
-		scard = dp->scard;
-		srcs = alloc(scard * sizeof(*srcs));
-		memcpy(srcs, dp->srcs, scard * sizeof(*srcs));
-		for (i = 0; i < scard; ++i) {
-			sp = srcs[i];
-			unless (sp->actOcc)
-				continue;
-			found = false;
-			for (j = 0; dp->scard; ++j)
-				if (dp->srcs[j]->id == sp->id) {
-					found = true;
-					break;
-				}
+		end = dp->nready;
+		for (i = base; i < end; ++i) {
+			/* dp->ready may move if a callback makes it grow */
+			sp = dp->ready[i].src;
+			acts = dp->ready[i].acts;
 			/* if nothing changed out from under us... */
-			/* fix: otherwise log an error?? */
-			unless (found and (sp->actImp & sp->actOcc))
+			unless (dispHasSource(dp, sp)
+			and     sp->id == dp->ready[i].id
+			and     (sp->actImp & acts)) {
+				Py_DECREF(sp);
 				continue;
-
-			Py_INCREF(sp);
+			}
 			rpcDispDelSource(dp, sp);
-			/* copy the source so we can reset the original */
-			/* and call the copied version */
-			memcpy(&tp, sp, sizeof(*sp));
+			func = sp->func;
+			params = sp->params;
 			sp->id = -1;
 			sp->actImp = 0;
-			sp->actOcc = 0;
 			sp->params = NULL;
 			sp->func = NULL;
-			unless ((tp.func)(dp, sp, tp.actOcc, tp.params)) {
-				Py_DECREF(tp.params);
-				res = dispHandleError(sp);
+			ok = func(dp, sp, acts, params);
+			Py_XDECREF(params);
+			unless (ok) {
+				res = rpcDispHandleError(sp);
 				unless (res & ONERR_KEEP_WORK) {
 					Py_DECREF(sp);
+					dispDropEvs(dp->ready, i + 1, end);
+					dp->nready = base;
 					return false;
 				}
-			} else
-				Py_DECREF(tp.params);
+			}
 			Py_DECREF(sp);
 		}
-		free(srcs);
+		dp->nready = base;
 		if (dp->etime >= 0.0) {
 			ct = get_time();
 			if (ct < 0) {
@@ -249,8 +289,13 @@ rpcDispWork(rpcDisp *dp, double timeout, bool *timedOut)
 }
 
 
-static int
-dispHandleError(rpcSource *srcp)
+/*
+ * Hand the error that is set to the source's onErr handler and do what
+ * it asks; returns what it asked for.  Unless ONERR_KEEP_WORK is in
+ * there the error is left set, to go out of work().
+ */
+int
+rpcDispHandleError(rpcSource *srcp)
 {
 	int		(*cfunc)(rpcSource *),
 			res;
@@ -325,10 +370,8 @@ dispHandleError(rpcSource *srcp)
 		Py_DECREF(ntb);
 	}
 	if (res & ONERR_KEEP_DEF) {
-		if (srcp->doClose and srcp->fd >= 0) {
-			close(srcp->fd);
-			srcp->fd = -1;
-		}
+		if (srcp->doClose and srcp->fd >= 0)
+			rpcSourceClose(srcp);
 		rpcLogSrc(1, srcp, "Error from source");
 		PyErr_Restore(exc, v, tb);
 	} else if (!(res & ONERR_KEEP_WORK)) {
@@ -344,82 +387,116 @@ dispHandleError(rpcSource *srcp)
 
 
 /*
- * find the next events
+ * is the source currently registered with this dispatcher?
+ */
+static bool
+dispHasSource(rpcDisp *dp, rpcSource *sp)
+{
+	return (sp->slot >= 0
+	and     (uint)sp->slot < dp->scard
+	and     dp->srcs[sp->slot] == sp);
+}
+
+
+/*
+ * register the interest of a source with the poller
+ */
+static bool
+dispWatch(rpcDisp *dp, rpcSource *sp)
+{
+	unless (sp->actImp & (ACT_INPUT|ACT_OUTPUT|ACT_EXCEPT))
+		return true;
+	if (sp->actImp & ACT_IMMEDIATE)
+		return true;
+	if (sp->fd < 0) {
+		fprintf(rpcLogger, "BAD FD!!: %d\n", sp->fd);
+		return true;
+	}
+	unless (rpcPollerSet(dp->poller, sp->fd, sp->actImp, sp, sp->fdGen))
+		return false;
+	sp->pollFd = sp->fd;
+
+	return true;
+}
+
+
+static void
+dispUnwatch(rpcDisp *dp, rpcSource *sp)
+{
+	if (sp->pollFd >= 0) {
+		rpcPollerUnset(dp->poller, sp->pollFd, sp);
+		sp->pollFd = -1;
+	}
+}
+
+
+/*
+ * find the next events and push them onto the ready list
  */
 static bool
 dispNextEv(rpcDisp *dp, double timeout)
 {
 	rpcSource	*src;
-	struct timeval	tv;
-	fd_set		inFd,
-			outFd,
-			excFd;
-	int		i,
-			nEvents,
-			maxFd;
-	bool		hasImm;
-
-	maxFd = -1;
-	hasImm = false;
-	FD_ZERO(&inFd);
-	FD_ZERO(&outFd);
-	FD_ZERO(&excFd);
-
-	for (i = 0; i < (int)dp->scard; ++i) {
-		src = dp->srcs[i];
-		src->actOcc = 0;
-		unless (src->actImp)
-			continue;
-		if (src->actImp & ACT_IMMEDIATE) {
-			src->actOcc |= ACT_IMMEDIATE;
-			hasImm = true;
-		} else if (src->fd < 0) {
-			fprintf(rpcLogger, "BAD FD!!: %d\n", src->fd);
-			continue;
-		} else {
-			if (src->actImp & ACT_INPUT)
-				FD_SET((uint)src->fd, &inFd);
-			if (src->actImp & ACT_OUTPUT)
-				FD_SET((uint)src->fd, &outFd);
-			if (src->actImp & ACT_EXCEPT)
-				FD_SET((uint)src->fd, &excFd);
-			if (src->fd > maxFd)
-				maxFd = src->fd;
-		}
-	}
-	if (hasImm)
+	rpcPollerEv	*ev;
+	rpcDispEv	*rp;
+	int		i;
+
+	if (dp->nimm)
 		timeout = 0.0;
-	if (maxFd != -1) {
-		Py_BEGIN_ALLOW_THREADS
-		if (timeout < 0.0)
-			nEvents = select(maxFd+1, &inFd, &outFd, &excFd, NULL);
-		else {
-			tv.tv_sec = (int)floor(timeout);
-			tv.tv_usec = ((int)floor(1000000.0 *
-					(timeout-floor(timeout)))) % 1000000;
-			nEvents = select(maxFd+1, &inFd, &outFd, &excFd, &tv);
-		}
-		Py_END_ALLOW_THREADS
-		if (nEvents < 0) {
-			PyErr_SetFromErrno(rpcError);
-			return false;
-		}
-	}
-	for (i = 0; i < (int)dp->scard; ++i) {
-		src = dp->srcs[i];
-		if (src->actImp & ACT_IMMEDIATE)
-			continue;
-		if (FD_ISSET(src->fd, &inFd))
-			src->actOcc |= ACT_INPUT;
-		if (FD_ISSET(src->fd, &outFd))
-			src->actOcc |= ACT_OUTPUT;
-		if (FD_ISSET(src->fd, &excFd))
-			src->actOcc |= ACT_EXCEPT;
+	unless (rpcPollerWait(dp->poller, timeout))
+		return false;
+	unless (dispGrowEvs(&dp->ready, &dp->rall,
+			dp->nready + dp->poller->nevs + dp->nimm))
+		return false;
+	for (i = 0; i < dp->poller->nevs; ++i) {
+		ev = &dp->poller->evs[i];
+		src = ev->owner;
+		Py_INCREF(src);
+		rp = &dp->ready[dp->nready++];
+		rp->src = src;
+		rp->id = src->id;
+		rp->acts = ev->acts;
 	}
+	/* the references move over with the entries */
+	memcpy(dp->ready + dp->nready, dp->imms, dp->nimm * sizeof(*dp->imms));
+	dp->nready += dp->nimm;
+	dp->nimm = 0;
+
+	return true;
+}
+
+
+static bool
+dispGrowEvs(rpcDispEv **evs, uint *all, uint need)
+{
+	rpcDispEv	*nevs;
+	uint		nall;
+
+	if (need <= *all)
+		return true;
+	nall = *all;
+	while (nall < need)
+		nall *= 2;
+	nevs = ralloc(*evs, nall * sizeof(*nevs));
+	if (nevs == NULL)
+		return false;
+	*evs = nevs;
+	*all = nall;
 
 	return true;
 }
 
+
+static void
+dispDropEvs(rpcDispEv *evs, uint from, uint to)
+{
+	uint	i;
+
+	for (i = from; i < to; ++i)
+		Py_DECREF(evs[i].src);
+}
+
+
 /*
  * os independent funtion to get current time
  */
@@ -12,6 +12,8 @@
 
 
 #include "rpcInclude.h"
+#include "rpcSource.h"
+#include "rpcPoller.h"
 
 
 extern	PyTypeObject	rpcDispType;
@@ -20,6 +22,16 @@ extern	PyTypeObject	rpcDispType;
 struct _disp;				/* to appease the compiler gods */
 
 
+/*
+ * A source which is ready to have its callback run
+ */
+typedef struct {
+	rpcSource	*src;		/* the source (we hold a reference) */
+	int		id,		/* src->id when it became ready */
+			acts;		/* actions that occured */
+} rpcDispEv;
+
+
 /*
  * A dispatcher for file-descriptor based events
  */
@@ -30,6 +42,13 @@ typedef struct _disp {
 			salloc;		/* amount of sources allocated */
 	double		etime;		/* when work should stop */
 	rpcSource	**srcs;		/* array of pointers to sources */
+	rpcPoller	*poller;	/* waits for events on the fds */
+	rpcDispEv	*ready,		/* sources to run, stacked per work() */
+			*imms;		/* immediate sources for next round */
+	uint		nready,
+			rall,
+			nimm,
+			iall;
 } rpcDisp;
 
 
@@ -40,6 +59,7 @@ PyObject	*rpcDispActiveFds(rpcDisp *dp);
 bool		rpcDispAddSource(rpcDisp *dp, rpcSource *sp);
 bool		rpcDispDelSource(rpcDisp *dp, rpcSource *sp);
 bool		rpcDispWork(rpcDisp *dp, double timeout, bool *timedOut);
+int		rpcDispHandleError(rpcSource *srcp);
 
 
 #endif /* _RPCDISPATCH_H_ */
@@ -0,0 +1,441 @@
+/*
+ * Copyright (C) 2001, Shilad Sen, Sourcelight Technologies, Inc.
+ * See xmlrpc.h or the README for more copyright information.
+ */
+
+
+#include "xmlrpc.h"
+#include "rpcInternal.h"
+#include <assert.h>
+#include <ctype.h>
+#include <string.h>
+
+
+#define	MAX_HEADER	65536		/* longest header we accept */
+#define	MAX_CHUNK_LINE	1024		/* longest chunk size or trailer line */
+
+#define	FIELD_IS(cp, len, name)	\
+	((len) == sizeof(name) - 1 and strncasecmp(cp, name, len) == 0)
+
+
+static	bool		httpFirstLine(rpcHttpHead *hp, char *bp, char *cp,
+				char *ep);
+static	bool		httpField(rpcHttpHead *hp, char *bp, char *cp,
+				char *ep);
+static	bool		httpStrIs(rpcHttpStr *sp, char *bp, char *str);
+static	bool		httpChunkSize(rpcChunks *chp, char *cp, char *ep);
+
+
+void
+rpcHttpInit(rpcHttpHead *hp, int type)
+{
+	hp->type = type;
+	hp->version = 0;
+	hp->status = 0;
+	hp->pos = 0;
+	hp->scan = 0;
+	hp->lines = 0;
+	hp->hlen = -1;
+	hp->clen = -1;
+	hp->chunked = false;
+	hp->keepAlive = false;
+	hp->uri.off = -1;
+	hp->host.off = -1;
+	hp->conn.off = -1;
+	hp->te.off = -1;
+	hp->auth.off = -1;
+	hp->chunks.state = CHUNK_SIZE;
+	hp->chunks.left = 0;
+	hp->chunks.body = 0;
+}
+
+
+/*
+ * Parse as much of the header at bp as we can.  bp must be the same
+ * header each time, with len growing as more of it arrives.  Returns
+ * HTTP_DONE once the blank line has been seen (hp->hlen is then the
+ * length of the header), HTTP_AGAIN if more is needed or HTTP_ERR with
+ * a python error set.
+ */
+int
+rpcHttpParse(rpcHttpHead *hp, char *bp, long len)
+{
+	char	*cp,		/* start of the current line */
+		*lp,		/* end of the current line */
+		*np,		/* the newline after it */
+		*ep;		/* end of the data */
+
+	if (hp->hlen >= 0)
+		return HTTP_DONE;
+	cp = bp + hp->pos;
+	ep = bp + len;
+	np = bp + hp->scan;
+	while ((np = memchr(np, '\n', ep - np)) != NULL) {
+		lp = np;
+		if (lp > cp and lp[-1] == '\r')
+			lp--;
+		if (hp->lines == 0) {
+			unless (httpFirstLine(hp, bp, cp, lp))
+				return HTTP_ERR;
+		} else if (lp == cp) {
+			hp->lines++;
+			hp->hlen = np + 1 - bp;
+			hp->pos = hp->hlen;
+			hp->scan = hp->hlen;
+			if (hp->version == 10)
+				hp->keepAlive = httpStrIs(&hp->conn, bp,
+							"keep-alive");
+			else
+				hp->keepAlive = not httpStrIs(&hp->conn, bp,
+							"close");
+			return HTTP_DONE;
+		} else unless (httpField(hp, bp, cp, lp))
+			return HTTP_ERR;
+		hp->lines++;
+		cp = np + 1;
+		np = cp;
+	}
+	hp->pos = cp - bp;
+	hp->scan = len;
+	if (len > MAX_HEADER) {
+		PyErr_SetString(rpcError, "HTTP header too long");
+		return HTTP_ERR;
+	}
+
+	return HTTP_AGAIN;
+}
+
+
+/*
+ * Build a dictionary out of a parsed header, the way parseHeader()
+ * always has: the HTTP version as a float, the URI of a request and
+ * every header field with its name capitalized.
+ */
+PyObject *
+rpcHttpDict(rpcHttpHead *hp, char *bp)
+{
+	PyObject	*addInfo,
+			*name,
+			*value;
+	char		*cp,
+			*ep,
+			*lp,
+			*tp,
+			*sp;
+
+	assert(hp->hlen >= 0);
+	addInfo = PyDict_New();
+	if (addInfo == NULL)
+		return NULL;
+	value = PyFloat_FromDouble(hp->version == 10 ? 1.0 : 1.1);
+	if ((value == NULL)
+	or  (PyDict_SetItemString(addInfo, "HTTP Version", value))) {
+		Py_XDECREF(value);
+		Py_DECREF(addInfo);
+		return NULL;
+	}
+	Py_DECREF(value);
+	if (hp->uri.off >= 0) {
+		value = PyString_FromStringAndSize(bp + hp->uri.off,
+							hp->uri.len);
+		if ((value == NULL)
+		or  (PyDict_SetItemString(addInfo, "URI", value))) {
+			Py_XDECREF(value);
+			Py_DECREF(addInfo);
+			return NULL;
+		}
+		Py_DECREF(value);
+	}
+	ep = bp + hp->hlen;
+	cp = (char *)memchr(bp, '\n', ep - bp) + 1;
+	while (cp < ep) {
+		lp = memchr(cp, '\n', ep - cp);
+		if (lp > cp and lp[-1] == '\r')
+			lp--;
+		if (lp == cp)
+			break;
+		tp = memchr(cp, ':', lp - cp);
+		assert(tp != NULL);
+		name = PyString_FromStringAndSize(cp, tp - cp);
+		if (name == NULL) {
+			Py_DECREF(addInfo);
+			return NULL;
+		}
+		for (sp = PyString_AS_STRING(name); *sp; ++sp)	/* capitalize */
+			if (sp == PyString_AS_STRING(name)) {
+				if ('a' <= *sp && *sp <= 'z')
+					*sp -= 'a' - 'A';
+			} else if ('A' <= *sp && *sp <= 'Z')
+				*sp += 'a' - 'A';
+		for (++tp; tp < lp and (*tp == ' ' or *tp == '\t'); ++tp)
+			;
+		value = PyString_FromStringAndSize(tp, lp - tp);
+		if ((value == NULL)
+		or  (PyDict_SetItem(addInfo, name, value))) {
+			Py_DECREF(name);
+			Py_XDECREF(value);
+			Py_DECREF(addInfo);
+			return NULL;
+		}
+		Py_DECREF(name);
+		Py_DECREF(value);
+		cp = memchr(lp, '\n', ep - lp) + 1;
+	}
+
+	return addInfo;
+}
+
+
+/*
+ * De-chunk a chunked body in place.  bp holds *lenp bytes: the first
+ * hp->chunks.body of them are body that is already de-chunked and the
+ * rest is raw.  The raw bytes are parsed as far as they go, their
+ * chunk data is moved down to follow the body and the chunk framing is
+ * dropped; whatever is left unparsed follows that.  *lenp is set to
+ * the new length of the data.  Each body byte is moved once, however
+ * the chunks and the reads happen to split up.
+ *
+ * Returns HTTP_DONE after the last chunk and its trailer (any bytes
+ * past them are left after the body), HTTP_AGAIN if more is needed or
+ * HTTP_ERR with a python error set.
+ */
+int
+rpcHttpDechunk(rpcHttpHead *hp, char *bp, long *lenp)
+{
+	rpcChunks	*chp;
+	char		*dp,		/* where the next body byte goes */
+			*cp,		/* the next raw byte */
+			*ep,		/* end of the data */
+			*np;
+	long		n;
+	int		res;
+
+	chp = &hp->chunks;
+	dp = bp + chp->body;
+	cp = dp;
+	ep = bp + *lenp;
+	res = HTTP_AGAIN;
+	while (cp < ep and res == HTTP_AGAIN) {
+		switch (chp->state) {
+		case CHUNK_SIZE:
+		case CHUNK_TRAILER:
+			np = memchr(cp, '\n', ep - cp);
+			if (np == NULL) {
+				if (ep - cp > MAX_CHUNK_LINE) {
+					setPyErr("chunk header line too long");
+					return HTTP_ERR;
+				}
+				goto out;
+			}
+			if (chp->state == CHUNK_SIZE) {
+				unless (httpChunkSize(chp, cp, np))
+					return HTTP_ERR;
+			} else if (np == cp or (np == cp + 1 and *cp == '\r')) {
+				chp->state = CHUNK_DONE;
+				res = HTTP_DONE;
+			}
+			cp = np + 1;
+			break;
+		case CHUNK_DATA:
+			n = min(chp->left, ep - cp);
+			if (dp != cp)
+				memmove(dp, cp, n);
+			dp += n;
+			cp += n;
+			chp->left -= n;
+			if (chp->left == 0)
+				chp->state = CHUNK_END;
+			break;
+		case CHUNK_END:
+			if (*cp == '\r') {
+				if (ep - cp < 2)
+					goto out;
+				cp++;
+			}
+			if (*cp != '\n') {
+				setPyErr("no line end after chunk data");
+				return HTTP_ERR;
+			}
+			cp++;
+			chp->state = CHUNK_SIZE;
+			break;
+		default:
+			assert(false);
+		}
+	}
+out:
+	n = ep - cp;
+	if (n > 0 and dp != cp)
+		memmove(dp, cp, n);
+	chp->body = dp - bp;
+	*lenp = chp->body + n;
+
+	return res;
+}
+
+
+/*
+ * the Request-Line of a request or the Status-Line of a response
+ */
+static bool
+httpFirstLine(rpcHttpHead *hp, char *bp, char *cp, char *ep)
+{
+	char		*tp;
+	long		status;
+
+	if (hp->type == TYPE_REQ) {
+		tp = memchr(cp, ' ', ep - cp);
+		if (tp == NULL) {
+			setPyErr("illegal Request-Line");
+			return false;
+		}
+		if (tp - cp > 255) {
+			setPyErr("HTTP Method too long");
+			return false;
+		}
+		unless (tp - cp == 4 and strncasecmp(cp, "POST", 4) == 0) {
+			PyErr_Format(rpcError, "unsupported HTTP Method: '%.*s'",
+				(int)(tp - cp), cp);
+			return false;
+		}
+		cp = tp + 1;
+		tp = memchr(cp, ' ', ep - cp);
+		if (tp == NULL) {
+			setPyErr("illegal Request-Line");
+			return false;
+		}
+		hp->uri.off = cp - bp;
+		hp->uri.len = tp - cp;
+		cp = tp + 1;
+		if (ep - cp >= 8 and strncmp(cp, "HTTP/1.0", 8) == 0)
+			hp->version = 10;
+		else if (ep - cp >= 8 and strncmp(cp, "HTTP/1.1", 8) == 0)
+			hp->version = 11;
+		else {
+			setPyErr("illegal HTTP Version");
+			return false;
+		}
+	} else {
+		if (ep - cp >= 9 and strncmp(cp, "HTTP/1.0 ", 9) == 0)
+			hp->version = 10;
+		else if (ep - cp >= 9 and strncmp(cp, "HTTP/1.1 ", 9) == 0)
+			hp->version = 11;
+		else {
+			setPyErr("illegal HTTP version");
+			return false;
+		}
+		cp += 9;
+		for (status = 0; cp < ep and '0' <= *cp and *cp <= '9'; ++cp)
+			status = 10 * status + (*cp - '0');
+		hp->status = (int)status;
+	}
+
+	return true;
+}
+
+
+/*
+ * a "name: value" line; only the fields we use are recorded
+ */
+static bool
+httpField(rpcHttpHead *hp, char *bp, char *cp, char *ep)
+{
+	rpcHttpStr	*fp;
+	char		*tp,
+			*vp;
+	long		clen;
+
+	tp = memchr(cp, ':', ep - cp);
+	if (tp == NULL) {
+		setPyErr("illegal HTTP header line");
+		return false;
+	}
+	for (vp = tp + 1; vp < ep and (*vp == ' ' or *vp == '\t'); ++vp)
+		;
+	while (ep > vp and (ep[-1] == ' ' or ep[-1] == '\t'))
+		ep--;
+	if (FIELD_IS(cp, tp - cp, "Content-length")) {
+		if (vp == ep) {
+			setPyErr("invalid Content-length");
+			return false;
+		}
+		for (clen = 0; vp < ep; ++vp) {
+			unless (('0' <= *vp and *vp <= '9')
+			and     (clen <= (LONG_MAX - (*vp - '0')) / 10)) {
+				setPyErr("invalid Content-length");
+				return false;
+			}
+			clen = 10 * clen + (*vp - '0');
+		}
+		hp->clen = clen;
+		return true;
+	} else if (FIELD_IS(cp, tp - cp, "Transfer-Encoding"))
+		fp = &hp->te;
+	else if (FIELD_IS(cp, tp - cp, "Connection"))
+		fp = &hp->conn;
+	else if (FIELD_IS(cp, tp - cp, "Host"))
+		fp = &hp->host;
+	else if (FIELD_IS(cp, tp - cp, "Authorization"))
+		fp = &hp->auth;
+	else
+		return true;
+	fp->off = vp - bp;
+	fp->len = ep - vp;
+	if (fp == &hp->te)
+		hp->chunked = httpStrIs(fp, bp, "chunked");
+
+	return true;
+}
+
+
+static bool
+httpStrIs(rpcHttpStr *sp, char *bp, char *str)
+{
+	return (sp->off >= 0
+	and     sp->len == (long)strlen(str)
+	and     strncasecmp(bp + sp->off, str, sp->len) == 0);
+}
+
+
+/*
+ * the size line of a chunk; extensions after a ';' are ignored.  Blanks
+ * may come before and after the hex digits but not between them.
+ */
+static bool
+httpChunkSize(rpcChunks *chp, char *cp, char *ep)
+{
+	long		size;
+	int		d;
+
+	if (ep > cp and ep[-1] == '\r')
+		ep--;
+	while (cp < ep and (*cp == ' ' or *cp == '\t'))
+		cp++;
+	unless (cp < ep and isxdigit((unsigned char)*cp)) {
+		setPyErr("invalid chunk size");
+		return false;
+	}
+	for (size = 0; cp < ep and isxdigit((unsigned char)*cp); ++cp) {
+		if ('0' <= *cp and *cp <= '9')
+			d = *cp - '0';
+		else if ('a' <= *cp and *cp <= 'f')
+			d = *cp - 'a' + 10;
+		else
+			d = *cp - 'A' + 10;
+		if (size > (LONG_MAX - d) / 16) {
+			setPyErr("chunk size too large");
+			return false;
+		}
+		size = 16 * size + d;
+	}
+	while (cp < ep and (*cp == ' ' or *cp == '\t'))
+		cp++;
+	unless (cp == ep or *cp == ';') {
+		setPyErr("invalid chunk size");
+		return false;
+	}
+	chp->left = size;
+	chp->state = (size == 0) ? CHUNK_TRAILER : CHUNK_DATA;
+
+	return true;
+}
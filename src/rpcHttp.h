@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2001, Shilad Sen, Sourcelight Technologies, Inc.
+ * See xmlrpc.h or the README for more copyright information.
+ *
+ * An incremental HTTP header parser.
+ *
+ * The parser is fed the same growing buffer over and over and picks up
+ * where it stopped the last time, so every byte of a header is looked
+ * at once.  The headers that the library cares about are recorded as
+ * offsets into the buffer; a python dictionary of the header is only
+ * built when somebody asks for it.
+ */
+
+
+#ifndef _RPCHTTP_H_
+#define _RPCHTTP_H_
+
+
+#include "rpcInclude.h"
+
+
+#define	HTTP_ERR	0
+#define	HTTP_AGAIN	1
+#define	HTTP_DONE	2
+
+#define	CHUNK_SIZE	0		/* rpcChunks states */
+#define	CHUNK_DATA	1
+#define	CHUNK_END	2
+#define	CHUNK_TRAILER	3
+#define	CHUNK_DONE	4
+
+
+/*
+ * part of a header, as an offset from the start of the header
+ */
+typedef struct {
+	long		off,		/* -1 if the field was not seen */
+			len;
+} rpcHttpStr;
+
+
+/*
+ * a chunked body being taken apart in place: the first body bytes of
+ * the buffer are what has been de-chunked, the rest is still raw
+ */
+typedef struct {
+	int		state;		/* CHUNK_* */
+	long		left,		/* bytes left in the current chunk */
+			body;		/* de-chunked bytes at the front */
+} rpcChunks;
+
+
+typedef struct {
+	int		type,		/* TYPE_REQ or TYPE_RESP */
+			version,	/* 10 for HTTP/1.0, 11 for HTTP/1.1 */
+			status;		/* status code of a response */
+	long		pos,		/* start of the line being parsed */
+			scan,		/* how far that line has been scanned */
+			lines,		/* lines parsed so far */
+			hlen,		/* header length, once it is done */
+			clen;		/* Content-length, or -1 */
+	bool		chunked,	/* is the body chunked? */
+			keepAlive;	/* should the connection stay open? */
+	rpcHttpStr	uri,
+			host,
+			conn,
+			te,
+			auth;
+	rpcChunks	chunks;		/* used once the header is dropped */
+} rpcHttpHead;
+
+
+void		rpcHttpInit(rpcHttpHead *hp, int type);
+int		rpcHttpParse(rpcHttpHead *hp, char *bp, long len);
+PyObject	*rpcHttpDict(rpcHttpHead *hp, char *bp);
+int		rpcHttpDechunk(rpcHttpHead *hp, char *bp, long *lenp);
+
+
+#endif /* _RPCHTTP_H_ */
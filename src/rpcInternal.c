@@ -133,55 +133,139 @@ set_errno(int num)
 
 
 
+/*
+ * Parse a decimal number, with an optional exponent, at *cp.  Numbers of
+ * up to 15 or so digits with small exponents are converted exactly with
+ * a single multiplication or division; anything else is handed to
+ * python's string to double conversion, which works in place.
+ */
 bool
 decodeActDouble(char **cp, char *ep, double *d)
 {
+	static const double	pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	unsigned PY_LONG_LONG	m;
 	char		*tp,
-			*dp;
-	bool		dot;
+			*xp,
+			*end;
+	long		scale,		/* power of ten to apply to m */
+			exp;
+	int		ndig,		/* digits in m */
+			nseen;		/* digits seen */
+	bool		neg,
+			dot,
+			exact,
+			eneg;
 
-	dot = false;
 	tp = *cp;
-	if (**cp == '-')
+	neg = false;
+	if (*cp < ep and (**cp == '-' or **cp == '+')) {
+		neg = (**cp == '-');
 		++*cp;
-	for (; *cp < ep; ++*cp)
+	}
+	m = 0;
+	scale = 0;
+	ndig = 0;
+	nseen = 0;
+	dot = false;
+	exact = true;
+	for (; *cp < ep; ++*cp) {
 		if (**cp == '.') {
 			if (dot)
 				return false;
-			else
-				dot = true;
-		} else if (**cp < '0' || **cp > '9')
+			dot = true;
+			continue;
+		}
+		if (**cp < '0' or **cp > '9')
 			break;
-	dp = alloc(*cp - tp + 1);
-	strncpy(dp, tp, *cp - tp);
-	dp[*cp - tp] = EOS;
-	*d = atof(dp);
-	free(dp);
+		nseen++;
+		if (ndig == 0 and **cp == '0') {	/* leading zero */
+			if (dot)
+				scale--;
+		} else if (ndig < 19) {
+			m = 10 * m + (**cp - '0');
+			ndig++;
+			if (dot)
+				scale--;
+		} else {				/* too many digits */
+			exact = false;
+			if (not dot)
+				scale++;
+		}
+	}
+	if (nseen == 0)
+		return false;
+	if (*cp < ep and (**cp == 'e' or **cp == 'E')) {
+		xp = *cp + 1;
+		eneg = false;
+		if (xp < ep and (*xp == '-' or *xp == '+')) {
+			eneg = (*xp == '-');
+			xp++;
+		}
+		if (xp < ep and '0' <= *xp and *xp <= '9') {
+			for (exp = 0; xp < ep and '0' <= *xp and *xp <= '9'; ++xp)
+				if (exp < 100000)
+					exp = 10 * exp + (*xp - '0');
+			scale += eneg ? -exp : exp;
+			*cp = xp;
+		}
+	}
+	if ((exact)
+	and (m <= ((unsigned PY_LONG_LONG)1 << 53))
+	and (scale >= -22 and scale <= 22)) {
+		if (scale < 0)
+			*d = (double)m / pow10[-scale];
+		else
+			*d = (double)m * pow10[scale];
+		if (neg)
+			*d = -*d;
+		return true;
+	}
+	*d = PyOS_string_to_double(tp, &end, NULL);
+	if (*d == -1.0 and PyErr_Occurred()) {
+		PyErr_Clear();
+		return false;
+	}
 
-	return (*cp > tp);
+	return (end == *cp);
 }
 
 
+/*
+ * Parse a decimal integer at *cp.  If it does not fit in a long, false
+ * is returned with *cp moved past the digits anyway, so the caller can
+ * tell an overflow from a missing number.
+ */
 bool
 decodeActLong(char **cp, char *ep, long *l)
 {
-	long		t;
+	ulong		t,
+			lim;
 	char		*tp;
-	int		sign;
+	bool		neg,
+			over;
 
 	tp = *cp;
 	t = 0;
-	sign = 1;
-
-	if (**cp == '-') {
-		sign = -1;
+	neg = false;
+	over = false;
+	if (*cp < ep and (**cp == '-' or **cp == '+')) {
+		neg = (**cp == '-');
 		++*cp;
+		tp = *cp;
 	}
-	while (*cp < ep && **cp <= '9' && **cp >= '0')
-		t = 10 * t + *((*cp)++) - '0';
-	*l = t * sign;
+	lim = neg ? (ulong)LONG_MAX + 1 : (ulong)LONG_MAX;
+	for (; *cp < ep && **cp <= '9' && **cp >= '0'; ++*cp) {
+		if (t > (lim - (**cp - '0')) / 10)
+			over = true;
+		else
+			t = 10 * t + (**cp - '0');
+	}
+	*l = neg ? (long)(0UL - t) : (long)t;
 
-	return (*cp > tp);
+	return (*cp > tp and not over);
 }
 
 
@@ -189,29 +273,34 @@ decodeActLong(char **cp, char *ep, long *l)
 bool
 decodeActLongHex(char **cp, char *ep, long *l)
 {
-	long		t;
+	ulong		t;
 	char		*tp;
-	int		sign;
+	int		sign,
+			dig;
 
 	tp = *cp;
 	t = 0;
 	sign = 1;
 
-	if (**cp == '-') {
+	if (*cp < ep and **cp == '-') {
 		sign = -1;
 		++*cp;
+		tp = *cp;
 	}
-	while (*cp < ep) {
+	for (; *cp < ep; ++*cp) {
 		if (**cp <= '9' && **cp >= '0')
-			t = 16 * t + *((*cp)++) - '0';
-		else if (**cp <= 'z' && **cp >= 'a')
-			t = 16 * t + 10 + *((*cp)++) - 'a';
-		else if (**cp <= 'Z' && **cp >= 'A')
-			t = 16 * t + 10 + *((*cp)++) - 'A';
+			dig = **cp - '0';
+		else if (**cp <= 'f' && **cp >= 'a')
+			dig = 10 + **cp - 'a';
+		else if (**cp <= 'F' && **cp >= 'A')
+			dig = 10 + **cp - 'A';
 		else
 			break;
+		if (t > ((ulong)LONG_MAX - dig) / 16)
+			return false;
+		t = 16 * t + dig;
 	}
-	*l = t * sign;
+	*l = (long)t * sign;
 
 	return (*cp > tp);
 }
@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2001, Shilad Sen, Sourcelight Technologies, Inc.
+ * See xmlrpc.h or the README for more copyright information.
+ */
+
+
+#include "xmlrpc.h"
+#include "rpcInternal.h"
+#include <assert.h>
+#include <string.h>
+
+
+#define	METHODS_MIN	16		/* slots in a new table */
+
+
+static	char		*methodsKey(PyObject *name, long *klenp);
+static	ulong		methodsHash(char *key, long klen);
+static	rpcMethod	*methodsSlot(
+				rpcMethods	*mp,
+				char		*key,
+				long		klen,
+				ulong		hash
+			);
+static	bool		methodsGrow(rpcMethods *mp);
+static	void		methodsDrop(rpcMethod *mp);
+
+
+rpcMethods *
+rpcMethodsNew(void)
+{
+	rpcMethods	*mp;
+
+	mp = alloc(sizeof(*mp));
+	if (mp == NULL)
+		return NULL;
+	mp->nmeths = 0;
+	mp->all = METHODS_MIN;
+	mp->meths = alloc(mp->all * sizeof(*mp->meths));
+	if (mp->meths == NULL) {
+		free(mp);
+		return NULL;
+	}
+	memset(mp->meths, 0, mp->all * sizeof(*mp->meths));
+
+	return mp;
+}
+
+
+void
+rpcMethodsFree(rpcMethods *mp)
+{
+	int		i;
+
+	for (i = 0; i < mp->all; ++i)
+		if (mp->meths[i].key != NULL) {
+			free(mp->meths[i].key);
+			methodsDrop(&mp->meths[i]);
+		}
+	free(mp->meths);
+	free(mp);
+}
+
+
+/*
+ * Add a method, or replace the one of the same name.  It is handled by
+ * cfunc if that is not NULL and by pyfunc otherwise; self is what a
+ * python handler gets as its first argument, NULL meaning the server.
+ */
+bool
+rpcMethodsAdd(
+	rpcMethods	*mp,
+	PyObject	*name,
+	rpcCMethod	cfunc,
+	PyObject	*pyfunc,
+	PyObject	*self
+)
+{
+	rpcMethod	*methp,
+			old;
+	char		*key;
+	long		klen;
+	ulong		hash;
+
+	unless (PyString_Check(name)) {
+		PyErr_SetString(rpcError, "method names must be strings");
+		return false;
+	}
+	if (cfunc == NULL and not PyCallable_Check(pyfunc)) {
+		PyErr_SetString(rpcError, "method must be callable");
+		return false;
+	}
+	if ((mp->nmeths + 1) * 3 > mp->all * 2)
+		unless (methodsGrow(mp))
+			return false;
+	key = methodsKey(name, &klen);
+	if (key == NULL)
+		return false;
+	hash = methodsHash(key, klen);
+	methp = methodsSlot(mp, key, klen, hash);
+	memset(&old, 0, sizeof(old));
+	if (methp->key == NULL) {
+		methp->key = alloc(klen + 1);
+		if (methp->key == NULL)
+			return false;
+		memcpy(methp->key, key, klen);
+		methp->key[klen] = EOS;
+		methp->klen = klen;
+		methp->hash = hash;
+		mp->nmeths++;
+	} else
+		old = *methp;		/* dropped once the entry is whole */
+	Py_INCREF(name);
+	PyString_InternInPlace(&name);
+	methp->name = name;
+	if (cfunc != NULL) {
+		methp->flags = METHOD_C;
+		methp->cfunc = cfunc;
+		methp->pyfunc = NULL;
+		methp->self = NULL;
+	} else {
+		methp->flags = METHOD_PY;
+		methp->cfunc = NULL;
+		methp->pyfunc = pyfunc;
+		Py_INCREF(pyfunc);
+		methp->self = self;
+		Py_XINCREF(self);
+	}
+	methodsDrop(&old);
+
+	return true;
+}
+
+
+/*
+ * the method called name, or NULL if there is none; it is also NULL
+ * if name is not a string, with an error set
+ */
+rpcMethod *
+rpcMethodsFind(rpcMethods *mp, PyObject *name)
+{
+	rpcMethod	*methp;
+	char		*key;
+	long		klen;
+
+	key = methodsKey(name, &klen);
+	if (key == NULL)
+		return NULL;
+	methp = methodsSlot(mp, key, klen, methodsHash(key, klen));
+	if (methp->key == NULL)
+		return NULL;
+	return methp;
+}
+
+
+/*
+ * the bytes of a method name
+ */
+static char *
+methodsKey(PyObject *name, long *klenp)
+{
+	char		*key;
+	Py_ssize_t	len;
+
+	if (PyString_AsStringAndSize(name, &key, &len))
+		return NULL;
+	*klenp = len;
+	return key;
+}
+
+
+/*
+ * FNV-1a
+ */
+static ulong
+methodsHash(char *key, long klen)
+{
+	ulong		hash;
+	long		i;
+
+	hash = 2166136261UL;
+	for (i = 0; i < klen; ++i) {
+		hash ^= (unsigned char)key[i];
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+
+/*
+ * the slot holding key, or the free slot where it would go
+ */
+static rpcMethod *
+methodsSlot(rpcMethods *mp, char *key, long klen, ulong hash)
+{
+	rpcMethod	*methp;
+	int		i;
+
+	i = hash & (mp->all - 1);
+	while (true) {
+		methp = &mp->meths[i];
+		if (methp->key == NULL)
+			return methp;
+		if (methp->hash == hash
+		and methp->klen == klen
+		and memcmp(methp->key, key, klen) == 0)
+			return methp;
+		i = (i + 1) & (mp->all - 1);
+	}
+}
+
+
+static bool
+methodsGrow(rpcMethods *mp)
+{
+	rpcMethod	*old,
+			*methp;
+	int		oall,
+			i;
+
+	old = mp->meths;
+	oall = mp->all;
+	mp->meths = alloc(2 * oall * sizeof(*mp->meths));
+	if (mp->meths == NULL) {
+		mp->meths = old;
+		return false;
+	}
+	mp->all = 2 * oall;
+	memset(mp->meths, 0, mp->all * sizeof(*mp->meths));
+	for (i = 0; i < oall; ++i)
+		if (old[i].key != NULL) {
+			methp = methodsSlot(mp, old[i].key, old[i].klen,
+						old[i].hash);
+			*methp = old[i];
+		}
+	free(old);
+
+	return true;
+}
+
+
+/*
+ * let go of what an entry holds, but not its key
+ */
+static void
+methodsDrop(rpcMethod *methp)
+{
+	Py_XDECREF(methp->name);
+	Py_XDECREF(methp->pyfunc);
+	Py_XDECREF(methp->self);
+	methp->name = NULL;
+	methp->pyfunc = NULL;
+	methp->self = NULL;
+	methp->cfunc = NULL;
+	methp->flags = 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2001, Shilad Sen, Sourcelight Technologies, Inc.
+ * See xmlrpc.h or the README for more copyright information.
+ *
+ * The table of methods a server answers.
+ *
+ * Each method is resolved once, when it is added, into a typed entry:
+ * a C function or a python callable, and what the handler gets as its
+ * first argument.  A request's method name is then looked up by its
+ * bytes with a single probe of an open addressed table, and the
+ * handler is given the entry's interned copy of the name.
+ */
+
+
+#ifndef _RPCMETHODS_H_
+#define _RPCMETHODS_H_
+
+
+#include "rpcInclude.h"
+#include "rpcSource.h"
+
+
+#define	METHOD_C	(1 << 0)	/* the handler is cfunc */
+#define	METHOD_PY	(1 << 1)	/* the handler is pyfunc */
+
+
+struct _server;			/* to appease the compiler gods */
+
+
+/*
+ * A method written in C, added with rpcServerAddCMethod(), so that an
+ * extension module can answer its hot methods without running python.
+ * It is called with the interpreter lock held, on the dispatcher's
+ * thread or on a worker, and gets the server, the connection, the uri
+ * and the method name (both only good for the call) and the decoded
+ * params (borrowed).  It returns a new reference to the result, or NULL
+ * with an exception set to send a fault; raising rpcPostpone delays
+ * the response just as it does for a python handler.
+ */
+typedef PyObject	*(*rpcCMethod)(
+				struct _server	*servp,
+				rpcSource	*srcp,
+				char		*uri,
+				char		*method,
+				PyObject	*params
+			);
+
+
+typedef struct {
+	char		*key;		/* the name's bytes, or NULL if free */
+	long		klen;
+	ulong		hash;		/* of key */
+	int		flags;		/* METHOD_* */
+	PyObject	*name,		/* the name, interned */
+			*pyfunc,	/* python handler */
+			*self;		/* its first argument, NULL for the
+					 * server */
+	rpcCMethod	cfunc;		/* C handler */
+} rpcMethod;
+
+
+typedef struct {
+	int		nmeths,		/* entries in use */
+			all;		/* slots, a power of 2 */
+	rpcMethod	*meths;
+} rpcMethods;
+
+
+rpcMethods	*rpcMethodsNew(void);
+void		rpcMethodsFree(rpcMethods *mp);
+bool		rpcMethodsAdd(
+			rpcMethods	*mp,
+			PyObject	*name,
+			rpcCMethod	cfunc,
+			PyObject	*pyfunc,
+			PyObject	*self
+		);
+rpcMethod	*rpcMethodsFind(rpcMethods *mp, PyObject *name);
+
+
+#endif /* _RPCMETHODS_H_ */
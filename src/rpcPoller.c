@@ -0,0 +1,649 @@
+/*
+ * Copyright (C) 2001, Shilad Sen, Sourcelight Technologies, Inc.
+ * See xmlrpc.h or the README for more copyright information.
+ */
+
+
+#include "xmlrpc.h"
+#include "rpcInternal.h"
+#include <math.h>
+#include <limits.h>
+
+
+#ifdef MSWINDOWS
+	#include <winsock2.h>
+#else
+	#include <unistd.h>
+	#include <sys/time.h>
+	#include <sys/types.h>
+#endif /* MSWINDOWS */
+
+#if defined(__linux__) && !defined(XMLRPC_NO_EPOLL)
+	#define	USE_EPOLL
+	#include <sys/epoll.h>
+#elif (defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) \
+    || defined(__DragonFly__) || defined(__APPLE__)) \
+    && !defined(XMLRPC_NO_KQUEUE)
+	#define	USE_KQUEUE
+	#include <fcntl.h>
+	#include <sys/event.h>
+#endif
+
+
+#define	INIT_FDS	64
+#define	INIT_EVENTS	64
+#define	ACT_POLLED	(ACT_INPUT|ACT_OUTPUT|ACT_EXCEPT)
+
+
+static	bool	pollerGrowFds(rpcPoller *pp, int fd);
+static	bool	pollerAddEv(rpcPoller *pp, int fd, int acts);
+static	bool	pollerFlush(rpcPoller *pp);
+static	bool	pollerApply(rpcPoller *pp, int fd, rpcPollerFd *fp);
+static	bool	selectWait(rpcPoller *pp, double timeout);
+#ifdef USE_EPOLL
+static	bool	epollApply(rpcPoller *pp, int fd, rpcPollerFd *fp);
+static	bool	epollWait(rpcPoller *pp, double timeout);
+#endif /* USE_EPOLL */
+#ifdef USE_KQUEUE
+static	bool	kqueueApply(rpcPoller *pp, int fd, rpcPollerFd *fp);
+static	bool	kqueueWait(rpcPoller *pp, double timeout);
+#endif /* USE_KQUEUE */
+
+
+rpcPoller *
+rpcPollerNew(void)
+{
+	rpcPoller	*pp;
+
+	pp = alloc(sizeof(*pp));
+	if (pp == NULL)
+		return NULL;
+	memset(pp, 0, sizeof(*pp));
+	pp->backend = POLLER_SELECT;
+	pp->kfd = -1;
+	pp->maxfd = -1;
+	pp->fdall = INIT_FDS;
+	pp->chgall = INIT_FDS;
+	pp->evall = INIT_EVENTS;
+	pp->fds = alloc(pp->fdall * sizeof(*pp->fds));
+	pp->chg = alloc(pp->chgall * sizeof(*pp->chg));
+	pp->evs = alloc(pp->evall * sizeof(*pp->evs));
+	if (pp->fds == NULL or pp->chg == NULL or pp->evs == NULL) {
+		rpcPollerFree(pp);
+		return NULL;
+	}
+	memset(pp->fds, 0, pp->fdall * sizeof(*pp->fds));
+
+#ifdef USE_EPOLL
+	pp->kfd = epoll_create1(EPOLL_CLOEXEC);
+	if (pp->kfd >= 0) {
+		pp->kevs = alloc(pp->evall * sizeof(struct epoll_event));
+		pp->backend = POLLER_EPOLL;
+	}
+#endif /* USE_EPOLL */
+#ifdef USE_KQUEUE
+	pp->kfd = kqueue();
+	if (pp->kfd >= 0) {
+		fcntl(pp->kfd, F_SETFD, FD_CLOEXEC);
+		pp->kevs = alloc(pp->evall * sizeof(struct kevent));
+		pp->backend = POLLER_KQUEUE;
+	}
+#endif /* USE_KQUEUE */
+	if (pp->backend != POLLER_SELECT and pp->kevs == NULL) {
+		rpcPollerFree(pp);
+		return NULL;
+	}
+	rpcLogMsg(9, "created %s poller", rpcPollerName(pp));
+
+	return pp;
+}
+
+
+void
+rpcPollerFree(rpcPoller *pp)
+{
+	if (pp->kfd >= 0)
+		close(pp->kfd);
+	if (pp->fds)
+		free(pp->fds);
+	if (pp->chg)
+		free(pp->chg);
+	if (pp->evs)
+		free(pp->evs);
+	if (pp->kevs)
+		free(pp->kevs);
+	free(pp);
+}
+
+
+char *
+rpcPollerName(rpcPoller *pp)
+{
+	switch (pp->backend) {
+	case POLLER_EPOLL:
+		return "epoll";
+	case POLLER_KQUEUE:
+		return "kqueue";
+	default:
+		return "select";
+	}
+}
+
+
+/*
+ * In a forked child: an epoll set would still be shared with the
+ * parent and a kqueue is not inherited at all, so the child gets a
+ * kernel poller of its own and every fd is registered with it again
+ * on the next wait.
+ */
+bool
+rpcPollerAfterFork(rpcPoller *pp)
+{
+	rpcPollerFd	*fp;
+	int		fd;
+
+	if (pp->backend == POLLER_SELECT)
+		return true;
+	close(pp->kfd);
+#ifdef USE_EPOLL
+	pp->kfd = epoll_create1(EPOLL_CLOEXEC);
+#endif /* USE_EPOLL */
+#ifdef USE_KQUEUE
+	pp->kfd = kqueue();
+	if (pp->kfd >= 0)
+		fcntl(pp->kfd, F_SETFD, FD_CLOEXEC);
+#endif /* USE_KQUEUE */
+	if (pp->kfd < 0) {
+		PyErr_SetFromErrno(rpcError);
+		return false;
+	}
+	for (fd = 0; fd < pp->fdall; ++fd) {
+		fp = &pp->fds[fd];
+		unless (fp->kacts)
+			continue;
+		fp->kacts = 0;
+		fp->kowner = NULL;
+		if (fp->dirty)
+			continue;
+		if (pp->nchg == pp->chgall) {
+			pp->chgall *= 2;
+			pp->chg = ralloc(pp->chg, pp->chgall * sizeof(*pp->chg));
+			if (pp->chg == NULL)
+				return false;
+		}
+		pp->chg[pp->nchg++] = fd;
+		fp->dirty = true;
+	}
+
+	return true;
+}
+
+
+/*
+ * Ask for "acts" on "fd" to be reported to "owner".  "gen" identifies
+ * the open file behind fd; when it changes the fd is registered with
+ * the kernel again even if the actions stay the same, since closing a
+ * descriptor silently drops its kernel registration.
+ *
+ * Nothing is pushed to the kernel until the next rpcPollerWait().
+ */
+bool
+rpcPollerSet(rpcPoller *pp, int fd, int acts, void *owner, uint gen)
+{
+	rpcPollerFd	*fp;
+
+	if (fd < 0) {
+		PyErr_SetString(rpcError, "bad file descriptor for poller");
+		return false;
+	}
+	acts &= ACT_POLLED;
+	if (fd >= pp->fdall and not pollerGrowFds(pp, fd))
+		return false;
+	fp = &pp->fds[fd];
+	if (fp->acts and not acts)
+		pp->nfds--;
+	else if (acts and not fp->acts)
+		pp->nfds++;
+	fp->acts = acts;
+	fp->owner = acts ? owner : NULL;
+	fp->gen = gen;
+	if (acts and fd > pp->maxfd)
+		pp->maxfd = fd;
+	if (fp->dirty)
+		return true;
+	if (pp->nchg == pp->chgall) {
+		pp->chgall *= 2;
+		pp->chg = ralloc(pp->chg, pp->chgall * sizeof(*pp->chg));
+		if (pp->chg == NULL)
+			return false;
+	}
+	pp->chg[pp->nchg++] = fd;
+	fp->dirty = true;
+
+	return true;
+}
+
+
+/*
+ * Drop interest in fd, but only if owner is the one that still has it:
+ * a closed descriptor may already have been reused by somebody else.
+ */
+void
+rpcPollerUnset(rpcPoller *pp, int fd, void *owner)
+{
+	if (fd < 0 or fd >= pp->fdall or pp->fds[fd].owner != owner)
+		return;
+	rpcPollerSet(pp, fd, 0, NULL, pp->fds[fd].gen);
+}
+
+
+/*
+ * Wait up to timeout seconds (forever if negative) for events.  The
+ * events found are left in pp->evs.
+ */
+bool
+rpcPollerWait(rpcPoller *pp, double timeout)
+{
+	pp->nevs = 0;
+	unless (pollerFlush(pp))
+		return false;
+	if (pp->nfds == 0)
+		return true;
+	switch (pp->backend) {
+#ifdef USE_EPOLL
+	case POLLER_EPOLL:
+		return epollWait(pp, timeout);
+#endif /* USE_EPOLL */
+#ifdef USE_KQUEUE
+	case POLLER_KQUEUE:
+		return kqueueWait(pp, timeout);
+#endif /* USE_KQUEUE */
+	default:
+		return selectWait(pp, timeout);
+	}
+}
+
+
+static bool
+pollerGrowFds(rpcPoller *pp, int fd)
+{
+	int	nall;
+
+	nall = pp->fdall;
+	while (nall <= fd)
+		nall *= 2;
+	pp->fds = ralloc(pp->fds, nall * sizeof(*pp->fds));
+	if (pp->fds == NULL)
+		return false;
+	memset(pp->fds + pp->fdall, 0, (nall - pp->fdall) * sizeof(*pp->fds));
+	pp->fdall = nall;
+
+	return true;
+}
+
+
+/*
+ * record an event, merging it with an earlier one for the same fd
+ * (kqueue reports reads and writes separately)
+ */
+static bool
+pollerAddEv(rpcPoller *pp, int fd, int acts)
+{
+	rpcPollerFd	*fp;
+	rpcPollerEv	*ep;
+
+	if (fd < 0 or fd >= pp->fdall)
+		return true;
+	fp = &pp->fds[fd];
+	acts &= fp->acts;
+	unless (acts)
+		return true;
+	if (pp->nevs and pp->evs[pp->nevs - 1].fd == fd) {
+		pp->evs[pp->nevs - 1].acts |= acts;
+		return true;
+	}
+	if (pp->nevs == pp->evall) {
+		pp->evall *= 2;
+		pp->evs = ralloc(pp->evs, pp->evall * sizeof(*pp->evs));
+		if (pp->evs == NULL)
+			return false;
+	}
+	ep = &pp->evs[pp->nevs++];
+	ep->fd = fd;
+	ep->acts = acts;
+	ep->owner = fp->owner;
+
+	return true;
+}
+
+
+/*
+ * push pending changes to the kernel
+ */
+static bool
+pollerFlush(rpcPoller *pp)
+{
+	rpcPollerFd	*fp;
+	int		i,
+			fd;
+
+	for (i = 0; i < pp->nchg; ++i) {
+		fd = pp->chg[i];
+		fp = &pp->fds[fd];
+		fp->dirty = false;
+		unless (pollerApply(pp, fd, fp)) {
+			/* keep what we did not get to for the next try */
+			memmove(pp->chg, pp->chg + i + 1,
+				(pp->nchg - i - 1) * sizeof(*pp->chg));
+			pp->nchg -= i + 1;
+			for (i = 0; i < pp->nchg; ++i)
+				pp->fds[pp->chg[i]].dirty = true;
+			return false;
+		}
+	}
+	pp->nchg = 0;
+	while (pp->maxfd >= 0 and not pp->fds[pp->maxfd].acts)
+		pp->maxfd--;
+
+	return true;
+}
+
+
+static bool
+pollerApply(rpcPoller *pp, int fd, rpcPollerFd *fp)
+{
+	bool	ok;
+
+	if (fp->acts == fp->kacts
+	and fp->owner == fp->kowner
+	and (fp->gen == fp->kgen or not fp->acts))
+		return true;
+	switch (pp->backend) {
+#ifdef USE_EPOLL
+	case POLLER_EPOLL:
+		ok = epollApply(pp, fd, fp);
+		break;
+#endif /* USE_EPOLL */
+#ifdef USE_KQUEUE
+	case POLLER_KQUEUE:
+		ok = kqueueApply(pp, fd, fp);
+		break;
+#endif /* USE_KQUEUE */
+	default:
+		ok = true;
+		break;
+	}
+	unless (ok)
+		return false;
+	fp->kacts = fp->acts;
+	fp->kowner = fp->owner;
+	fp->kgen = fp->gen;
+
+	return true;
+}
+
+
+static bool
+selectWait(rpcPoller *pp, double timeout)
+{
+	struct timeval	tv;
+	rpcPollerFd	*fp;
+	fd_set		inFd,
+			outFd,
+			excFd;
+	int		fd,
+			acts,
+			nEvents;
+
+#ifndef MSWINDOWS
+	if (pp->maxfd >= FD_SETSIZE) {
+		PyErr_Format(rpcError,
+			"fd %d is too large for select()", pp->maxfd);
+		return false;
+	}
+#endif /* MSWINDOWS */
+	FD_ZERO(&inFd);
+	FD_ZERO(&outFd);
+	FD_ZERO(&excFd);
+	for (fd = 0; fd <= pp->maxfd; ++fd) {
+		fp = &pp->fds[fd];
+		if (fp->acts & ACT_INPUT)
+			FD_SET((uint)fd, &inFd);
+		if (fp->acts & ACT_OUTPUT)
+			FD_SET((uint)fd, &outFd);
+		if (fp->acts & ACT_EXCEPT)
+			FD_SET((uint)fd, &excFd);
+	}
+	Py_BEGIN_ALLOW_THREADS
+	if (timeout < 0.0)
+		nEvents = select(pp->maxfd+1, &inFd, &outFd, &excFd, NULL);
+	else {
+		tv.tv_sec = (int)floor(timeout);
+		tv.tv_usec = ((int)floor(1000000.0 *
+				(timeout-floor(timeout)))) % 1000000;
+		nEvents = select(pp->maxfd+1, &inFd, &outFd, &excFd, &tv);
+	}
+	Py_END_ALLOW_THREADS
+	if (nEvents < 0) {
+		PyErr_SetFromErrno(rpcError);
+		return false;
+	}
+	for (fd = 0; nEvents > 0 and fd <= pp->maxfd; ++fd) {
+		acts = 0;
+		if (FD_ISSET(fd, &inFd))
+			acts |= ACT_INPUT;
+		if (FD_ISSET(fd, &outFd))
+			acts |= ACT_OUTPUT;
+		if (FD_ISSET(fd, &excFd))
+			acts |= ACT_EXCEPT;
+		unless (acts)
+			continue;
+		nEvents--;
+		unless (pollerAddEv(pp, fd, acts))
+			return false;
+	}
+
+	return true;
+}
+
+
+#ifdef USE_EPOLL
+static bool
+epollApply(rpcPoller *pp, int fd, rpcPollerFd *fp)
+{
+	struct epoll_event	ev;
+	int			op;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+	if (fp->acts & ACT_INPUT)
+		ev.events |= EPOLLIN;
+	if (fp->acts & ACT_OUTPUT)
+		ev.events |= EPOLLOUT;
+	if (fp->acts & ACT_EXCEPT)
+		ev.events |= EPOLLPRI;
+
+	if (not fp->acts) {
+		unless (fp->kacts)
+			return true;
+		if (epoll_ctl(pp->kfd, EPOLL_CTL_DEL, fd, &ev) == 0
+		or  errno == ENOENT or errno == EBADF)
+			return true;
+		PyErr_SetFromErrno(rpcError);
+		return false;
+	}
+	/* a new owner or a new file means a new registration */
+	if (not fp->kacts or fp->kowner != fp->owner or fp->kgen != fp->gen)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+	if (epoll_ctl(pp->kfd, op, fd, &ev) == 0)
+		return true;
+	if (op == EPOLL_CTL_ADD and errno == EEXIST)
+		op = EPOLL_CTL_MOD;
+	else if (op == EPOLL_CTL_MOD and errno == ENOENT)
+		op = EPOLL_CTL_ADD;
+	else {
+		PyErr_SetFromErrno(rpcError);
+		return false;
+	}
+	if (epoll_ctl(pp->kfd, op, fd, &ev) == 0)
+		return true;
+	PyErr_SetFromErrno(rpcError);
+	return false;
+}
+
+
+static bool
+epollWait(rpcPoller *pp, double timeout)
+{
+	struct epoll_event	*evs;
+	int			i,
+				ms,
+				acts,
+				nEvents;
+	uint			flags;
+
+	if (timeout < 0.0)
+		ms = -1;
+	else if (timeout * 1000.0 >= (double)INT_MAX)
+		ms = INT_MAX;
+	else
+		ms = (int)ceil(timeout * 1000.0);
+	evs = pp->kevs;
+	Py_BEGIN_ALLOW_THREADS
+	nEvents = epoll_wait(pp->kfd, evs, pp->evall, ms);
+	Py_END_ALLOW_THREADS
+	if (nEvents < 0) {
+		PyErr_SetFromErrno(rpcError);
+		return false;
+	}
+	for (i = 0; i < nEvents; ++i) {
+		flags = evs[i].events;
+		acts = 0;
+		if (flags & EPOLLIN)
+			acts |= ACT_INPUT;
+		if (flags & EPOLLOUT)
+			acts |= ACT_OUTPUT;
+		if (flags & EPOLLPRI)
+			acts |= ACT_EXCEPT;
+		/* let the reader or writer find out about the error */
+		if (flags & (EPOLLERR|EPOLLHUP))
+			acts |= ACT_INPUT|ACT_OUTPUT;
+		unless (pollerAddEv(pp, evs[i].data.fd, acts))
+			return false;
+	}
+	/* the buffer was filled, so make room for more next time */
+	if (nEvents == pp->evall) {
+		evs = ralloc(pp->kevs, 2 * pp->evall * sizeof(*evs));
+		if (evs == NULL)
+			return false;
+		pp->kevs = evs;
+		pp->evall *= 2;
+		pp->evs = ralloc(pp->evs, pp->evall * sizeof(*pp->evs));
+		if (pp->evs == NULL)
+			return false;
+	}
+
+	return true;
+}
+#endif /* USE_EPOLL */
+
+
+#ifdef USE_KQUEUE
+static bool
+kqueueChange(rpcPoller *pp, int fd, int filter, bool add)
+{
+	struct kevent	kev;
+
+	EV_SET(&kev, fd, filter, add ? EV_ADD : EV_DELETE, 0, 0, NULL);
+	if (kevent(pp->kfd, &kev, 1, NULL, 0, NULL) == 0)
+		return true;
+	if (not add and (errno == ENOENT or errno == EBADF))
+		return true;
+	PyErr_SetFromErrno(rpcError);
+	return false;
+}
+
+
+/*
+ * kqueue has no notion of exceptional conditions, so ACT_EXCEPT is
+ * never reported by this backend
+ */
+static bool
+kqueueApply(rpcPoller *pp, int fd, rpcPollerFd *fp)
+{
+	bool	stale;
+
+	stale = (fp->kowner != fp->owner or fp->kgen != fp->gen);
+	if ((fp->acts & ACT_INPUT)
+	and (stale or not (fp->kacts & ACT_INPUT))) {
+		unless (kqueueChange(pp, fd, EVFILT_READ, true))
+			return false;
+	} else if (not (fp->acts & ACT_INPUT) and (fp->kacts & ACT_INPUT)) {
+		unless (kqueueChange(pp, fd, EVFILT_READ, false))
+			return false;
+	}
+	if ((fp->acts & ACT_OUTPUT)
+	and (stale or not (fp->kacts & ACT_OUTPUT))) {
+		unless (kqueueChange(pp, fd, EVFILT_WRITE, true))
+			return false;
+	} else if (not (fp->acts & ACT_OUTPUT) and (fp->kacts & ACT_OUTPUT)) {
+		unless (kqueueChange(pp, fd, EVFILT_WRITE, false))
+			return false;
+	}
+
+	return true;
+}
+
+
+static bool
+kqueueWait(rpcPoller *pp, double timeout)
+{
+	struct kevent	*evs;
+	struct timespec	ts,
+			*tsp;
+	int		i,
+			acts,
+			nEvents;
+
+	tsp = NULL;
+	if (timeout >= 0.0) {
+		ts.tv_sec = (time_t)floor(timeout);
+		ts.tv_nsec = (long)((timeout - floor(timeout)) * 1000000000.0);
+		tsp = &ts;
+	}
+	evs = pp->kevs;
+	Py_BEGIN_ALLOW_THREADS
+	nEvents = kevent(pp->kfd, NULL, 0, evs, pp->evall, tsp);
+	Py_END_ALLOW_THREADS
+	if (nEvents < 0) {
+		PyErr_SetFromErrno(rpcError);
+		return false;
+	}
+	for (i = 0; i < nEvents; ++i) {
+		if (evs[i].flags & EV_ERROR)
+			acts = ACT_INPUT|ACT_OUTPUT;
+		else if (evs[i].filter == EVFILT_READ)
+			acts = ACT_INPUT;
+		else if (evs[i].filter == EVFILT_WRITE)
+			acts = ACT_OUTPUT;
+		else
+			continue;
+		unless (pollerAddEv(pp, (int)evs[i].ident, acts))
+			return false;
+	}
+	if (nEvents == pp->evall) {
+		evs = ralloc(pp->kevs, 2 * pp->evall * sizeof(*evs));
+		if (evs == NULL)
+			return false;
+		pp->kevs = evs;
+		pp->evall *= 2;
+		pp->evs = ralloc(pp->evs, pp->evall * sizeof(*pp->evs));
+		if (pp->evs == NULL)
+			return false;
+	}
+
+	return true;
+}
+#endif /* USE_KQUEUE */
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2001, Shilad Sen, Sourcelight Technologies, Inc.
+ * See xmlrpc.h or the README for more copyright information.
+ *
+ * An object which waits for events on a set of file descriptors.
+ *
+ * Interest in a file descriptor is registered once and kept across
+ * calls to rpcPollerWait(), so a wakeup only costs as much as the
+ * number of descriptors that are actually ready.  Changes are queued
+ * and only pushed to the kernel right before the next wait, which
+ * means a source that is removed and re-added with the same interest
+ * inside one dispatch iteration costs no system calls at all.
+ *
+ * epoll is used on Linux and kqueue on the BSDs; everything else falls
+ * back to select().
+ */
+
+
+#ifndef _RPCPOLLER_H_
+#define _RPCPOLLER_H_
+
+
+#include "rpcInclude.h"
+
+
+#define	POLLER_SELECT	0
+#define	POLLER_EPOLL	1
+#define	POLLER_KQUEUE	2
+
+
+/*
+ * per file descriptor state
+ */
+typedef struct {
+	int		acts,		/* actions that are wanted */
+			kacts;		/* actions registered with the kernel */
+	uint		gen,		/* generation of the wanted fd */
+			kgen;		/* generation of the registered fd */
+	void		*owner,		/* who wants the events */
+			*kowner;	/* who registered with the kernel */
+	bool		dirty;		/* is the fd on the change list? */
+} rpcPollerFd;
+
+
+/*
+ * an event returned by rpcPollerWait()
+ */
+typedef struct {
+	int		fd,		/* the file descriptor */
+			acts;		/* actions that occured */
+	void		*owner;		/* who wanted the events */
+} rpcPollerEv;
+
+
+typedef struct {
+	int		backend,	/* one of the POLLER_* values */
+			kfd,		/* epoll or kqueue descriptor */
+			nfds,		/* fds with some interest */
+			maxfd,		/* highest fd with some interest */
+			fdall,		/* size of the fd table */
+			nchg,		/* number of pending changes */
+			chgall,		/* size of the change list */
+			nevs,		/* number of events from last wait */
+			evall;		/* size of the event arrays */
+	rpcPollerFd	*fds;		/* table indexed by file descriptor */
+	int		*chg;		/* fds with pending changes */
+	rpcPollerEv	*evs;		/* events from the last wait */
+	void		*kevs;		/* backend specific event buffer */
+} rpcPoller;
+
+
+rpcPoller	*rpcPollerNew(void);
+void		rpcPollerFree(rpcPoller *pp);
+char		*rpcPollerName(rpcPoller *pp);
+bool		rpcPollerAfterFork(rpcPoller *pp);
+bool		rpcPollerSet(
+			rpcPoller	*pp,
+			int		fd,
+			int		acts,
+			void		*owner,
+			uint		gen
+		);
+void		rpcPollerUnset(rpcPoller *pp, int fd, void *owner);
+bool		rpcPollerWait(rpcPoller *pp, double timeout);
+
+
+#endif /* _RPCPOLLER_H_ */
@@ -0,0 +1,620 @@
+/*
+ * Copyright (C) 2001, Shilad Sen, Sourcelight Technologies, Inc.
+ * See xmlrpc.h or the README for more copyright information.
+ */
+
+
+#include "xmlrpc.h"
+#include "rpcInternal.h"
+#include <assert.h>
+#include <string.h>
+
+
+#define	CALL_METHOD	0		/* fields of a queued call */
+#define	CALL_PARAMS	1
+#define	CALL_FUNC	2
+#define	CALL_ARGS	3
+#define	CALL_OWNER	4
+#define	CALL_NAME	5
+#define	CALL_PASS	6
+
+#define	QUEUE_SLACK	64		/* sent calls kept before trimming */
+
+
+static	rpcPool		*poolNewFromDisp(
+				char		*host,
+				int		port,
+				char		*url,
+				int		nclients,
+				rpcDisp		*dp
+			);
+static	bool		poolFill(rpcPool *pp);
+static	bool		poolSend(rpcPool *pp, rpcClient *cp, PyObject *call);
+static	bool		poolFail(rpcClient *cp, PyObject *call);
+static	bool		poolString(PyObject *obj, char **strp);
+static	bool		poolTrim(rpcPool *pp);
+static	bool		poolCallback(
+				rpcClient	*cp,
+				PyObject	*resp,
+				PyObject	*args
+			);
+static	int		poolTraverse(rpcPool *pp, visitproc visit, void *arg);
+static	int		poolClear(rpcPool *pp);
+static	PyObject	*pyRpcPoolGetAttr(rpcPool *pp, char *name);
+
+
+rpcPool *
+rpcPoolNew(char *host, int port, char *url, int nclients)
+{
+	rpcDisp		*dp;
+	rpcPool		*pp;
+
+	dp = rpcDispNew();
+	if (dp == NULL)
+		return NULL;
+	pp = poolNewFromDisp(host, port, url, nclients, dp);
+	Py_DECREF(dp);
+
+	return pp;
+}
+
+
+rpcPool *
+rpcPoolNewFromServer(
+	char		*host,
+	int		port,
+	char		*url,
+	int		nclients,
+	rpcServer	*servp
+)
+{
+	return poolNewFromDisp(host, port, url, nclients, servp->disp);
+}
+
+
+static rpcPool *
+poolNewFromDisp(char *host, int port, char *url, int nclients, rpcDisp *dp)
+{
+	rpcPool		*pp;
+	rpcClient	*cp;
+
+	if (nclients < 1) {
+		PyErr_SetString(rpcError, "a pool needs at least one client");
+		return NULL;
+	}
+	pp = PyObject_GC_New(rpcPool, &rpcPoolType);
+	if (pp == NULL)
+		return NULL;
+	pp->disp = dp;
+	Py_INCREF(dp);
+	pp->nclients = 0;
+	pp->qhead = 0;
+	pp->clients = NULL;
+	pp->queue = PyList_New(0);
+	if (pp->queue == NULL) {
+		Py_DECREF(pp);
+		return NULL;
+	}
+	pp->clients = alloc(nclients * sizeof(*pp->clients));
+	if (pp->clients == NULL) {
+		Py_DECREF(pp);
+		return NULL;
+	}
+	while (pp->nclients < nclients) {
+		cp = rpcClientNewFromDisp(host, port, url, dp);
+		if (cp == NULL) {
+			Py_DECREF(pp);
+			return NULL;
+		}
+		pp->clients[pp->nclients++] = cp;
+	}
+	PyObject_GC_Track(pp);
+
+	return pp;
+}
+
+
+void
+rpcPoolDealloc(rpcPool *pp)
+{
+	int		i;
+
+	PyObject_GC_UnTrack(pp);
+	for (i = 0; i < pp->nclients; ++i)
+		Py_DECREF(pp->clients[i]);
+	if (pp->clients)
+		free(pp->clients);
+	Py_XDECREF(pp->queue);
+	Py_DECREF(pp->disp);
+	PyObject_GC_Del(pp);
+}
+
+
+/*
+ * The calls in flight hold the pool, and the queued calls may too, so
+ * the pool is seen to by the garbage collector.  Its clients are its
+ * alone, so their calls and error handlers are visited as its own.
+ */
+static int
+poolTraverse(rpcPool *pp, visitproc visit, void *arg)
+{
+	rpcClient	*cp;
+	int		i,
+			j;
+
+	Py_VISIT(pp->queue);
+	for (i = 0; i < pp->nclients; ++i) {
+		cp = pp->clients[i];
+		for (j = 0; j < cp->ncalls; ++j)
+			Py_VISIT(cp->calls[j].funcArgs);
+		if (cp->src->onErrType == ONERR_TYPE_PY)
+			Py_VISIT((PyObject *)cp->src->onErr);
+	}
+
+	return 0;
+}
+
+
+/*
+ * break the cycles through the pool: its calls are dropped unanswered
+ */
+static int
+poolClear(rpcPool *pp)
+{
+	int		i;
+
+	for (i = 0; i < pp->nclients; ++i) {
+		rpcClientAbandon(pp->clients[i]);
+		rpcSourceSetOnErr(pp->clients[i]->src, ONERR_TYPE_DEF, NULL);
+	}
+	Py_CLEAR(pp->queue);
+	pp->qhead = 0;
+
+	return 0;
+}
+
+
+void
+rpcPoolClose(rpcPool *pp)
+{
+	int		i;
+
+	for (i = 0; i < pp->nclients; ++i)
+		rpcClientClose(pp->clients[i]);
+}
+
+
+/*
+ * Queue a call and send it at once if a client is idle.  pyfunc is
+ * called with owner, the response and extArgs once the response is in.
+ * method, name and pass are strings; name and pass may be None.
+ */
+bool
+rpcPoolNbExecute(
+	rpcPool		*pp,
+	PyObject	*method,
+	PyObject	*params,
+	PyObject	*pyfunc,
+	PyObject	*extArgs,
+	PyObject	*owner,
+	PyObject	*name,
+	PyObject	*pass
+)
+{
+	PyObject	*call;
+	int		res;
+
+	call = Py_BuildValue("(O,O,O,O,O,O,O)", method, params, pyfunc,
+				extArgs, owner, name, pass);
+	if (call == NULL)
+		return false;
+	res = PyList_Append(pp->queue, call);
+	Py_DECREF(call);
+	if (res)
+		return false;
+
+	return poolFill(pp);
+}
+
+
+/*
+ * the number of calls which are queued or in flight
+ */
+long
+rpcPoolPending(rpcPool *pp)
+{
+	long		pending;
+	int		i;
+
+	pending = PyList_GET_SIZE(pp->queue) - pp->qhead;
+	for (i = 0; i < pp->nclients; ++i)
+		if (pp->clients[i]->execing)
+			pending++;
+
+	return pending;
+}
+
+
+/*
+ * Send queued calls on the idle clients.  A client whose call failed is
+ * idle again, so this is also how the pool gets going after an error.
+ * A call that cannot be sent is answered with a fault at once; only an
+ * error from its callback stops the filling.
+ */
+static bool
+poolFill(rpcPool *pp)
+{
+	rpcClient	*cp;
+	PyObject	*call;
+	int		i;
+	bool		res;
+
+	res = true;
+	i = 0;
+	while (i < pp->nclients and pp->qhead < PyList_GET_SIZE(pp->queue)) {
+		cp = pp->clients[i];
+		if (cp->execing) {
+			i++;
+			continue;
+		}
+		call = PyList_GET_ITEM(pp->queue, pp->qhead);
+		Py_INCREF(call);
+		Py_INCREF(Py_None);
+		PyList_SetItem(pp->queue, pp->qhead, Py_None);
+		pp->qhead++;
+		unless (poolSend(pp, cp, call))
+			res = poolFail(cp, call);
+		Py_DECREF(call);
+		unless (res)
+			break;
+	}
+	unless (poolTrim(pp))
+		return false;
+
+	return res;
+}
+
+
+static bool
+poolSend(rpcPool *pp, rpcClient *cp, PyObject *call)
+{
+	PyObject	*args;
+	char		*method,
+			*name,
+			*pass;
+	bool		res;
+
+	unless (poolString(PyTuple_GET_ITEM(call, CALL_METHOD), &method)
+	and     poolString(PyTuple_GET_ITEM(call, CALL_NAME), &name)
+	and     poolString(PyTuple_GET_ITEM(call, CALL_PASS), &pass))
+		return false;
+	args = Py_BuildValue("(O,O,O,O)", pp,
+				PyTuple_GET_ITEM(call, CALL_FUNC),
+				PyTuple_GET_ITEM(call, CALL_ARGS),
+				PyTuple_GET_ITEM(call, CALL_OWNER));
+	if (args == NULL)
+		return false;
+	res = rpcClientNbExecute(cp, method, PyTuple_GET_ITEM(call, CALL_PARAMS),
+				poolCallback, args, name, pass);
+	Py_DECREF(args);
+
+	return res;
+}
+
+
+/*
+ * Sending call failed: hand its callback a fault carrying the error
+ * instead, which is cleared.  False if the callback raises.
+ */
+static bool
+poolFail(rpcClient *cp, PyObject *call)
+{
+	PyObject	*exc,
+			*v,
+			*tb,
+			*str,
+			*addInfo,
+			*resp,
+			*res;
+
+	PyErr_Fetch(&exc, &v, &tb);
+	str = PyObject_Str(v ? v : exc);
+	Py_XDECREF(exc);
+	Py_XDECREF(v);
+	Py_XDECREF(tb);
+	if (str == NULL)
+		return false;
+	rpcLogSrc(3, cp->src, "pool could not send a call: %s",
+		PyString_AS_STRING(str));
+	addInfo = PyDict_New();
+	if (addInfo == NULL) {
+		Py_DECREF(str);
+		return false;
+	}
+	resp = buildFault(-1, PyString_AS_STRING(str), addInfo, cp->encFlags);
+	Py_DECREF(addInfo);
+	Py_DECREF(str);
+	if (resp == NULL)
+		return false;
+	res = PyObject_CallFunctionObjArgs(PyTuple_GET_ITEM(call, CALL_FUNC),
+						PyTuple_GET_ITEM(call, CALL_OWNER),
+						resp,
+						PyTuple_GET_ITEM(call, CALL_ARGS),
+						NULL);
+	Py_DECREF(resp);
+	unless (res)
+		return false;
+	Py_DECREF(res);
+
+	return true;
+}
+
+
+/*
+ * the bytes of a string, or NULL for None
+ */
+static bool
+poolString(PyObject *obj, char **strp)
+{
+	Py_ssize_t	len;
+
+	if (obj == Py_None) {
+		*strp = NULL;
+		return true;
+	}
+	return PyString_AsStringAndSize(obj, strp, &len) == 0;
+}
+
+
+/*
+ * drop the calls that have been sent from the front of the queue, once
+ * they are most of it
+ */
+static bool
+poolTrim(rpcPool *pp)
+{
+	long		qlen;
+
+	qlen = PyList_GET_SIZE(pp->queue);
+	if (pp->qhead < qlen and (pp->qhead < QUEUE_SLACK or pp->qhead * 2 < qlen))
+		return true;
+	if (PyList_SetSlice(pp->queue, 0, pp->qhead, NULL))
+		return false;
+	pp->qhead = 0;
+
+	return true;
+}
+
+
+/*
+ * A call is done: run its callback and give the client the next call.
+ * args is (pool, pyfunc, extArgs, owner).
+ */
+static bool
+poolCallback(rpcClient *cp, PyObject *resp, PyObject *args)
+{
+	PyObject	*res;
+
+	assert(PyTuple_Check(args));
+	assert(PyTuple_GET_SIZE(args) == 4);
+	res = PyObject_CallFunctionObjArgs(PyTuple_GET_ITEM(args, 1),
+						PyTuple_GET_ITEM(args, 3),
+						resp,
+						PyTuple_GET_ITEM(args, 2),
+						NULL);
+	unless (res)
+		return false;
+	Py_DECREF(res);
+
+	return poolFill((rpcPool *)PyTuple_GET_ITEM(args, 0));
+}
+
+
+/*
+ * queue up a call; see rpcPoolNbExecute()
+ */
+static PyObject *
+pyRpcPoolNbExecute(PyObject *self, PyObject *args)
+{
+	PyObject	*method,
+			*params,
+			*pyfunc,
+			*extArgs,
+			*owner,
+			*pyName,
+			*pyPass;
+
+	owner = self;
+	unless (PyArg_ParseTuple(args, "OOOOOO|O", &method, &params,
+				&pyfunc, &extArgs, &pyName, &pyPass, &owner))
+		return NULL;
+	unless (PyString_Check(method))
+		return setPyErr("method must be a string");
+	unless (PySequence_Check(params))
+		return setPyErr("execute params must be a sequence");
+	unless (PyCallable_Check(pyfunc))
+		return setPyErr("callback must be callable");
+	unless (pyName == Py_None or PyString_Check(pyName))
+		return setPyErr("name must be a string or None");
+	unless (pyPass == Py_None or PyString_Check(pyPass))
+		return setPyErr("pass must be a string or None");
+	unless (rpcPoolNbExecute((rpcPool *)self, method, params, pyfunc,
+					extArgs, owner, pyName, pyPass))
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+/*
+ * Work on the pool's connections for a while
+ */
+static PyObject *
+pyRpcPoolWork(PyObject *self, PyObject *args)
+{
+	rpcPool		*pp;
+	bool		timedOut;
+	double		timeout;
+
+	pp = (rpcPool *)self;
+	unless ((PyArg_ParseTuple(args, "d", &timeout))
+	and     (poolFill(pp))
+	and     (rpcDispWork(pp->disp, timeout, &timedOut)))
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+/*
+ * The number of calls queued or in flight
+ */
+static PyObject *
+pyRpcPoolPending(PyObject *self, PyObject *args)
+{
+	unless (PyArg_ParseTuple(args, ""))
+		return NULL;
+
+	return PyInt_FromLong(rpcPoolPending((rpcPool *)self));
+}
+
+
+/*
+ * Set a handler for errors on every connection of the pool
+ */
+static PyObject *
+pyRpcPoolSetOnErr(PyObject *self, PyObject *args)
+{
+	PyObject	*func;
+	rpcPool		*pp;
+	int		i;
+
+	pp = (rpcPool *)self;
+	unless (PyArg_ParseTuple(args, "O", &func))
+		return NULL;
+	unless (func == Py_None or PyCallable_Check(func)) {
+		PyErr_SetString(rpcError, "error handler must be callable");
+		return NULL;
+	}
+	for (i = 0; i < pp->nclients; ++i)
+		if (func != Py_None)
+			rpcSourceSetOnErr(pp->clients[i]->src, ONERR_TYPE_PY,
+						func);
+		else
+			rpcSourceSetOnErr(pp->clients[i]->src, ONERR_TYPE_DEF,
+						NULL);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+/*
+ * Turn compact (unindented) encoding of requests on or off
+ */
+static PyObject *
+pyRpcPoolSetCompact(PyObject *self, PyObject *args)
+{
+	rpcPool		*pp;
+	int		compact,
+			i;
+
+	pp = (rpcPool *)self;
+	unless (PyArg_ParseTuple(args, "i", &compact))
+		return NULL;
+	for (i = 0; i < pp->nclients; ++i)
+		if (compact)
+			pp->clients[i]->encFlags |= ENC_COMPACT;
+		else
+			pp->clients[i]->encFlags &= ~ENC_COMPACT;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+/*
+ * The file descriptors the pool is waiting on
+ */
+static PyObject *
+pyRpcPoolActiveFds(PyObject *self, PyObject *args)
+{
+	unless (PyArg_ParseTuple(args, ""))
+		return NULL;
+
+	return rpcDispActiveFds(((rpcPool *)self)->disp);
+}
+
+
+/*
+ * Close the pool's connections; they are opened again as calls need them
+ */
+static PyObject *
+pyRpcPoolClose(PyObject *self, PyObject *args)
+{
+	unless (PyArg_ParseTuple(args, ""))
+		return NULL;
+	rpcPoolClose((rpcPool *)self);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+/*
+ * member functions for pool object
+ */
+static PyMethodDef pyRpcPoolMethods[] = {
+	{ "activeFds",	(PyCFunction)pyRpcPoolActiveFds,	1,	0 },
+	{ "close",	(PyCFunction)pyRpcPoolClose,		1,	0 },
+	{ "nbexecute",	(PyCFunction)pyRpcPoolNbExecute,	1,	0 },
+	{ "pending",	(PyCFunction)pyRpcPoolPending,		1,	0 },
+	{ "setCompact",	(PyCFunction)pyRpcPoolSetCompact,	1,	0 },
+	{ "setOnErr",	(PyCFunction)pyRpcPoolSetOnErr,		1,	0 },
+	{ "work",	(PyCFunction)pyRpcPoolWork,		1,	0 },
+	{ NULL,		NULL},
+};
+
+
+/*
+ * return an attribute for a pool object
+ */
+static PyObject *
+pyRpcPoolGetAttr(rpcPool *pp, char *name)
+{
+	return Py_FindMethod(pyRpcPoolMethods, (PyObject *)pp, name);
+}
+
+
+/*
+ * map characterstics of a pool object
+ */
+PyTypeObject rpcPoolType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "rpcPool",
+	.tp_basicsize = sizeof(rpcPool),
+	.tp_itemsize = 0,
+	.tp_dealloc = (destructor)rpcPoolDealloc,
+	.tp_getattr = (getattrfunc)pyRpcPoolGetAttr,
+	.tp_setattr = NULL,
+#if PY_MAJOR_VERSION < 3
+	.tp_print = NULL,
+	.tp_compare = NULL,
+#endif
+	.tp_repr = NULL,
+	.tp_as_number = NULL,
+	.tp_as_sequence = NULL,
+	.tp_as_mapping = NULL,
+	.tp_hash = NULL,
+	.tp_call = NULL,
+	.tp_str = NULL,
+	.tp_getattro = NULL,
+	.tp_setattro = NULL,
+	.tp_as_buffer = NULL,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+	.tp_doc = NULL,
+	.tp_traverse = (traverseproc)poolTraverse,
+	.tp_clear = (inquiry)poolClear
+};
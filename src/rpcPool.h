@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2001, Shilad Sen, Sourcelight Technologies, Inc.
+ * See xmlrpc.h or the README for more copyright information.
+ *
+ * A pool of keep-alive connections to one xmlrpc server.
+ *
+ * Calls are queued on the pool and each is sent on whichever of its
+ * clients is idle, so that up to nclients calls are in flight at once.
+ * A call's callback is run as soon as its response is in, and the
+ * client then moves straight on to the next queued call.
+ */
+
+#ifndef _RPCPOOL_H_
+#define _RPCPOOL_H_
+
+
+#include "rpcInclude.h"
+#include "rpcClient.h"
+#include "rpcDispatch.h"
+#include "rpcServer.h"
+
+
+extern	PyTypeObject	rpcPoolType;
+
+
+typedef struct {
+	PyObject_HEAD			/* python standard */
+	rpcDisp		*disp;		/* shared by the clients */
+	int		nclients;
+	rpcClient	**clients;
+	PyObject	*queue;		/* calls waiting for a client */
+	long		qhead;		/* the first of them in queue */
+} rpcPool;
+
+
+rpcPool		*rpcPoolNew(char *host, int port, char *url, int nclients);
+rpcPool		*rpcPoolNewFromServer(
+			char		*host,
+			int		port,
+			char		*url,
+			int		nclients,
+			rpcServer	*servp
+		);
+void		rpcPoolDealloc(rpcPool *pp);
+bool		rpcPoolNbExecute(
+			rpcPool		*pp,
+			PyObject	*method,
+			PyObject	*params,
+			PyObject	*pyfunc,
+			PyObject	*extArgs,
+			PyObject	*owner,
+			PyObject	*name,
+			PyObject	*pass
+		);
+long		rpcPoolPending(rpcPool *pp);
+void		rpcPoolClose(rpcPool *pp);
+
+
+#endif /* _RPCPOOL_H_ */
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2001, Shilad Sen, Sourcelight Technologies, Inc.
+ * See xmlrpc.h or the README for more copyright information.
+ */
+
+
+#include "xmlrpc.h"
+#include "rpcInternal.h"
+#include "rpcScan.h"
+#include <string.h>
+
+#if defined(__AVX2__)
+	#include <immintrin.h>
+	#define	SCAN_AVX2
+#elif defined(__SSE2__) || defined(_M_X64)
+	#include <emmintrin.h>
+	#define	SCAN_SSE2
+#endif
+
+
+static	uint		firstBit(uint mask);
+static	uint		countBits(uint mask);
+
+
+/*
+ * characters that end a run of text: the start of a tag, an escape
+ * sequence or a line
+ */
+static const uchar	isMarkup[256] = {
+	['<'] = 1, ['&'] = 1, ['\n'] = 1
+};
+
+static const uchar	isSpace[256] = {
+	[' '] = 1, ['\t'] = 1, ['\r'] = 1, ['\n'] = 1
+};
+
+
+/*
+ * return the first '<', '&' or '\n' in [cp, ep), or ep if there is none
+ */
+char *
+rpcScanMarkup(char *cp, char *ep)
+{
+#if defined(SCAN_AVX2)
+	__m256i		lt, amp, nl, v;
+	uint		mask;
+
+	lt = _mm256_set1_epi8('<');
+	amp = _mm256_set1_epi8('&');
+	nl = _mm256_set1_epi8('\n');
+	for (; ep - cp >= 32; cp += 32) {
+		v = _mm256_loadu_si256((__m256i *)cp);
+		mask = (uint)_mm256_movemask_epi8(_mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, lt),
+						_mm256_cmpeq_epi8(v, amp)),
+				_mm256_cmpeq_epi8(v, nl)));
+		if (mask)
+			return cp + firstBit(mask);
+	}
+#elif defined(SCAN_SSE2)
+	__m128i		lt, amp, nl, v;
+	uint		mask;
+
+	lt = _mm_set1_epi8('<');
+	amp = _mm_set1_epi8('&');
+	nl = _mm_set1_epi8('\n');
+	for (; ep - cp >= 16; cp += 16) {
+		v = _mm_loadu_si128((__m128i *)cp);
+		mask = (uint)_mm_movemask_epi8(_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, lt),
+					     _mm_cmpeq_epi8(v, amp)),
+				_mm_cmpeq_epi8(v, nl)));
+		if (mask)
+			return cp + firstBit(mask);
+	}
+#endif
+	for (; cp < ep; ++cp)
+		if (isMarkup[(uchar)*cp])
+			return cp;
+	return ep;
+}
+
+
+/*
+ * return the first '<' or '&' in [cp, ep), or ep if there is none
+ */
+char *
+rpcScanEscape(char *cp, char *ep)
+{
+#if defined(SCAN_AVX2)
+	__m256i		lt, amp, v;
+	uint		mask;
+
+	lt = _mm256_set1_epi8('<');
+	amp = _mm256_set1_epi8('&');
+	for (; ep - cp >= 32; cp += 32) {
+		v = _mm256_loadu_si256((__m256i *)cp);
+		mask = (uint)_mm256_movemask_epi8(_mm256_or_si256(
+				_mm256_cmpeq_epi8(v, lt),
+				_mm256_cmpeq_epi8(v, amp)));
+		if (mask)
+			return cp + firstBit(mask);
+	}
+#elif defined(SCAN_SSE2)
+	__m128i		lt, amp, v;
+	uint		mask;
+
+	lt = _mm_set1_epi8('<');
+	amp = _mm_set1_epi8('&');
+	for (; ep - cp >= 16; cp += 16) {
+		v = _mm_loadu_si128((__m128i *)cp);
+		mask = (uint)_mm_movemask_epi8(_mm_or_si128(
+				_mm_cmpeq_epi8(v, lt),
+				_mm_cmpeq_epi8(v, amp)));
+		if (mask)
+			return cp + firstBit(mask);
+	}
+#endif
+	for (; cp < ep; ++cp)
+		if (*cp == '<' or *cp == '&')
+			return cp;
+	return ep;
+}
+
+
+/*
+ * skip spaces, tabs and line ends, counting the lines as we go
+ */
+char *
+rpcScanSpace(char *cp, char *ep, ulong *lines)
+{
+#if defined(SCAN_AVX2) || defined(SCAN_SSE2)
+	uint		mask,
+			lmask;
+#endif
+#if defined(SCAN_AVX2)
+	__m256i		sp, tab, cr, nl, v, isnl;
+
+	if (cp < ep and not isSpace[(uchar)*cp])	/* the usual case */
+		return cp;
+	sp = _mm256_set1_epi8(' ');
+	tab = _mm256_set1_epi8('\t');
+	cr = _mm256_set1_epi8('\r');
+	nl = _mm256_set1_epi8('\n');
+	for (; ep - cp >= 32; cp += 32) {
+		v = _mm256_loadu_si256((__m256i *)cp);
+		isnl = _mm256_cmpeq_epi8(v, nl);
+		lmask = (uint)_mm256_movemask_epi8(isnl);
+		mask = ~(uint)_mm256_movemask_epi8(_mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, sp),
+						_mm256_cmpeq_epi8(v, tab)),
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), isnl)));
+		if (mask) {
+			mask = firstBit(mask);
+			*lines += countBits(lmask & ((1u << mask) - 1));
+			return cp + mask;
+		}
+		*lines += countBits(lmask);
+	}
+#elif defined(SCAN_SSE2)
+	__m128i		sp, tab, cr, nl, v, isnl;
+
+	if (cp < ep and not isSpace[(uchar)*cp])	/* the usual case */
+		return cp;
+	sp = _mm_set1_epi8(' ');
+	tab = _mm_set1_epi8('\t');
+	cr = _mm_set1_epi8('\r');
+	nl = _mm_set1_epi8('\n');
+	for (; ep - cp >= 16; cp += 16) {
+		v = _mm_loadu_si128((__m128i *)cp);
+		isnl = _mm_cmpeq_epi8(v, nl);
+		lmask = (uint)_mm_movemask_epi8(isnl);
+		mask = ~(uint)_mm_movemask_epi8(_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, sp),
+					     _mm_cmpeq_epi8(v, tab)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, cr), isnl)))
+			& 0xffff;
+		if (mask) {
+			mask = firstBit(mask);
+			*lines += countBits(lmask & ((1u << mask) - 1));
+			return cp + mask;
+		}
+		*lines += countBits(lmask);
+	}
+#endif
+	for (; cp < ep and isSpace[(uchar)*cp]; ++cp)
+		if (*cp == '\n')
+			(*lines)++;
+	return cp;
+}
+
+
+/*
+ * return the first occurence of the len bytes at str in [cp, ep), or
+ * NULL if there is none
+ */
+char *
+rpcScanStr(char *cp, char *ep, char *str, long len)
+{
+	while (ep - cp >= len) {
+		cp = memchr(cp, *str, ep - cp - len + 1);
+		if (cp == NULL)
+			return NULL;
+		if (memcmp(cp, str, len) == 0)
+			return cp;
+		cp++;
+	}
+	return NULL;
+}
+
+
+static uint
+firstBit(uint mask)
+{
+#if defined(__GNUC__)
+	return (uint)__builtin_ctz(mask);
+#else
+	uint	i;
+
+	for (i = 0; not (mask & 1); ++i)
+		mask >>= 1;
+	return i;
+#endif
+}
+
+
+static uint
+countBits(uint mask)
+{
+#if defined(__GNUC__)
+	return (uint)__builtin_popcount(mask);
+#else
+	uint	i;
+
+	for (i = 0; mask; ++i)
+		mask &= mask - 1;
+	return i;
+#endif
+}
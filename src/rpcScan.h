@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2001, Shilad Sen, Sourcelight Technologies, Inc.
+ * See xmlrpc.h or the README for more copyright information.
+ *
+ * Bulk scanning of xml text for the decoder.
+ *
+ * The decoder spends most of its time looking for the end of a string
+ * or the end of a run of whitespace.  These routines look at 16 (SSE2)
+ * or 32 (AVX2) bytes at a time where the compiler allows it, and fall
+ * back to a table driven loop or memchr() elsewhere.
+ */
+
+
+#ifndef _RPCSCAN_H_
+#define _RPCSCAN_H_
+
+
+#include "rpcInclude.h"
+
+
+char		*rpcScanMarkup(char *cp, char *ep);
+char		*rpcScanEscape(char *cp, char *ep);
+char		*rpcScanSpace(char *cp, char *ep, ulong *lines);
+char		*rpcScanStr(char *cp, char *ep, char *str, long len);
+
+
+#endif /* _RPCSCAN_H_ */
@@ -4,25 +4,32 @@
  */
 
 
+#include "xmlrpc.h"		/* first: pyconfig.h sets _GNU_SOURCE */
+#include "rpcInternal.h"
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
-#include "xmlrpc.h"
-#include "rpcInternal.h"
 
 
 #ifdef MSWINDOWS
 	#include <winsock2.h>
 #else
 	#define CLOSE_ON_EXEC	FD_CLOEXEC
+	#include <sys/mman.h>
 	#include <sys/socket.h>
 	#include <netinet/in.h>
 	#include <unistd.h>
 #endif
 
 
-#define	READ_SIZE	4096
+#define	ACCEPT_BUDGET	64		/* default most accepts per wakeup */
+
+#if PY_VERSION_HEX >= 0x03090000
+	#define	VECTORCALL	PyObject_Vectorcall
+#elif PY_VERSION_HEX >= 0x03080000
+	#define	VECTORCALL	_PyObject_Vectorcall
+#endif
 
 
 static	bool		serveAccept(
@@ -43,6 +50,19 @@ static	bool		readRequest(
 				int		actions,
 				PyObject	*params
 			);
+static	bool		startRequest(
+				rpcDisp		*dp,
+				rpcSource	*srcp,
+				PyObject	*servp,
+				bool		eof
+			);
+static	PyObject	*serverUri(rpcServer *servp, char *bp, long len);
+static	bool		readBody(
+				rpcDisp		*dp,
+				rpcSource	*srcp,
+				PyObject	*servp,
+				bool		eof
+			);
 static	bool		writeResponse(
 				rpcDisp		*dp,
 				rpcSource	*sp,
@@ -52,15 +72,36 @@ static	bool		writeResponse(
 static	bool		doResponse(
 				rpcServer	*servp,
 				rpcSource	*srcp,
-				PyObject	*result,
-				bool		keepAlive
+				PyObject	*result
 			);
 static	PyObject	*dispatch(
 				rpcServer	*servp,
 				rpcSource	*srcp,
-				PyObject	*request,
-				bool		*keepAlive
+				PyObject	*pyuri,
+				PyObject	*decoder
+			);
+static	bool		findHandler(
+				rpcServer	*servp,
+				rpcSource	*srcp,
+				PyObject	*decoder,
+				rpcMethod	*methp,
+				PyObject	**paramsp
+			);
+static	PyObject	*callHandler(
+				rpcMethod	*methp,
+				rpcServer	*servp,
+				rpcSource	*srcp,
+				PyObject	*pyuri,
+				PyObject	*params
+			);
+static	bool		submitRequest(
+				rpcServer	*servp,
+				rpcSource	*srcp,
+				PyObject	*pyuri,
+				PyObject	*decoder
 			);
+static	PyObject	*runRequest(PyObject *job);
+static	bool		finishRequest(PyObject *job, PyObject *result);
 static	bool		grabError(
 				int		*faultCode,
 				char		**faultString,
@@ -79,11 +120,34 @@ static	PyObject	*pyRpcServerGetAttr(rpcServer *sp, char *name);
 static	PyObject	*pyRpcServerQueueResponse(PyObject *self, PyObject *args);
 static	PyObject	*pyRpcServerQueueFault(PyObject *self, PyObject *args);
 static	PyObject	*pyRpcServerSetAuth(PyObject *self, PyObject *args);
+static	PyObject	*pyRpcServerSetCompact(PyObject *self, PyObject *args);
 static	PyObject	*pyRpcServerSetFdAndListen(PyObject *self, PyObject *args);
 static	PyObject	*pyRpcServerSetOnErr(PyObject *self, PyObject *args);
+static	PyObject	*pyRpcServerSetWorkers(PyObject *self, PyObject *args);
 static	PyObject	*pyRpcServerWork(PyObject *self, PyObject *args);
-static	bool		nbRead(int fd, PyObject **buffpp, bool *eof);
-static	bool		authenticate(rpcServer *servp, PyObject *addInfo);
+static	bool		authenticate(
+				rpcServer	*servp,
+				PyObject	*pyuri,
+				PyObject	*auth
+			);
+static	bool		acceptClient(
+				rpcDisp		*dp,
+				rpcSource	*sp,
+				rpcServer	*servp,
+				bool		*blocked
+			);
+static	void		connClosed(rpcSource *sp, PyObject *servp);
+static	bool		resumeAccept(rpcServer *servp);
+static	int		serverSocket(int port, int queue, bool reusePort);
+static	PyObject	*statsDict(rpcServerStats *stp);
+static	PyObject	*pyRpcServerFork(PyObject *self, PyObject *args);
+static	PyObject	*pyRpcServerSetReusePort(PyObject *self, PyObject *args);
+static	PyObject	*pyRpcServerSetMaxConns(PyObject *self, PyObject *args);
+static	PyObject	*pyRpcServerSetAcceptBudget(
+				PyObject	*self,
+				PyObject	*args
+			);
+static	PyObject	*pyRpcServerStats(PyObject *self, PyObject *args);
 
 
 rpcServer *
@@ -101,59 +165,97 @@ rpcServerNew(void)
 	if (sp->src == NULL)
 		return NULL;
 	sp->src->doClose = true;
-	sp->comtab = PyDict_New();
-	if (sp->comtab == NULL)
+	sp->methods = rpcMethodsNew();
+	if (sp->methods == NULL)
 		return NULL;
+	sp->lastUri = NULL;
 	sp->authFunc = NULL;
+	sp->encFlags = 0;
+	sp->streamSize = 0;
+	sp->workers = NULL;
+	sp->reusePort = false;
+	sp->port = -1;
+	sp->queue = 0;
+	sp->nprocs = 1;
+	sp->nconns = 0;
+	sp->maxConns = 0;
+	sp->acceptBudget = ACCEPT_BUDGET;
+	sp->paused = false;
+	memset(&sp->local, 0, sizeof(sp->local));
+#ifndef MSWINDOWS
+	sp->local.pid = getpid();
+#endif /* MSWINDOWS */
+	sp->stats = &sp->local;
+	sp->allStats = NULL;
 	return  sp;
 }
 
 
-void
+/*
+ * Stop listening and drop the connections.  Requests the workers have
+ * are answered first; false if that failed, with the error set.
+ */
+bool
 rpcServerClose(rpcServer *sp)
 {
-	if (sp->src->fd >= 0)
-		close(sp->src->fd);
-	sp->src->fd = -1;
+	bool		ok;
+
+	ok = true;
+	rpcSourceClose(sp->src);
+	if (sp->workers
+	and not rpcWorkersOnWorker(sp->workers)
+	and not sp->workers->finishing) {
+		ok = rpcWorkersStop(sp->workers);
+		rpcWorkersFree(sp->workers);
+		sp->workers = NULL;
+	}
 	rpcDispClear(sp->disp);
+
+	return ok;
 }
 
 
 void
 rpcServerDealloc(rpcServer *sp)
 {
+	if (sp->workers)
+		rpcWorkersFree(sp->workers);
+#ifndef MSWINDOWS
+	if (sp->allStats)
+		munmap(sp->allStats, sp->nprocs * sizeof(*sp->allStats));
+#endif /* MSWINDOWS */
+	rpcMethodsFree(sp->methods);
+	Py_XDECREF(sp->lastUri);
 	Py_DECREF(sp->src);
 	rpcDispDealloc(sp->disp);
 }
 
 
+/*
+ * add a method handled in C; see rpcCMethod for how cfunc is called
+ */
 bool
-rpcServerAddCMethod(
-	rpcServer 	*servp,
-	char		*method,
-	PyObject	*(*cfunc)(
-				rpcServer *,
-				rpcSource *,
-				char *,
-				char *,
-				PyObject *,
-				PyObject *
-			)
-)
+rpcServerAddCMethod(rpcServer *servp, char *method, rpcCMethod cfunc)
 {
-	PyObject	*pyfunc;
+	PyObject	*name;
+	bool		res;
 
-	pyfunc = PyString_FromStringAndSize((char*)&cfunc, sizeof(cfunc));
-	if (pyfunc == NULL)
-		return false;
-	if (PyDict_SetItemString(servp->comtab, method, pyfunc))
+	name = PyString_FromString(method);
+	if (name == NULL)
 		return false;
-	return true;
+	res = rpcMethodsAdd(servp->methods, name, cfunc, NULL, NULL);
+	Py_DECREF(name);
+
+	return res;
 }
 
 
+/*
+ * add the methods in the dictionary toAdd; their handlers get self as
+ * their first argument, or the server if self is NULL
+ */
 bool
-rpcServerAddPyMethods(rpcServer *sp, PyObject *toAdd)
+rpcServerAddPyMethods(rpcServer *sp, PyObject *toAdd, PyObject *self)
 {
 	PyObject	*items,
 			*elem,
@@ -174,23 +276,44 @@ rpcServerAddPyMethods(rpcServer *sp, PyObject *toAdd)
 		assert(PyTuple_GET_SIZE(elem) == 2);
 		method = PyTuple_GET_ITEM(elem, 0);
 		func = PyTuple_GET_ITEM(elem, 1);
-		unless (PyString_Check(method)) {
-			PyErr_SetString(rpcError, "method names must be strings");
-			return false;
-		}
-		unless (PyCallable_Check(func)) {
-			PyErr_SetString(rpcError, "method must be callable");
+		unless (rpcMethodsAdd(sp->methods, method, NULL, func, self)) {
+			Py_DECREF(items);
 			return false;
 		}
-		if (PyDict_SetItem(sp->comtab, method, func))
-			return false;
 	}
+	Py_DECREF(items);
 	return true;
 }
 
 
 bool 
 rpcServerBindAndListen(rpcServer *servp, int port, int queue)
+{
+	int		fd;
+
+	fd = serverSocket(port, queue, servp->reusePort);
+	if (fd < 0)
+		return false;
+	rpcSourceSetFd(servp->src, fd);
+	servp->port = port;
+	servp->queue = queue;
+	rpcLogSrc(3, servp->src, "server listening on port %d", port);
+	servp->src->actImp = ACT_INPUT;
+	servp->src->func = serveAccept;
+	servp->src->params = (PyObject *)servp;
+	unless (rpcDispAddSource(servp->disp, servp->src)) {
+		(void)rpcServerClose(servp);
+		return false;
+	}
+	return true;
+}
+
+
+/*
+ * a non-blocking socket listening on port, or -1 with a python error
+ */
+static int
+serverSocket(int port, int queue, bool reusePort)
 {
 	int			fd,
 				sflag;
@@ -204,7 +327,7 @@ rpcServerBindAndListen(rpcServer *servp, int port, int queue)
 	if ((fd == INVALID_SOCKET)
 	or  (ioctlsocket((SOCKET)fd, FIONBIO, &flag) == SOCKET_ERROR)) {
 		PyErr_SetFromErrno(rpcError);
-		return false;
+		return -1;
 	}
 #else
 	fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -212,18 +335,31 @@ rpcServerBindAndListen(rpcServer *servp, int port, int queue)
 	or  (fcntl(fd, F_SETFL, O_NONBLOCK) != 0)
 	or  (fcntl(fd, F_SETFD, CLOSE_ON_EXEC) != 0)) {
 		PyErr_SetFromErrno(rpcError);
-		return false;
+		if (fd >= 0)
+			close(fd);
+		return -1;
 	}
 #endif /* MSWINDOWS */
-	servp->src->fd = fd;
-
 	sflag = 1;
-	fd = servp->src->fd;
 	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
 		(void *)&sflag, sizeof(sflag)) != 0) {
-		rpcServerClose(servp);
 		PyErr_SetFromErrno(rpcError);
-		return false;
+		close(fd);
+		return -1;
+	}
+	if (reusePort) {
+#ifdef SO_REUSEPORT
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+			(void *)&sflag, sizeof(sflag)) != 0) {
+			PyErr_SetFromErrno(rpcError);
+			close(fd);
+			return -1;
+		}
+#else
+		setPyErr("SO_REUSEPORT is not supported on this platform");
+		close(fd);
+		return -1;
+#endif /* SO_REUSEPORT */
 	}
 	saddr.sin_family = AF_INET;
 	saddr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -231,18 +367,11 @@ rpcServerBindAndListen(rpcServer *servp, int port, int queue)
 	if ((bind(fd, (struct sockaddr *)&saddr, sizeof(saddr)) < 0)
 	or  (listen(fd, queue) < 0)) {
 		PyErr_SetFromErrno(rpcError);
-		rpcServerClose(servp);
-		return false;
-	}
-	rpcLogSrc(3, servp->src, "server listening on port %d", port);
-	servp->src->actImp = ACT_INPUT;
-	servp->src->func = serveAccept;
-	servp->src->params = (PyObject *)servp;
-	unless (rpcDispAddSource(servp->disp, servp->src)) {
-		rpcServerClose(servp);
-		return false;
+		close(fd);
+		return -1;
 	}
-	return true;
+
+	return fd;
 }
 
 
@@ -267,7 +396,7 @@ rpcServerSetFdAndListen(rpcServer *servp, int fd, int queue)
 #endif /* MSWINDOWS */
 	rpcLogSrc(3, servp->src, "server listening on fd %d", fd);
 /*	Py_INCREF(servp);	why was this here? */
-	servp->src->fd = fd;
+	rpcSourceSetFd(servp->src, fd);
 	servp->src->actImp = ACT_INPUT;
 	servp->src->func = serveAccept;
 	servp->src->params = (PyObject *)servp;
@@ -289,11 +418,207 @@ rpcServerSetAuth(rpcServer *sp, PyObject *authFunc)
 }
 
 
+/*
+ * Fork nprocs - 1 more processes to serve the server's port.  The
+ * parent gets 0 back and each child its own number, 1 to nprocs - 1;
+ * -1 means failure, with a python error.  A server bound with
+ * SO_REUSEPORT gets a socket of its own in each child so the kernel
+ * spreads connections over the processes; otherwise they all accept
+ * on the one socket.  Stats are kept in memory the processes share.
+ * This should be called before any connection is accepted and before
+ * the workers are started.
+ */
+int
+rpcServerFork(rpcServer *servp, int nprocs)
+{
+#ifdef MSWINDOWS
+	setPyErr("fork is not supported on this platform");
+	return -1;
+#else
+	rpcServerStats	*all;
+	pid_t		pid;
+	int		i,
+			fd;
+
+	if (nprocs < 1) {
+		setPyErr("number of processes must be positive");
+		return -1;
+	}
+	if (servp->src->fd < 0) {
+		setPyErr("server must be listening before it forks");
+		return -1;
+	}
+	if (servp->allStats) {
+		setPyErr("server has already forked");
+		return -1;
+	}
+	if (servp->workers) {
+		setPyErr("server can't fork once its workers are running");
+		return -1;
+	}
+	all = mmap(NULL, nprocs * sizeof(*all), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANON, -1, 0);
+	if (all == MAP_FAILED) {
+		PyErr_SetFromErrno(rpcError);
+		return -1;
+	}
+	memset(all, 0, nprocs * sizeof(*all));
+	all[0] = servp->local;
+	servp->allStats = all;
+	servp->nprocs = nprocs;
+	servp->stats = &all[0];
+	fflush(NULL);
+	for (i = 1; i < nprocs; ++i) {
+#if PY_VERSION_HEX >= 0x03070000
+		PyOS_BeforeFork();
+#endif
+		pid = fork();
+		if (pid < 0) {
+#if PY_VERSION_HEX >= 0x03070000
+			PyOS_AfterFork_Parent();
+#endif
+			PyErr_SetFromErrno(rpcError);
+			return -1;
+		}
+		if (pid > 0) {
+#if PY_VERSION_HEX >= 0x03070000
+			PyOS_AfterFork_Parent();
+#endif
+			rpcLogSrc(3, servp->src, "server forked process %d",
+				(int)pid);
+			continue;
+		}
+#if PY_VERSION_HEX >= 0x03070000
+		PyOS_AfterFork_Child();
+#else
+		PyOS_AfterFork();
+#endif
+		servp->stats = &all[i];
+		servp->stats->pid = getpid();
+		unless (rpcPollerAfterFork(servp->disp->poller))
+			return -1;
+		if (servp->reusePort and servp->port >= 0) {
+			fd = serverSocket(servp->port, servp->queue, true);
+			if (fd < 0)
+				return -1;
+			(void)rpcDispDelSource(servp->disp, servp->src);
+			rpcSourceClose(servp->src);
+			rpcSourceSetFd(servp->src, fd);
+			servp->src->actImp = ACT_INPUT;
+			servp->src->func = serveAccept;
+			servp->src->params = (PyObject *)servp;
+			unless (rpcDispAddSource(servp->disp, servp->src))
+				return -1;
+		}
+		return i;
+	}
+
+	return 0;
+#endif /* MSWINDOWS */
+}
+
+
+/*
+ * The stats of every process serving the port, added up, with a list
+ * of each process's own under "procs"
+ */
+PyObject *
+rpcServerStatsDict(rpcServer *servp)
+{
+	rpcServerStats	total,
+			*stp;
+	PyObject	*dict,
+			*procs,
+			*proc;
+	int		i;
+
+	stp = servp->allStats ? servp->allStats : &servp->local;
+	memset(&total, 0, sizeof(total));
+	procs = PyList_New(servp->nprocs);
+	if (procs == NULL)
+		return NULL;
+	for (i = 0; i < servp->nprocs; ++i) {
+		total.conns += stp[i].conns;
+		total.reqs += stp[i].reqs;
+		total.faults += stp[i].faults;
+		proc = statsDict(&stp[i]);
+		if (proc == NULL) {
+			Py_DECREF(procs);
+			return NULL;
+		}
+		PyList_SET_ITEM(procs, i, proc);
+	}
+	total.pid = servp->stats->pid;
+	dict = statsDict(&total);
+	if ((dict == NULL)
+	or  (PyDict_SetItemString(dict, "procs", procs))) {
+		Py_XDECREF(dict);
+		Py_DECREF(procs);
+		return NULL;
+	}
+	Py_DECREF(procs);
+
+	return dict;
+}
+
+
+static PyObject *
+statsDict(rpcServerStats *stp)
+{
+	return Py_BuildValue("{s:l,s:l,s:l,s:l}",
+			"pid", stp->pid,
+			"connections", stp->conns,
+			"requests", stp->reqs,
+			"faults", stp->faults);
+}
+
+
+/*
+ * The listening socket is readable: accept what is waiting, up to
+ * acceptBudget connections so that a storm of them can't starve the
+ * ones already open; the rest are picked up on the next iteration.
+ * Accepting stops altogether while maxConns connections are open and
+ * starts again from connClosed().
+ */
+static bool
+serveAccept(rpcDisp *dp, rpcSource *sp, int actions, PyObject *params)
+{
+	rpcServer	*servp;
+	bool		blocked;
+	int		n;
+
+	servp = (rpcServer *)params;
+	for (n = 0; n < servp->acceptBudget; ++n) {
+		if (servp->maxConns > 0 and servp->nconns >= servp->maxConns) {
+			rpcLogSrc(3, sp, "server has %d connections, "
+				"not accepting any more", servp->nconns);
+			servp->paused = true;
+			return true;
+		}
+		unless (acceptClient(dp, sp, servp, &blocked))
+			return false;
+		if (blocked)
+			break;
+	}
+	sp->actImp = ACT_INPUT;
+	sp->func = serveAccept;
+	sp->params = params;
+	Py_INCREF(sp->params);
+	unless (rpcDispAddSource(dp, sp))
+		return false;
+	return true;
+}
+
+
+/*
+ * accept one connection and start reading its header; *blocked is set
+ * if there was none waiting
+ */
 static bool
-serveAccept(rpcDisp *dp, rpcSource *sp, int actions, PyObject *servp)
+acceptClient(rpcDisp *dp, rpcSource *sp, rpcServer *servp, bool *blocked)
 {
-	socklen_t		len,
-				res;
+	socklen_t		len;
+	int			res;
 	uint			in;
 	rpcSource		*client;
 	struct sockaddr_in	addr;
@@ -301,209 +626,381 @@ serveAccept(rpcDisp *dp, rpcSource *sp, int actions, PyObject *servp)
 	ulong		flag	= 1;
 #endif /* MSWINDOWS */
 
+	*blocked = false;
 	len = sizeof(addr);
-	res = accept(sp->fd, (struct sockaddr *)&addr, &len);
-	if (res >= 0) {
-#ifdef MSWINDOWS
-		unless (ioctlsocket((SOCKET)res, FIONBIO, &flag) == 0) {
-			PyErr_SetFromErrno(rpcError);
-			return false;
-		}
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+	res = accept4(sp->fd, (struct sockaddr *)&addr, &len,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
 #else
-		unless ((fcntl(res, F_SETFL, O_NONBLOCK) == 0)
-		and     (fcntl(res, F_SETFD, CLOSE_ON_EXEC) == 0)) {
+	res = accept(sp->fd, (struct sockaddr *)&addr, &len);
+#endif
+	if (res < 0) {
+		unless (isBlocked(get_errno())) {
 			PyErr_SetFromErrno(rpcError);
 			return false;
 		}
+		rpcLogSrc(7, sp, "blocked on accept");
+		*blocked = true;
+		return true;
+	}
+#ifdef MSWINDOWS
+	unless (ioctlsocket((SOCKET)res, FIONBIO, &flag) == 0) {
+		PyErr_SetFromErrno(rpcError);
+		return false;
+	}
+#elif !defined(SOCK_NONBLOCK) || !defined(SOCK_CLOEXEC)
+	unless ((fcntl(res, F_SETFL, O_NONBLOCK) == 0)
+	and     (fcntl(res, F_SETFD, CLOSE_ON_EXEC) == 0)) {
+		PyErr_SetFromErrno(rpcError);
+		close(res);
+		return false;
+	}
 #endif /* MSWINDOWS */
-		client = rpcSourceNew(res);
-		if (client == NULL)
-			return false;
-		client->doClose = true;
-		client->desc = alloc(strlen("255.255.255.255:123456") + 1);
-		if (client->desc == NULL)
-			return false;
-		in = ntohl(addr.sin_addr.s_addr);
-		sprintf(client->desc, "%u.%u.%u.%u:%u",
-			0xFF & (in>>24), 0xFF & (in>>16),
-			0xFF & (in>>8), 0xFF & in, ntohs(addr.sin_port));
-		rpcLogSrc(3, sp, "server got connection from %s", client->desc);
-		client->actImp = ACT_INPUT;
-		client->func = serverReadHeader;
-		client->params = Py_BuildValue("(s,O)", "", servp);
-		if (client->params == NULL)
-			return false;
-		rpcSourceSetOnErr(client, sp->onErrType, sp->onErr);
-		unless (rpcDispAddSource(dp, client))
-			return false;
+	client = rpcSourceNew(res);
+	if (client == NULL)
+		return false;
+	client->doClose = true;
+	servp->nconns++;
+	rpcSourceSetOnClose(client, connClosed, (PyObject *)servp);
+	client->desc = alloc(strlen("255.255.255.255:123456") + 1);
+	if (client->desc == NULL) {
 		Py_DECREF(client);
-	} else unless (isBlocked(get_errno())) {
-		PyErr_SetFromErrno(rpcError);
 		return false;
-	} else
-		fprintf(rpcLogger, "blocked on accept\n");
-	sp->actImp = ACT_INPUT;
-	sp->func = serveAccept;
-	sp->params = servp;
-	Py_INCREF(sp->params);
-	unless (rpcDispAddSource(dp, sp))
+	}
+	in = ntohl(addr.sin_addr.s_addr);
+	sprintf(client->desc, "%u.%u.%u.%u:%u",
+		0xFF & (in>>24), 0xFF & (in>>16),
+		0xFF & (in>>8), 0xFF & in, ntohs(addr.sin_port));
+	rpcLogSrc(3, sp, "server got connection from %s", client->desc);
+	servp->stats->conns++;
+	client->actImp = ACT_INPUT;
+	client->func = serverReadHeader;
+	client->params = (PyObject *)servp;
+	Py_INCREF(servp);
+	rpcSourceSetOnErr(client, sp->onErrType, sp->onErr);
+	unless (rpcDispAddSource(dp, client)) {
+		Py_DECREF(client);
 		return false;
+	}
+	Py_DECREF(client);
 	return true;
 }
 
 
+/*
+ * a connection accepted by servp has been closed
+ */
+static void
+connClosed(rpcSource *sp, PyObject *servp)
+{
+	PyObject	*exc,
+			*v,
+			*tb;
+
+	((rpcServer *)servp)->nconns--;
+	PyErr_Fetch(&exc, &v, &tb);
+	unless (resumeAccept((rpcServer *)servp)) {
+		rpcLogSrc(1, sp, "server could not start accepting again");
+		PyErr_Clear();
+	}
+	PyErr_Restore(exc, v, tb);
+}
+
 
+/*
+ * start accepting again if serveAccept() stopped for maxConns and there
+ * is room now
+ */
 static bool
-serverReadHeader(rpcDisp *dp, rpcSource *sp, int actions, PyObject *params)
+resumeAccept(rpcServer *servp)
 {
-	PyObject	*buff,
-			*args,
-			*servp;
-	bool		eof,
-			res;
-	long		blen;
-	char		*hp,		/* start of header */
-			*bp,		/* start of body */
-			*cp,		/* current position */
-			*ep,		/* end of string read */
-			*lp;		/* start of content-length value */
-
-	unless (PyArg_ParseTuple(params, "SO:serverReadHeader", &buff, &servp))
+	unless (servp->paused)
+		return true;
+	if (servp->src->fd < 0) {
+		servp->paused = false;
+		return true;
+	}
+	if (servp->maxConns > 0 and servp->nconns >= servp->maxConns)
+		return true;
+	rpcLogSrc(3, servp->src, "server accepting connections again");
+	servp->paused = false;
+	servp->src->actImp = ACT_INPUT;
+	servp->src->func = serveAccept;
+	servp->src->params = (PyObject *)servp;
+	Py_INCREF(servp->src->params);
+	unless (rpcDispAddSource(servp->disp, servp->src)) {
+		Py_DECREF(servp->src->params);
+		servp->src->params = NULL;
+		servp->paused = true;
 		return false;
-	eof = false;
-	unless (nbRead(sp->fd, &buff, &eof))
+	}
+	return true;
+}
+
+
+
+static bool
+serverReadHeader(rpcDisp *dp, rpcSource *sp, int actions, PyObject *servp)
+{
+	bool		eof;
+
+	unless (rpcSourceRead(sp, &eof))
 		return false;
-	bp = NULL;
-	lp = NULL;
-	hp = PyString_AS_STRING(buff);
-	ep = hp + PyString_GET_SIZE(buff);
 	rpcLogSrc(7, sp, "server read %d bytes of header",
-			PyString_GET_SIZE(buff));
-	for (cp = hp; (bp == NULL) and (cp < ep); ++cp) {
-		if ((ep - cp > 16)
-		and (strncasecmp(cp, "Content-length: ", 16) == 0))
-			lp = cp + 16;
-		if ((ep - cp > 4)
-		and (strncmp(cp, "\r\n\r\n", 4) == 0))
-			bp = cp + 4;
-		if ((ep - cp > 2)
-		and (strncmp(cp, "\n\n", 2) == 0))
-			bp = cp + 2;
-	}
-	if (bp == NULL) {
+		(int)rpcSourceInLen(sp));
+	switch (rpcHttpParse(&sp->http, rpcSourceInData(sp),
+				rpcSourceInLen(sp))) {
+	case HTTP_ERR:
+		return false;
+	case HTTP_AGAIN:
 		if (eof) {
-			if (PyString_GET_SIZE(buff) == 0) {
-				close(sp->fd);
-				sp->fd = -1;
-				Py_DECREF(buff);
+			if (rpcSourceInLen(sp) == 0) {
+				rpcSourceClose(sp);
 				rpcLogSrc(3, sp, "received EOF");
 				return true;
 			}
-			Py_DECREF(buff);
 			PyErr_SetString(rpcError, "got EOS while reading");
 			return false;
 		}
 		sp->actImp = ACT_INPUT;
 		sp->func = serverReadHeader;
-		sp->params = Py_BuildValue("(O,O)", buff, servp);
-		Py_DECREF(buff);
-		if ((sp->params == NULL)
-		or  (not rpcDispAddSource(dp, sp)))
+		sp->params = servp;
+		Py_INCREF(servp);
+		unless (rpcDispAddSource(dp, sp))
 			return false;
 		return true;
 	}
-	if (lp == NULL) {
-		Py_DECREF(buff);
+	if (sp->http.chunked)
+		sp->http.clen = -1;		/* the chunks say how long */
+	else if (sp->http.clen < 0) {
 		PyErr_SetString(rpcError,
 			"no Content-length parameter found in header");
 		return false;
 	}
-	unless (decodeActLong(&lp, ep, &blen)) {
-		Py_DECREF(buff);
-		PyErr_SetString(rpcError, "invalid Content-length");
-		return false;
-	}
 	rpcLogSrc(7, sp, "server finished reading header");
-	rpcLogSrc(9, sp, "server content length should be %d", blen);
-	args = Py_BuildValue("(s#,s#,l,O)", hp, bp-hp, bp, ep-bp, blen, servp);
-	if (args == NULL)
-		return false;
-	res = readRequest(dp, sp, actions, args);
-	Py_DECREF(args);
-	Py_DECREF(buff);
+	((rpcServer *)servp)->stats->reqs++;
+	if (sp->http.chunked)
+		rpcLogSrc(9, sp, "server content is chunked");
+	else
+		rpcLogSrc(9, sp, "server content length should be %ld",
+			sp->http.clen);
 
-	return res;
+	return startRequest(dp, sp, servp, eof);
 }
 
 
 
+/*
+ * The header of a request is in.  The uri and authorization are taken
+ * out of it and it is dropped; the body is then decoded as it arrives
+ * (see readBody()).  The body of a request that fails authentication is
+ * read but never decoded.
+ */
 static bool
-readRequest(rpcDisp *dp, rpcSource *srcp, int actions, PyObject *params)
+startRequest(rpcDisp *dp, rpcSource *srcp, PyObject *servp, bool eof)
 {
-	PyObject	*head,
-			*body,
-			*servp,
-			*result;
-	bool		eof,
-			res,
-			keepAlive;
-	long		blen,
-			slen;
-
-	unless (PyArg_ParseTuple(params, "SSlO:readRequest",
-					&head, &body, &blen, &servp))
+	PyObject	*pyuri,
+			*auth,
+			*decoder,
+			*exc,
+			*v,
+			*tb;
+	rpcHttpHead	*hp;
+	char		*data;
+
+	hp = &srcp->http;
+	data = rpcSourceInData(srcp);
+	auth = NULL;
+	pyuri = serverUri((rpcServer *)servp, data + hp->uri.off, hp->uri.len);
+	if (pyuri == NULL)
 		return false;
-	unless (nbRead(srcp->fd, &body, &eof))
+	if ((((rpcServer *)servp)->authFunc != NULL)
+	and (hp->auth.off >= 0)) {
+		auth = PyString_FromStringAndSize(data + hp->auth.off,
+							hp->auth.len);
+		if (auth == NULL) {
+			Py_DECREF(pyuri);
+			return false;
+		}
+	}
+	if (authenticate((rpcServer *)servp, pyuri, auth))
+		decoder = decoderNew(TYPE_REQ);
+	else {		/* keep the error for the response */
+		PyErr_Fetch(&exc, &v, &tb);
+		PyErr_NormalizeException(&exc, &v, &tb);
+		Py_XDECREF(tb);
+		decoder = Py_BuildValue("(NN)", exc, v);
+	}
+	Py_XDECREF(auth);
+	if (decoder == NULL) {
+		Py_DECREF(pyuri);
 		return false;
-	slen = PyString_GET_SIZE(body);
-	rpcLogSrc(9, srcp, "server read %d of %d body bytes", slen, blen);
-	if (slen > blen) {
-		Py_DECREF(body);
-		PyErr_SetString(rpcError, "readRequest read too many bytes");
+	}
+	rpcSourceConsume(srcp, hp->hlen);
+	rpcSourceClearConn(srcp);
+	srcp->conn.uri = pyuri;
+	srcp->conn.decoder = decoder;
+	srcp->conn.blen = hp->clen;
+	srcp->conn.keepAlive = hp->keepAlive;
+
+	return readBody(dp, srcp, servp, eof);
+}
+
+
+/*
+ * the uri of a request as a string; clients mostly post every request
+ * to the same uri, so the last one is kept and handed out again
+ */
+static PyObject *
+serverUri(rpcServer *servp, char *bp, long len)
+{
+	PyObject	*pyuri;
+	char		*last;
+	Py_ssize_t	llen;
+
+	pyuri = servp->lastUri;
+	if (pyuri != NULL
+	and PyString_AsStringAndSize(pyuri, &last, &llen) == 0
+	and llen == len
+	and memcmp(last, bp, len) == 0) {
+		Py_INCREF(pyuri);
+		return pyuri;
+	}
+	pyuri = PyString_FromStringAndSize(bp, len);
+	if (pyuri == NULL)
+		return NULL;
+	Py_XDECREF(servp->lastUri);
+	servp->lastUri = pyuri;
+	Py_INCREF(pyuri);
+
+	return pyuri;
+}
+
+
+static bool
+readRequest(rpcDisp *dp, rpcSource *srcp, int actions, PyObject *params)
+{
+	bool		eof;
+
+	unless (rpcSourceRead(srcp, &eof))
 		return false;
-	} else if (blen == slen) {
-		rpcLogSrc(9, srcp, "server finished reading body");
-		Py_INCREF(head);	/* hack so concat doesn't fail */
-		PyString_ConcatAndDel(&head, body);
-		if (head == NULL)
+
+	return readBody(dp, srcp, params, eof);
+}
+
+
+/*
+ * Feed what there is of the body to the decoder and drop what it is done
+ * with.  The decoder and the bytes of the body left, -1 for a chunked
+ * body, are in srcp->conn; a chunked body is de-chunked in the input
+ * buffer first.  Once the whole body is decoded the request is
+ * dispatched.  Anything past the body is the start of a pipelined
+ * request and is left in the buffer.
+ */
+static bool
+readBody(rpcDisp *dp, rpcSource *srcp, PyObject *servp, bool eof)
+{
+	PyObject	*pyuri,
+			*decoder,
+			*result;
+	rpcConn		*connp;
+	rpcChunks	*chp;
+	char		*data;
+	long		left,
+			avail,
+			used,
+			len;
+	bool		final,
+			res;
+	int		r;
+
+	connp = &srcp->conn;
+	decoder = connp->decoder;
+	left = connp->blen;
+	chp = &srcp->http.chunks;
+	data = rpcSourceInData(srcp);
+	avail = rpcSourceInLen(srcp);
+	if (left < 0) {
+		len = avail;
+		r = rpcHttpDechunk(&srcp->http, data, &len);
+		if (r == HTTP_ERR)
 			return false;
-		result = dispatch((rpcServer *)servp, srcp, head, &keepAlive);
-		res = doResponse((rpcServer *)servp, srcp, result, keepAlive);
-		Py_DECREF(head);
-		return res;
+		rpcSourceTruncate(srcp, len);
+		avail = chp->body;
+		final = (r == HTTP_DONE);
+		rpcLogSrc(9, srcp, "server de-chunked %ld body bytes", avail);
 	} else {
+		rpcLogSrc(9, srcp, "server read %ld of %ld body bytes",
+			avail, left);
+		if (avail > left)
+			avail = left;
+		final = (avail == left);
+	}
+	if (PyTuple_Check(decoder)) {		/* authentication failed */
+		used = avail;
+		r = final ? DEC_DONE : DEC_AGAIN;
+	} else
+		r = decoderFeed(decoder, data, data + avail, final, &used);
+	if (r == DEC_ERR)
+		return false;
+	rpcSourceConsume(srcp, used);
+	if (left < 0)
+		chp->body -= used;
+	else
+		connp->blen -= used;
+	if (r == DEC_AGAIN) {
 		if (eof) {
-			Py_DECREF(body);
 			PyErr_SetString(rpcError, "got EOS while reading body");
 			return false;
 		}
 		srcp->actImp = ACT_INPUT;
 		srcp->func = readRequest;
-		srcp->params = Py_BuildValue("(S,S,l,O)",
-				head, body, blen, servp);
-		Py_DECREF(body);
-		if (srcp->params == NULL)
-			return false;
+		srcp->params = servp;
+		Py_INCREF(servp);
 		unless (rpcDispAddSource(dp, srcp))
 			return false;
 		return true;
 	}
+	rpcLogSrc(9, srcp, "server finished reading body");
+	pyuri = connp->uri;
+	connp->uri = NULL;
+	connp->decoder = NULL;
+	if (PyTuple_Check(decoder)) {
+		Py_INCREF(PyTuple_GET_ITEM(decoder, 0));
+		Py_INCREF(PyTuple_GET_ITEM(decoder, 1));
+		PyErr_Restore(PyTuple_GET_ITEM(decoder, 0),
+				PyTuple_GET_ITEM(decoder, 1), NULL);
+		result = NULL;
+	} else if (((rpcServer *)servp)->workers != NULL) {
+		res = submitRequest((rpcServer *)servp, srcp, pyuri, decoder);
+		Py_DECREF(pyuri);
+		Py_DECREF(decoder);
+		return res;
+	} else
+		result = dispatch((rpcServer *)servp, srcp, pyuri, decoder);
+	Py_DECREF(pyuri);
+	Py_DECREF(decoder);
+
+	return doResponse((rpcServer *)servp, srcp, result);
 }
 
 
+/*
+ * Send the response to a request, or a fault if result is NULL; whether
+ * the connection is kept afterwards is in srcp->conn
+ */
 static bool
-doResponse(rpcServer *servp, rpcSource *srcp, PyObject *result, bool keepAlive)
+doResponse(rpcServer *servp, rpcSource *srcp, PyObject *result)
 {
 	PyObject	*addInfo,
 			*response,
+			*stream,
 			*strRes,
-			*params,
 			*exc,
 			*v,
 			*tb;
 	int		faultCode;
 	char		*faultString;
-	bool		res;
 
 	addInfo = PyDict_New();
 	if (addInfo == NULL)
@@ -515,40 +1012,44 @@ doResponse(rpcServer *servp, rpcSource *srcp, PyObject *result, bool keepAlive)
 		if (exc == NULL) {
 			return (false);
 		} else if (PyErr_GivenExceptionMatches(v, rpcPostpone)) {
-			PyObject	*o;
-			if (srcp->params == NULL) {
-				srcp->params = Py_BuildValue("(i)", keepAlive);
-				if (srcp->params == NULL)
-					return false;
-			} else {
-				o = Py_BuildValue("(i,O)", keepAlive, srcp->params);
-				if (o == NULL)
-					return false;
-				Py_DECREF(srcp->params);
-				srcp->params = o;
-			}
+			srcp->conn.postponed = true;
 			rpcLogSrc(7, srcp, "received postpone request");
 			PyErr_Restore(exc, v, tb);
 			PyErr_Clear();
 			Py_DECREF(addInfo);
 			return (true);
-		} else if (exc and grabError(&faultCode, &faultString, exc, v, tb)) {
-			response = buildFault(faultCode, faultString, addInfo);
+		}
+		servp->stats->faults++;
+		if (exc and grabError(&faultCode, &faultString, exc, v, tb)) {
+			response = buildFault(faultCode, faultString, addInfo,
+						servp->encFlags);
 			free(faultString);
 		} else {
-			response = buildFault(-1, "Unknown error", addInfo);
+			response = buildFault(-1, "Unknown error", addInfo,
+						servp->encFlags);
 		}
 		PyErr_Restore(exc, v, tb);
 		assert(PyErr_Occurred());
 		PyErr_Print();
 		PyErr_Clear();
+	} else if (servp->streamSize > 0 and srcp->http.version == 11) {
+		stream = streamResponse(result, addInfo, servp->encFlags);
+		Py_DECREF(result);
+		Py_DECREF(addInfo);
+		if (stream == NULL)
+			return false;
+		rpcLogSrc(8, srcp, "server streaming response");
+		srcp->conn.stream = stream;
+		return writeResponse(servp->disp, srcp, ACT_OUTPUT,
+					(PyObject *)servp);
 	} else {
-		response = buildResponse(result, addInfo);
+		response = buildResponse(result, addInfo, servp->encFlags);
 		Py_DECREF(result);
 	}
 	/* one more attempt at failure recovery */
 	if (response == NULL)
-		response = buildFault(-1, "Unknown error", addInfo);
+		response = buildFault(-1, "Unknown error", addInfo,
+						servp->encFlags);
 	Py_DECREF(addInfo);
 	if (response == NULL)
 		return false;
@@ -560,70 +1061,67 @@ doResponse(rpcServer *servp, rpcSource *srcp, PyObject *result, bool keepAlive)
 			PyString_AS_STRING(strRes));
 		Py_DECREF(strRes);
 	}
-	params = Py_BuildValue("(O,i,O)", response, (int)keepAlive, servp);
-	Py_DECREF(response);
-	if (params == NULL)
+	unless (rpcSourceQueue(srcp, response)) {
+		Py_DECREF(response);
 		return false;
-	res = writeResponse(servp->disp, srcp, ACT_OUTPUT, params);
-	Py_DECREF(params);
+	}
+	Py_DECREF(response);
 
-	return res;
+	return writeResponse(servp->disp, srcp, ACT_OUTPUT, (PyObject *)servp);
 }
 
 static PyObject *
-dispatch(rpcServer *servp, rpcSource *srcp, PyObject *request, bool *keepAlive)
+dispatch(
+	rpcServer	*servp,
+	rpcSource	*srcp,
+	PyObject	*pyuri,
+	PyObject	*decoder
+)
 {
-	PyObject	*args,
-			*method,
-			*params,
-			*addInfo,
-			*tuple,	
-			*pyfunc,
-			*(*cfunc)(
-				rpcServer *,
-				rpcSource *,
-				char *,
-				char *,
-				PyObject *
-			),
-			*pyuri,
-			*result,
-			*strReq,
-			*strRes;
-	char		buff[256],
-			*uri;
+	PyObject	*params,
+			*result;
+	rpcMethod	meth;
 
-	if (rpcLogLevel >= 8) {
-		strReq = PyObject_Repr(request);
-		if (strReq == NULL)
-			return NULL;
-		rpcLogSrc(8, srcp, "server got request %s",
-			PyString_AS_STRING(strReq));
-		Py_DECREF(strReq);
-	}
-	tuple = parseRequest(request);
-	if (tuple == NULL)
+	unless (findHandler(servp, srcp, decoder, &meth, &params))
 		return NULL;
-	assert(PyTuple_Check(tuple));
-	assert(PyTuple_GET_SIZE(tuple) == 3);
-	method = PyTuple_GET_ITEM(tuple, 0);
-	params = PyTuple_GET_ITEM(tuple, 1);
-	addInfo = PyTuple_GET_ITEM(tuple, 2);
-	assert(PyDict_Check(addInfo));
-	unless (authenticate(servp, addInfo)) {
-		Py_DECREF(tuple);
-		return NULL;
-	}
-	*keepAlive = doKeepAliveFromDict(addInfo);
-	pyuri = PyDict_GetItemString(addInfo, "URI");
-	assert(pyuri != NULL);
-	assert(PyString_Check(pyuri));
-	uri = PyString_AS_STRING(pyuri);
+	Py_INCREF(meth.name);		/* in case the handler replaces */
+	Py_XINCREF(meth.pyfunc);	/* its own method */
+	Py_XINCREF(meth.self);
+	result = callHandler(&meth, servp, srcp, pyuri, params);
+	Py_DECREF(meth.name);
+	Py_XDECREF(meth.pyfunc);
+	Py_XDECREF(meth.self);
+
+	return result;
+}
+
 
+/*
+ * Look up the method of a decoded request.  Sets *paramsp to its params,
+ * borrowed from the decoder, and copies the method's entry to *methp;
+ * the entry's references are borrowed from the server's table.
+ */
+static bool
+findHandler(
+	rpcServer	*servp,
+	rpcSource	*srcp,
+	PyObject	*decoder,
+	rpcMethod	*methp,
+	PyObject	**paramsp
+)
+{
+	PyObject	*method,
+			*strReq;
+	rpcMethod	*entry;
+	char		buff[256];
+
+	unless (decoderCall(decoder, &method, paramsp))
+		return false;
+	assert(PyString_Check(method));
 	if (rpcLogLevel >= 5) {
-		strReq = PyObject_Repr(params);
+		strReq = PyObject_Repr(*paramsp);
 		if (strReq == NULL)
-			return NULL;
+			return false;
 		rpcLogSrc(5, srcp, "server got request ('%s', %s)",
 			PyString_AS_STRING(method), PyString_AS_STRING(strReq));
 		Py_DECREF(strReq);
@@ -631,34 +1129,61 @@ dispatch(rpcServer *servp, rpcSource *srcp, PyObject *request, bool *keepAlive)
 		rpcLogSrc(3, srcp, "server got request '%s'",
 			PyString_AS_STRING(method));
 
-	assert(PyString_Check(method));
-	unless (PyMapping_HasKey(servp->comtab, method)) {
+	entry = rpcMethodsFind(servp->methods, method);
+	if (entry == NULL) {
+		if (PyErr_Occurred())
+			return false;
 		snprintf(buff, 255, "unknown command: \'%s\'",
 			PyString_AS_STRING(method));
-		Py_DECREF(tuple);
 		PyErr_SetString(rpcError, buff);
-		return NULL;
+		return false;
 	}
-	pyfunc = PyDict_GetItem(servp->comtab, method);
-	if (PyCallable_Check(pyfunc)) {
-		args = Py_BuildValue("(O,O,s,O,O)",
-				 servp, srcp, uri, method, params);
-		Py_DECREF(tuple);
-		if (args == NULL)
-			return NULL;
-		result = PyObject_CallObject(pyfunc, args);
-		Py_DECREF(args);
-	} else if (PyString_Check(pyfunc)) {
-		assert(PyString_GET_SIZE(pyfunc) == sizeof(cfunc));
-		memcpy(&cfunc, PyString_AS_STRING(pyfunc), sizeof(cfunc));
-		result = cfunc(
-				servp,
-				srcp,
-				uri,
-				PyString_AS_STRING(method),
-				params
-			);
-		Py_DECREF(tuple);
+	*methp = *entry;
+
+	return true;
+}
+
+
+/*
+ * Call a handler, a C function or a python callable.  A python handler
+ * gets (server, source, uri, method, params), with the method's self
+ * in place of the server if it has one; where the interpreter has
+ * vectorcall they are passed as they are, without building a tuple.
+ */
+static PyObject *
+callHandler(
+	rpcMethod	*methp,
+	rpcServer	*servp,
+	rpcSource	*srcp,
+	PyObject	*pyuri,
+	PyObject	*params
+)
+{
+	PyObject	*argv[5],
+			*result,
+			*strRes;
+	char		*uri,
+			*method;
+	Py_ssize_t	len;
+
+	if (methp->flags & METHOD_C) {
+		if (PyString_AsStringAndSize(pyuri, &uri, &len)
+		or PyString_AsStringAndSize(methp->name, &method, &len))
+			result = NULL;
+		else
+			result = methp->cfunc(servp, srcp, uri, method, params);
+	} else if (methp->flags & METHOD_PY) {
+		argv[0] = methp->self ? methp->self : (PyObject *)servp;
+		argv[1] = (PyObject *)srcp;
+		argv[2] = pyuri;
+		argv[3] = methp->name;
+		argv[4] = params;
+#ifdef VECTORCALL
+		result = VECTORCALL(methp->pyfunc, argv, 5, NULL);
+#else
+		result = PyObject_CallFunctionObjArgs(methp->pyfunc, argv[0],
+				argv[1], argv[2], argv[3], argv[4], NULL);
+#endif
 	} else {
 		setPyErr("illegal type for server callback");
 		return NULL;
@@ -678,6 +1203,102 @@ dispatch(rpcServer *servp, rpcSource *srcp, PyObject *request, bool *keepAlive)
 }
 
 
+/*
+ * Hand a request to the server's workers.  The connection sits out of
+ * the dispatcher, as a postponed one does, until finishRequest() sends
+ * the response.  The job is (server, source, uri, method, params,
+ * handler, self), the handler being the python callable or a capsule
+ * holding the C function.
+ */
+static bool
+submitRequest(
+	rpcServer	*servp,
+	rpcSource	*srcp,
+	PyObject	*pyuri,
+	PyObject	*decoder
+)
+{
+	PyObject	*params,
+			*handler,
+			*job;
+	rpcMethod	meth;
+	bool		res;
+
+	unless (findHandler(servp, srcp, decoder, &meth, &params))
+		return doResponse(servp, srcp, NULL);
+	if (meth.flags & METHOD_C)
+		handler = PyCapsule_New((void *)meth.cfunc, "rpcCMethod", NULL);
+	else {
+		handler = meth.pyfunc;
+		Py_INCREF(handler);
+	}
+	if (handler == NULL)
+		return false;
+	job = Py_BuildValue("(O,O,O,O,O,N,O)", servp, srcp, pyuri, meth.name,
+			params, handler, meth.self ? meth.self : Py_None);
+	if (job == NULL)
+		return false;
+	rpcLogSrc(7, srcp, "server queueing request for a worker");
+	res = rpcWorkersSubmit(servp->workers, runRequest, finishRequest, job);
+	Py_DECREF(job);
+
+	return res;
+}
+
+
+/*
+ * run on a worker thread
+ */
+static PyObject *
+runRequest(PyObject *job)
+{
+	PyObject	*handler;
+	rpcMethod	meth;
+
+	memset(&meth, 0, sizeof(meth));
+	meth.name = PyTuple_GET_ITEM(job, 3);
+	handler = PyTuple_GET_ITEM(job, 5);
+	if (PyCapsule_CheckExact(handler)) {
+		meth.flags = METHOD_C;
+		meth.cfunc = (rpcCMethod)PyCapsule_GetPointer(handler,
+								"rpcCMethod");
+	} else {
+		meth.flags = METHOD_PY;
+		meth.pyfunc = handler;
+		if (PyTuple_GET_ITEM(job, 6) != Py_None)
+			meth.self = PyTuple_GET_ITEM(job, 6);
+	}
+	return callHandler(&meth,
+			(rpcServer *)PyTuple_GET_ITEM(job, 0),
+			(rpcSource *)PyTuple_GET_ITEM(job, 1),
+			PyTuple_GET_ITEM(job, 2),
+			PyTuple_GET_ITEM(job, 4));
+}
+
+
+/*
+ * Back on the dispatcher's thread with what the handler returned.  If
+ * the response fails the connection's onErr handler gets the error, as
+ * it would from the dispatcher, and the connection is closed; only an
+ * error the handler does not keep is passed on to go out of work().
+ */
+static bool
+finishRequest(PyObject *job, PyObject *result)
+{
+	rpcSource	*srcp;
+	int		res;
+
+	srcp = (rpcSource *)PyTuple_GET_ITEM(job, 1);
+	if (doResponse((rpcServer *)PyTuple_GET_ITEM(job, 0), srcp, result))
+		return true;
+	res = rpcDispHandleError(srcp);
+	if (srcp->doClose and srcp->fd >= 0)
+		rpcSourceClose(srcp);
+
+	return (res & ONERR_KEEP_WORK) != 0;
+}
+
+
 static bool
 grabError(
 	int		*faultCode,
@@ -716,15 +1337,16 @@ grabError(
 }
 
 
+/*
+ * auth is the Authorization field of the request, or NULL if it had none
+ */
 static bool
-authenticate(rpcServer *servp, PyObject *addInfo)
+authenticate(rpcServer *servp, PyObject *pyuri, PyObject *auth)
 {
-	PyObject	*auth,
-			*encPair,
+	PyObject	*encPair,
 			*decPair,
 			*name,
 			*pass,
-			*pyuri,
 			*res;
 	char		*bp,
 			*cp,
@@ -733,10 +1355,6 @@ authenticate(rpcServer *servp, PyObject *addInfo)
 
 	if (servp->authFunc == NULL)
 		return true;
-	pyuri = PyDict_GetItemString(addInfo, "URI");
-	assert(pyuri != NULL);
-	assert(PyString_Check(pyuri));
-	auth = PyDict_GetItemString(addInfo, "Authorization");
 	if (auth == NULL) {
 		name = Py_None;
 		pass = Py_None;
@@ -800,54 +1418,68 @@ authenticate(rpcServer *servp, PyObject *addInfo)
 }
 
 
+/*
+ * write the response queued on the source; params is the server.  For
+ * a streamed response, srcp->conn.stream, the next chunk is only
+ * encoded when the last one has gone out.
+ */
 static bool
 writeResponse(rpcDisp *dp, rpcSource *srcp, int actions, PyObject *params)
 {
 	rpcServer	*servp;
-	PyObject	*toWrite;
-	int		keepAlive,
-			nb,
-			slen;
-
-	unless (PyArg_ParseTuple(params, "SiO:writeResponse",
-					&toWrite, &keepAlive, &servp))
-		return false;
-	slen = PyString_GET_SIZE(toWrite);
-	nb = write(srcp->fd, PyString_AS_STRING(toWrite), slen);
-	rpcLogSrc(9, srcp, "server wrote %d of %d bytes", nb, slen);
-	if (nb < 0 and isBlocked(get_errno()))
-		nb = 0;
-	if (nb < 0) {
-		PyErr_SetFromErrno(rpcError);
-		return false;
-	} else if (nb == slen) {
+	PyObject	*stream,
+			*chunk;
+	long		left;
+	bool		keepAlive,
+			done;
+
+	servp = (rpcServer *)params;
+	stream = srcp->conn.stream;
+	while (true) {
+		left = rpcSourceOutLen(srcp);
+		unless (rpcSourceWrite(srcp, &done))
+			return false;
+		rpcLogSrc(9, srcp, "server wrote %ld of %ld bytes",
+			left - rpcSourceOutLen(srcp), left);
+		if (not done or stream == NULL)
+			break;
+		chunk = streamNext(stream, servp->streamSize);
+		if (chunk == NULL)
+			return false;
+		if (chunk == Py_None) {
+			Py_DECREF(chunk);
+			break;
+		}
+		unless (rpcSourceQueue(srcp, chunk)) {
+			Py_DECREF(chunk);
+			return false;
+		}
+		Py_DECREF(chunk);
+	}
+	if (done) {
 		rpcLogSrc(9, srcp, "server finished writing response");
-		srcp->actImp = ACT_INPUT;
+		keepAlive = srcp->conn.keepAlive;
+		rpcSourceClearConn(srcp);
+		rpcHttpInit(&srcp->http, TYPE_REQ);
+		/* a pipelined request that is already in goes next */
+		if (rpcSourceInLen(srcp) > 0)
+			srcp->actImp = ACT_IMMEDIATE;
+		else
+			srcp->actImp = ACT_INPUT;
 		srcp->func = serverReadHeader;
-		srcp->params = Py_BuildValue("(s,O)", "", servp);
-		if (srcp->params == NULL)
-			return false;
+		srcp->params = (PyObject *)servp;
+		Py_INCREF(servp);
 		if (keepAlive) {
 			unless (rpcDispAddSource(dp, srcp))
 				return false;
-		} else {
-			close(srcp->fd);
-			srcp->fd = -1;
-		}
+		} else
+			rpcSourceClose(srcp);
 		return true;
 	} else {
-		assert(slen > nb);
-		toWrite = PyString_FromStringAndSize(
-			PyString_AS_STRING(toWrite) + nb, slen - nb);
-		if (toWrite == NULL)
-			return false;
 		srcp->actImp = ACT_OUTPUT;
 		srcp->func = writeResponse;
-		srcp->params = Py_BuildValue("(O,i,O)",
-					toWrite, keepAlive, servp);
-		Py_DECREF(toWrite);
-		if (srcp->params == NULL)
-			return false;
+		srcp->params = params;
+		Py_INCREF(params);
 		unless (rpcDispAddSource(dp, srcp))
 			return false;
 		return true;
@@ -856,17 +1488,23 @@ writeResponse(rpcDisp *dp, rpcSource *srcp, int actions, PyObject *params)
 
 
 /*
- * Register some commands with an rpc server
+ * Register some commands with an rpc server; if serv is given and not
+ * None, the handlers get it as their first argument instead of the server
  */
 static PyObject *
 pyRpcServerAddMethods(PyObject *self, PyObject *args)
 {
 	rpcServer	*sp;
-	PyObject	*toAdd;
+	PyObject	*toAdd,
+			*serv;
 
 	sp = (rpcServer *)self;
-	unless ((PyArg_ParseTuple(args, "O", &toAdd)
-	and     (rpcServerAddPyMethods(sp, toAdd))))
+	serv = NULL;
+	unless (PyArg_ParseTuple(args, "O|O", &toAdd, &serv))
+		return NULL;
+	if (serv == Py_None)
+		serv = NULL;
+	unless (rpcServerAddPyMethods(sp, toAdd, serv))
 		return NULL;
 
 	Py_INCREF(Py_None);
@@ -962,7 +1600,8 @@ pyRpcServerClose(PyObject *self, PyObject *args)
 	unless (PyArg_ParseTuple(args, ""))
 		return NULL;
 
-	rpcServerClose(sp);
+	unless (rpcServerClose(sp))
+		return NULL;
 
 	Py_INCREF(Py_None);
 	return Py_None;
@@ -996,61 +1635,6 @@ pyRpcServerSetOnErr(PyObject *self, PyObject *args)
 
 
 
-/*
- * returns number of bytes read, 
- */
-static bool
-nbRead(int fd, PyObject **buffpp, bool *eof)
-{
-	PyObject	*buffp;
-	long		bytesAv,
-			olen,
-			slen;
-	char		*cp;
-	int		res;
-	
-	*eof = false;
-	buffp = *buffpp;
-	assert(PyString_Check(buffp));
-	olen = PyString_GET_SIZE(buffp);
-	slen = olen;
-	bytesAv = slen + READ_SIZE;
-	cp = alloc(bytesAv);
-	if (cp == NULL)
-		return false;
-	memcpy(cp, PyString_AS_STRING(buffp), slen);
-	while (true) {
-		if (slen + READ_SIZE > bytesAv) {
-			bytesAv = max(bytesAv * 2, slen + READ_SIZE);
-			cp = ralloc(cp, bytesAv);
-			if (cp == NULL)
-				return false;
-		}
-		res = read(fd, cp + slen, READ_SIZE);
-		if (res > 0)
-			slen += res;
-		else if (res == 0) {
-			*eof = true;
-			break;
-		} else if (res < 0) {
-			 if (isBlocked(get_errno()))
-				break;
-			else {		/* bad error */
-				PyErr_SetFromErrno(rpcError);
-				return false;
-			}
-		}
-	}
-	buffp = PyString_FromStringAndSize(cp, slen);
-	if (buffp == NULL)
-		return false;
-	*buffpp = buffp;
-	free(cp);
-
-	return true;
-}
-
-
 /*
  * Tell an rpc server to exit the "work routine" asap
  */
@@ -1084,6 +1668,177 @@ pyRpcServerSetAuth(PyObject *self, PyObject *args)
 }
 
 
+/*
+ * turn compact (unindented) encoding of responses on or off
+ */
+static PyObject *
+pyRpcServerSetCompact(PyObject *self, PyObject *args)
+{
+	rpcServer	*servp;
+	int		compact;
+
+	servp = (rpcServer *)self;
+	unless (PyArg_ParseTuple(args, "i", &compact))
+		return NULL;
+	if (compact)
+		servp->encFlags |= ENC_COMPACT;
+	else
+		servp->encFlags &= ~ENC_COMPACT;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+/*
+ * Stream responses in HTTP chunks of about size bytes, encoding each
+ * one as the connection is ready for it; 0 turns streaming off.  Only
+ * HTTP/1.1 clients get streamed responses.
+ */
+static PyObject *
+pyRpcServerSetStreaming(PyObject *self, PyObject *args)
+{
+	rpcServer	*servp;
+	long		size;
+
+	servp = (rpcServer *)self;
+	unless (PyArg_ParseTuple(args, "l", &size))
+		return NULL;
+	if (size < 0)
+		return setPyErr("stream chunk size must not be negative");
+	servp->streamSize = size;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+/*
+ * Run method handlers on a pool of nthreads worker threads; 0 runs
+ * them on the thread that calls work(), as before.  Requests are still
+ * read, decoded and answered on that thread.  The requests the old
+ * pool has are all answered first, the ones it has not started being
+ * run right here.
+ */
+static PyObject *
+pyRpcServerSetWorkers(PyObject *self, PyObject *args)
+{
+	rpcServer	*servp;
+	int		nthreads;
+	bool		ok;
+
+	servp = (rpcServer *)self;
+	unless (PyArg_ParseTuple(args, "i", &nthreads))
+		return NULL;
+	if (nthreads < 0)
+		return setPyErr("number of workers must not be negative");
+	if (servp->workers) {
+		if (rpcWorkersOnWorker(servp->workers))
+			return setPyErr("workers can't be changed from a worker");
+		if (servp->workers->finishing)
+			return setPyErr("workers can't be changed while they "
+					"answer a request");
+		ok = rpcWorkersStop(servp->workers);
+		rpcWorkersFree(servp->workers);
+		servp->workers = NULL;
+		unless (ok)
+			return NULL;
+	}
+	if (nthreads > 0) {
+		servp->workers = rpcWorkersNew(servp->disp, nthreads);
+		if (servp->workers == NULL)
+			return NULL;
+	}
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+/*
+ * listen with SO_REUSEPORT, so that forked processes can each have a
+ * socket of their own on the port; must come before bindAndListen()
+ */
+static PyObject *
+pyRpcServerSetReusePort(PyObject *self, PyObject *args)
+{
+	rpcServer	*servp;
+	int		reusePort;
+
+	servp = (rpcServer *)self;
+	unless (PyArg_ParseTuple(args, "i", &reusePort))
+		return NULL;
+	servp->reusePort = reusePort ? true : false;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+/*
+ * stop accepting connections while maxConns of them are open; 0 means
+ * there is no limit
+ */
+static PyObject *
+pyRpcServerSetMaxConns(PyObject *self, PyObject *args)
+{
+	rpcServer	*servp;
+	int		maxConns;
+
+	servp = (rpcServer *)self;
+	unless (PyArg_ParseTuple(args, "i", &maxConns))
+		return NULL;
+	if (maxConns < 0)
+		return setPyErr("maximum connections must not be negative");
+	servp->maxConns = maxConns;
+	unless (resumeAccept(servp))
+		return NULL;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+/*
+ * accept at most budget connections each time the listening socket is
+ * readable
+ */
+static PyObject *
+pyRpcServerSetAcceptBudget(PyObject *self, PyObject *args)
+{
+	rpcServer	*servp;
+	int		budget;
+
+	servp = (rpcServer *)self;
+	unless (PyArg_ParseTuple(args, "i", &budget))
+		return NULL;
+	if (budget < 1)
+		return setPyErr("accept budget must be at least 1");
+	servp->acceptBudget = budget;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+static PyObject *
+pyRpcServerFork(PyObject *self, PyObject *args)
+{
+	int		nprocs,
+			res;
+
+	unless (PyArg_ParseTuple(args, "i", &nprocs))
+		return NULL;
+	res = rpcServerFork((rpcServer *)self, nprocs);
+	if (res < 0)
+		return NULL;
+	return PyInt_FromLong(res);
+}
+
+
+static PyObject *
+pyRpcServerStats(PyObject *self, PyObject *args)
+{
+	unless (PyArg_ParseTuple(args, ""))
+		return NULL;
+	return rpcServerStatsDict((rpcServer *)self);
+}
+
+
 /*
  * Tell an rpc server to exit the "work routine" asap
  */
@@ -1104,8 +1859,8 @@ pyRpcServerAddSource(PyObject *self, PyObject *args)
 		return setPyErr("callback params was NULL");
 	unless (PyTuple_Check(srcp->params))
 		return setPyErr("callback params was not a tuple");
-	unless (PyTuple_GET_SIZE(srcp->params) == 2)
-		return setPyErr("callback params was not a 2 length tuple");
+	unless (PyTuple_GET_SIZE(srcp->params) == 3)
+		return setPyErr("callback params was not a 3 length tuple");
 	unless (PyCallable_Check(PyTuple_GET_ITEM(srcp->params, 0)))
 		return setPyErr("callback params 1 was not callable");
 	unless (rpcDispAddSource(servp->disp, srcp))
@@ -1141,36 +1896,18 @@ pyRpcServerQueueResponse(PyObject *self, PyObject *args)
 {
 	rpcServer	*servp;
 	rpcSource	*srcp;
-	PyObject	*result,
-			*o;
-	bool		keepAlive;
+	PyObject	*result;
 
 	servp = (rpcServer *)self;
 	unless (PyArg_ParseTuple(args, "O!O", &rpcSourceType, &srcp, &result))
 		return (NULL);
 	assert(result != NULL);
-	if (!PyTuple_Check(srcp->params))
-		return setPyErr("srcp->params was not a tuple");
-	if (PyTuple_GET_SIZE(srcp->params) == 0)
-		return setPyErr("srcp->params did not have length 1 or 2");
-	if (! PyInt_Check(PyTuple_GET_ITEM(srcp->params, 0)))
-		return setPyErr("srcp->params[0] is not an int");
-
-	if (PyTuple_GET_SIZE(srcp->params) == 1) {
-		keepAlive = PyInt_AsLong(PyTuple_GET_ITEM(srcp->params, 0));
-		Py_DECREF(srcp->params);
-		srcp->params = NULL;
-	} else if (PyTuple_GET_SIZE(srcp->params) != 2) {
-		keepAlive = PyInt_AsLong(PyTuple_GET_ITEM(srcp->params, 0));
-		o = PyTuple_GET_ITEM(srcp->params, 1);
-		Py_INCREF(o);
-		Py_DECREF(srcp->params);
-		srcp->params = o;
-	} else
-		return setPyErr("srcp->params did not have length 1 or 2");
+	unless (srcp->conn.postponed)
+		return setPyErr("source has no postponed request");
+	srcp->conn.postponed = false;
 
 	Py_INCREF(result);
-	if (doResponse(servp, srcp, result, keepAlive)) {
+	if (doResponse(servp, srcp, result)) {
 		Py_INCREF(Py_None);
 		return (Py_None);
 	} else
@@ -1209,10 +1946,18 @@ static PyMethodDef pyRpcServerMethods[] = {
 	{ "setFdAndListen", (PyCFunction)pyRpcServerSetFdAndListen, 1, 0 },
 	{ "work",           (PyCFunction)pyRpcServerWork,           1, 0 },
 	{ "exit",           (PyCFunction)pyRpcServerExit,           1, 0 },
+	{ "fork",           (PyCFunction)pyRpcServerFork,           1, 0 },
 	{ "addSource",	    (PyCFunction)pyRpcServerAddSource,      1, 0 },
 	{ "delSource",	    (PyCFunction)pyRpcServerDelSource,      1, 0 },
+	{ "setAcceptBudget",(PyCFunction)pyRpcServerSetAcceptBudget,1, 0 },
 	{ "setAuth",        (PyCFunction)pyRpcServerSetAuth,        1, 0 },
+	{ "setCompact",     (PyCFunction)pyRpcServerSetCompact,     1, 0 },
+	{ "setMaxConnections",(PyCFunction)pyRpcServerSetMaxConns,  1, 0 },
 	{ "setOnErr",       (PyCFunction)pyRpcServerSetOnErr,       1, 0 },
+	{ "setReusePort",   (PyCFunction)pyRpcServerSetReusePort,   1, 0 },
+	{ "setStreaming",   (PyCFunction)pyRpcServerSetStreaming,   1, 0 },
+	{ "setWorkers",     (PyCFunction)pyRpcServerSetWorkers,     1, 0 },
+	{ "stats",          (PyCFunction)pyRpcServerStats,          1, 0 },
 	{ "queueFault",     (PyCFunction)pyRpcServerQueueFault,     1, 0 },
 	{ "queueResponse",  (PyCFunction)pyRpcServerQueueResponse,  1, 0 },
 	{ NULL,		NULL},
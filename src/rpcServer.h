@@ -13,12 +13,26 @@
 #include "rpcInclude.h"
 #include "rpcSource.h"
 #include "rpcDispatch.h"
+#include "rpcMethods.h"
+#include "rpcWorkers.h"
 
 
 extern	PyTypeObject	rpcServerType;
 
 
 
+/*
+ * counters kept by each process serving on a server's port; after
+ * rpcServerFork() they live in memory shared by all of the processes
+ */
+typedef struct {
+	long		pid,		/* the process */
+			conns,		/* connections accepted */
+			reqs,		/* requests read */
+			faults;		/* faults sent back */
+} rpcServerStats;
+
+
 /*
  * A new xmlrpc server
  */
@@ -26,27 +40,40 @@ typedef struct _server {
 	PyObject_HEAD			/* python standard */
 	rpcDisp		*disp;
 	rpcSource	*src;
-	PyObject	*comtab;
+	rpcMethods	*methods;	/* the methods it answers */
+	PyObject	*lastUri;	/* uri of the last request, reused
+					 * while requests keep to it */
 	bool		keepAlive;
 	PyObject	*authFunc;	/* authentication function */
+	int		encFlags;	/* ENC_* flags for responses */
+	long		streamSize;	/* chunk size when streaming, or 0 */
+	rpcWorkers	*workers;	/* runs the handlers, or NULL */
+	bool		reusePort;	/* listen with SO_REUSEPORT? */
+	int		port,		/* what bindAndListen() was given */
+			queue,
+			nprocs,		/* processes sharing allStats */
+			nconns,		/* connections open right now */
+			maxConns,	/* stop accepting at this many, or 0 */
+			acceptBudget;	/* most accepts per wakeup */
+	bool		paused;		/* src taken out for maxConns? */
+	rpcServerStats	local,		/* stats until the server forks */
+			*stats,		/* this process's stats */
+			*allStats;	/* every process's, once forked */
 } rpcServer;
 
 
 rpcServer	*rpcServerNew(void);
 void		rpcServerDealloc(rpcServer *sp);
-void		rpcServerClose(rpcServer *sp);
-bool		rpcServerAddPyMethods(rpcServer *sp, PyObject *toAdd);
+bool		rpcServerClose(rpcServer *sp);
+bool		rpcServerAddPyMethods(
+			rpcServer	*sp,
+			PyObject	*toAdd,
+			PyObject	*self
+		);
 bool		rpcServerAddCMethod(
 			rpcServer 	*servp,
 			char		*method,
-			PyObject	*(*func) (
-				rpcServer *,
-				rpcSource *,
-				char *,
-				char *,
-				PyObject *,
-				PyObject *
-			)
+			rpcCMethod	cfunc
 		);
 bool		rpcServerBindAndListen(
 			rpcServer	*sp,
@@ -54,6 +81,8 @@ bool		rpcServerBindAndListen(
 			int 		queue
 		);
 void		rpcServerSetAuth(rpcServer *sp, PyObject *authFunc);
+int		rpcServerFork(rpcServer *sp, int nprocs);
+PyObject	*rpcServerStatsDict(rpcServer *sp);
 
 
 #endif /* _RPCSERVER_H_ */
@@ -11,10 +11,25 @@
 
 #ifndef MSWINDOWS
 	#include <unistd.h>
+	#include <sys/uio.h>
 #endif /* MSWINDOWS */
 
 
+#define	READ_SIZE	4096		/* least we try to read at once */
+#define	READ_MAX	(16 * READ_SIZE)	/* most we read per wakeup */
+#define	IN_KEEP		65536		/* largest idle buffer we keep */
+#define	OUT_IOV		64		/* most segments per writev() */
+
+
+/*
+ * every fd given to a source gets a new generation, so the poller can
+ * tell a reused fd (or a reused source address) from the old one
+ */
+static	uint		nextFdGen = 1;
+
+
 static	PyObject	*rpcSourceGetAttr(rpcSource *cp, char *name);
+static	void		sourceClosed(rpcSource *srcp);
 static	bool		pyMarshaller(
 				rpcDisp		*dp,
 				rpcSource	*srcp,
@@ -33,7 +48,7 @@ rpcSourceNew(int fd)
 		return NULL;
 	sp->fd = fd;
 	sp->id = -1;
-	sp->actOcc = 0;
+	sp->slot = -1;
 	sp->actImp = 0;
 	sp->desc = NULL;
 	sp->func = NULL;
@@ -41,6 +56,21 @@ rpcSourceNew(int fd)
 	sp->onErrType = ONERR_TYPE_DEF;
 	sp->onErr = NULL;
 	sp->doClose = false;
+	sp->pollFd = -1;
+	sp->fdGen = nextFdGen++;
+	sp->in.beg = NULL;
+	sp->in.rpos = 0;
+	sp->in.wpos = 0;
+	sp->in.all = 0;
+	sp->out.segs = NULL;
+	sp->out.nsegs = 0;
+	sp->out.all = 0;
+	sp->out.off = 0;
+	sp->out.len = 0;
+	rpcHttpInit(&sp->http, TYPE_REQ);
+	memset(&sp->conn, 0, sizeof(sp->conn));
+	sp->onClose = NULL;
+	sp->closeArg = NULL;
 
 	return sp;
 }
@@ -51,10 +81,16 @@ rpcSourceDealloc(rpcSource *srcp)
 {
 	if (srcp->doClose)
 		close(srcp->fd);
+	sourceClosed(srcp);
 	if (srcp->desc) {
 		free(srcp->desc);
 		srcp->desc = NULL;
 	}
+	rpcSourceClearIn(srcp);
+	rpcSourceClearOut(srcp);
+	rpcSourceClearConn(srcp);
+	if (srcp->out.segs)
+		free(srcp->out.segs);
 	if (srcp->params) {
 		Py_DECREF(srcp->params);
 	}
@@ -98,6 +134,174 @@ rpcSourceSetOnErr(rpcSource *srcp, int funcType, void *func)
 }
 
 
+/*
+ * Have func called with arg when the source's fd is closed, or when the
+ * source goes away, whichever comes first; arg is kept until then
+ */
+void
+rpcSourceSetOnClose(
+	rpcSource	*srcp,
+	void		(*func)(rpcSource *sp, PyObject *arg),
+	PyObject	*arg
+)
+{
+	Py_XDECREF(srcp->closeArg);
+	srcp->onClose = func;
+	srcp->closeArg = arg;
+	Py_INCREF(arg);
+}
+
+
+static void
+sourceClosed(rpcSource *srcp)
+{
+	void		(*func)(rpcSource *sp, PyObject *arg);
+	PyObject	*arg;
+
+	func = srcp->onClose;
+	arg = srcp->closeArg;
+	if (func == NULL)
+		return;
+	srcp->onClose = NULL;
+	srcp->closeArg = NULL;
+	func(srcp, arg);
+	Py_DECREF(arg);
+}
+
+
+/*
+ * Give the source a new file descriptor.  Always use this (or
+ * rpcSourceClose()) rather than assigning fd directly, so that the
+ * dispatcher knows the old registration with the poller is gone.
+ */
+void
+rpcSourceSetFd(rpcSource *srcp, int fd)
+{
+	srcp->fd = fd;
+	srcp->fdGen = nextFdGen++;
+	rpcSourceClearIn(srcp);
+}
+
+
+void
+rpcSourceClose(rpcSource *srcp)
+{
+	if (srcp->fd >= 0)
+		close(srcp->fd);
+	rpcSourceSetFd(srcp, -1);
+	rpcSourceClearOut(srcp);
+	rpcSourceClearConn(srcp);
+	sourceClosed(srcp);
+}
+
+
+/*
+ * Read what is available on the source's fd into its input buffer, up
+ * to READ_MAX bytes so that the caller decodes as the data comes in; the
+ * rest is left for the next wakeup.  The data is appended in place; it
+ * is only copied when the buffer has to grow or when consumed space at
+ * the front is worth reclaiming.
+ */
+bool
+rpcSourceRead(rpcSource *srcp, bool *eof)
+{
+	rpcInBuff	*ip;
+	char		*nbeg;
+	long		nall,
+			used,
+			nread;
+	int		res;
+
+	*eof = false;
+	ip = &srcp->in;
+	for (nread = 0; nread < READ_MAX; nread += res) {
+		if (ip->all - ip->wpos < READ_SIZE + 1) {
+			used = ip->wpos - ip->rpos;
+			if (ip->rpos >= used and ip->all - used >= READ_SIZE + 1) {
+				memmove(ip->beg, ip->beg + ip->rpos, used);
+			} else {
+				nall = max(2 * ip->all, used + READ_SIZE + 1);
+				nbeg = ralloc(ip->beg, nall);
+				if (nbeg == NULL)
+					return false;
+				ip->beg = nbeg;
+				ip->all = nall;
+				memmove(ip->beg, ip->beg + ip->rpos, used);
+			}
+			ip->rpos = 0;
+			ip->wpos = used;
+		}
+		res = read(srcp->fd, ip->beg + ip->wpos, ip->all - ip->wpos - 1);
+		if (res > 0)
+			ip->wpos += res;
+		else if (res == 0) {
+			*eof = true;
+			break;
+		} else if (isBlocked(get_errno()))
+			break;
+		else {		/* bad error */
+			ip->beg[ip->wpos] = EOS;
+			PyErr_SetFromErrno(rpcError);
+			return false;
+		}
+	}
+	ip->beg[ip->wpos] = EOS;
+
+	return true;
+}
+
+
+/*
+ * Drop nBytes from the front of the input buffer
+ */
+void
+rpcSourceConsume(rpcSource *srcp, long nBytes)
+{
+	rpcInBuff	*ip;
+
+	ip = &srcp->in;
+	assert(nBytes <= ip->wpos - ip->rpos);
+	ip->rpos += nBytes;
+	if (ip->rpos < ip->wpos)
+		return;
+	ip->rpos = 0;
+	ip->wpos = 0;
+	if (ip->all > IN_KEEP)
+		rpcSourceClearIn(srcp);
+	else if (ip->beg)
+		ip->beg[0] = EOS;
+}
+
+
+/*
+ * Keep only the first nBytes of the unconsumed input, after the data
+ * has been rewritten in place
+ */
+void
+rpcSourceTruncate(rpcSource *srcp, long nBytes)
+{
+	rpcInBuff	*ip;
+
+	ip = &srcp->in;
+	assert(nBytes <= ip->wpos - ip->rpos);
+	ip->wpos = ip->rpos + nBytes;
+	if (ip->beg)
+		ip->beg[ip->wpos] = EOS;
+}
+
+
+void
+rpcSourceClearIn(rpcSource *srcp)
+{
+	if (srcp->in.beg)
+		free(srcp->in.beg);
+	srcp->in.beg = NULL;
+	srcp->in.rpos = 0;
+	srcp->in.wpos = 0;
+	srcp->in.all = 0;
+}
+
+
 /*
  * Set a handler for errors on the client
  */
@@ -173,7 +377,8 @@ pyRpcSourceSetDesc(PyObject *self, PyObject *args)
 
 
 /*
- * Set the callback for a specific object
+ * Set the callback for a specific object.  The callback gets owner, the
+ * source itself if it is not given, as its first argument.
  */
 static PyObject *
 pySetCallback(PyObject *self, PyObject *args)
@@ -182,16 +387,20 @@ pySetCallback(PyObject *self, PyObject *args)
 	int		actions;
 	PyObject	*func,
 			*params,
+			*owner,
 			*realParams;
 
 	srcp = (rpcSource *)self;
-	unless (PyArg_ParseTuple(args, "OiO", &func, &actions, &params))
+	owner = self;
+	unless (PyArg_ParseTuple(args, "OiO|O", &func, &actions, &params,
+				&owner))
 		return NULL;
 	unless (PyCallable_Check(func))
 		return setPyErr("Callback must be a callable object");
-	realParams = Py_BuildValue("(O,O)", func, params);
+	realParams = Py_BuildValue("(O,O,O)", func, params, owner);
 	if (realParams == NULL)
 		return NULL;
+	Py_XDECREF(srcp->params);
 	srcp->actImp = actions;
 	srcp->func = pyMarshaller;
 	srcp->params = realParams;
@@ -209,22 +418,35 @@ pyMarshaller(rpcDisp *dp, rpcSource *srcp, int acts, PyObject *params)
 {
 	PyObject	*res,
 			*pyFunc,
-			*realArgs;
+			*realArgs,
+			*owner,
+			*pyActs;
+	bool		again;
 
 	assert(PyTuple_Check(params));
-	assert(PyTuple_GET_SIZE(params) == 2);
+	assert(PyTuple_GET_SIZE(params) == 3);
 	pyFunc = PyTuple_GET_ITEM(params, 0);
 	realArgs = PyTuple_GET_ITEM(params, 1);
+	owner = PyTuple_GET_ITEM(params, 2);
 	assert(PyCallable_Check(pyFunc));
 
-	res = PyObject_CallFunction(pyFunc, "(O,i,O)", srcp, acts, realArgs);
+	pyActs = PyInt_FromLong(acts);
+	if (pyActs == NULL)
+		return false;
+	res = PyObject_CallFunctionObjArgs(pyFunc, owner, pyActs, realArgs,
+						NULL);
+	Py_DECREF(pyActs);
 	if (res == NULL)
 		return false;
+	again = false;
 	unless (PyInt_Check(res)) {
 		fprintf(rpcLogger, "callback returned ");
 		PyObject_Print(res, rpcLogger, 0);
 		fprintf(rpcLogger, "; removing handler\n");
-	} else if (PyInt_AsLong(res)) {
+	} else
+		again = PyInt_AsLong(res) != 0;
+	Py_DECREF(res);
+	if (again) {
 		srcp->params = params;
 		srcp->actImp = acts;
 		srcp->func = pyMarshaller;
@@ -316,3 +538,129 @@ PyTypeObject rpcSourceType = {
 	.tp_flags = 0,
 	.tp_doc = NULL
 };
+
+
+/*
+ * Queue a string to be written after whatever is already queued
+ */
+bool
+rpcSourceQueue(rpcSource *srcp, PyObject *str)
+{
+	rpcOutBuff	*op;
+	PyObject	**segs;
+	int		nall;
+
+	assert(PyString_Check(str));
+	op = &srcp->out;
+	if (PyString_GET_SIZE(str) == 0)
+		return true;
+	if (op->nsegs == op->all) {
+		nall = max(2 * op->all, 4);
+		segs = ralloc(op->segs, nall * sizeof(*segs));
+		if (segs == NULL)
+			return false;
+		op->segs = segs;
+		op->all = nall;
+	}
+	Py_INCREF(str);
+	op->segs[op->nsegs++] = str;
+	op->len += PyString_GET_SIZE(str);
+
+	return true;
+}
+
+
+/*
+ * Write as much of the queued output as the fd will take.  *done is set
+ * once the queue is empty.  A short write just moves the offset into
+ * the first string along; it never copies what is left.
+ */
+bool
+rpcSourceWrite(rpcSource *srcp, bool *done)
+{
+	rpcOutBuff	*op;
+	long		nb,
+			slen;
+	int		i,
+			n;
+#ifndef MSWINDOWS
+	struct iovec	iov[OUT_IOV];
+#endif /* MSWINDOWS */
+
+	op = &srcp->out;
+	*done = false;
+	while (op->nsegs > 0) {
+#ifdef MSWINDOWS
+		n = 1;
+		nb = write(srcp->fd, PyString_AS_STRING(op->segs[0]) + op->off,
+				PyString_GET_SIZE(op->segs[0]) - op->off);
+#else
+		n = min(op->nsegs, OUT_IOV);
+		for (i = 0; i < n; ++i) {
+			iov[i].iov_base = PyString_AS_STRING(op->segs[i]);
+			iov[i].iov_len = PyString_GET_SIZE(op->segs[i]);
+		}
+		iov[0].iov_base = (char *)iov[0].iov_base + op->off;
+		iov[0].iov_len -= op->off;
+		nb = writev(srcp->fd, iov, n);
+#endif /* MSWINDOWS */
+		if (nb < 0 and isBlocked(get_errno()))
+			return true;
+		if (nb < 0) {
+			PyErr_SetFromErrno(rpcError);
+			return false;
+		}
+		op->len -= nb;
+		for (i = 0; i < op->nsegs; ++i) {
+			slen = PyString_GET_SIZE(op->segs[i]) - op->off;
+			if (nb < slen)
+				break;
+			nb -= slen;
+			op->off = 0;
+			Py_DECREF(op->segs[i]);
+		}
+		op->off += nb;
+		op->nsegs -= i;
+		memmove(op->segs, op->segs + i, op->nsegs * sizeof(*op->segs));
+		if (i < n)		/* the fd is full */
+			return true;
+	}
+	*done = true;
+
+	return true;
+}
+
+
+/*
+ * Forget any output that has not been written
+ */
+void
+rpcSourceClearOut(rpcSource *srcp)
+{
+	rpcOutBuff	*op;
+	int		i;
+
+	op = &srcp->out;
+	for (i = 0; i < op->nsegs; ++i) {
+		Py_DECREF(op->segs[i]);
+	}
+	op->nsegs = 0;
+	op->off = 0;
+	op->len = 0;
+}
+
+
+/*
+ * Forget where the connection was in its request
+ */
+void
+rpcSourceClearConn(rpcSource *srcp)
+{
+	rpcConn		conn;
+
+	conn = srcp->conn;
+	memset(&srcp->conn, 0, sizeof(srcp->conn));
+	Py_XDECREF(conn.uri);
+	Py_XDECREF(conn.decoder);
+	Py_XDECREF(conn.stream);
+}
@@ -11,6 +11,7 @@
 
 
 #include "rpcInclude.h"
+#include "rpcHttp.h"
 
 
 #define	ACT_INPUT	(1 << 0)
@@ -34,6 +35,51 @@ struct _source;			/* to appease the compiler gods */
 struct _disp;			/* to appease the compiler gods */
 
 
+/*
+ * bytes read from a source which have not been consumed yet; the
+ * data always has an EOS after it
+ */
+typedef struct {
+	char		*beg;		/* the buffer */
+	long		rpos,		/* start of the unconsumed data */
+			wpos,		/* where the next read goes */
+			all;		/* bytes allocated */
+} rpcInBuff;
+
+
+/*
+ * python strings waiting to be written to a source, in order; they are
+ * handed to writev() as they are, so nothing is copied however the
+ * writes happen to split up
+ */
+typedef struct {
+	PyObject	**segs;		/* the strings */
+	int		nsegs,		/* strings queued */
+			all;		/* room in segs */
+	long		off,		/* bytes of segs[0] already written */
+			len;		/* bytes still to write */
+} rpcOutBuff;
+
+
+/*
+ * where a connection is in its current request or call; the server's
+ * and the client's callbacks keep their state here, so that their
+ * params need only be the server or client itself
+ */
+typedef struct {
+	int		state;		/* client: STATE_* of the call */
+	bool		keepAlive,	/* server: keep the connection open? */
+			chunked,	/* client: is the response chunked? */
+			postponed;	/* server: waiting on queueResponse()? */
+	long		hlen,		/* client: length of the header */
+			blen;		/* body length (server: bytes still to
+					 * come), or -1 if chunked */
+	PyObject	*uri,		/* server: uri of the request */
+			*decoder,	/* server: decoding the request body */
+			*stream;	/* server: response being streamed */
+} rpcConn;
+
+
 /*
  * a source object
  */
@@ -41,8 +87,8 @@ typedef struct _source {
 	PyObject_HEAD			/* python standard */
 	int		fd,		/* the file descriptor for events */
 			id,		/* id associated with the source */
-			actImp,		/* actions that are important */
-			actOcc;		/* actions that occured in last event */
+			slot,		/* index in the dispatcher's sources */
+			actImp;		/* actions that are important */
 	char		*desc;		/* description of the source */
 	bool		(*func)(	/* callback handler */
 				struct _disp	*dp,
@@ -54,14 +100,45 @@ typedef struct _source {
 	char		onErrType;	/* is the handler in c or python? */
 	void		*onErr;		/* error handler */
 	bool		doClose;	/* should we close the fd when done? */
+	int		pollFd;		/* fd registered with the poller */
+	uint		fdGen;		/* changes whenever fd changes */
+	rpcInBuff	in;		/* data read but not yet consumed */
+	rpcOutBuff	out;		/* data queued but not yet written */
+	rpcHttpHead	http;		/* header being parsed from in */
+	rpcConn		conn;		/* the request on the connection */
+	void		(*onClose)(	/* called once the fd is closed */
+				struct _source	*sp,
+				PyObject	*arg
+			);
+	PyObject	*closeArg;	/* parameter for onClose */
 } rpcSource;
 
 
+#define	rpcSourceInData(sp)	((sp)->in.beg + (sp)->in.rpos)
+#define	rpcSourceInLen(sp)	((sp)->in.wpos - (sp)->in.rpos)
+#define	rpcSourceOutLen(sp)	((sp)->out.len)
+
+
 
 rpcSource	*rpcSourceNew(int fd);
 void		rpcSourceDealloc(rpcSource *sp);
 void		rpcSourceSetParams(rpcSource *sp, PyObject *params);
 void		rpcSourceSetOnErr(rpcSource *sp, int funcType, void *func);
+void		rpcSourceSetOnClose(
+			rpcSource	*sp,
+			void		(*func)(rpcSource *sp, PyObject *arg),
+			PyObject	*arg
+		);
+void		rpcSourceSetFd(rpcSource *sp, int fd);
+void		rpcSourceClose(rpcSource *sp);
+bool		rpcSourceRead(rpcSource *sp, bool *eof);
+void		rpcSourceConsume(rpcSource *sp, long nBytes);
+void		rpcSourceTruncate(rpcSource *sp, long nBytes);
+void		rpcSourceClearIn(rpcSource *sp);
+bool		rpcSourceQueue(rpcSource *sp, PyObject *str);
+bool		rpcSourceWrite(rpcSource *sp, bool *done);
+void		rpcSourceClearOut(rpcSource *sp);
+void		rpcSourceClearConn(rpcSource *sp);
 
 
 #endif /* _RPCSOURCE_H_ */
@@ -8,19 +8,27 @@
 #include <string.h>
 #include "xmlrpc.h"
 #include "rpcInternal.h"
+#include "rpcScan.h"
 
 
 #define	BUFF_START	256
+#define	LEN_WIDTH	12		/* room for the Content-length */
 #define	EOL		"\r\n"
 #define	COM_BEG		"<!-- "
 #define	COM_END		" -->"
 #define	TAG_LEN(t)	(long)(sizeof(t)-1)
 
 
+/*
+ * The buffer is a python string from the start, so handing the result
+ * to python costs nothing more than trimming it to size.
+ */
 typedef struct {
+	PyObject *str;		/* the python string holding the buffer */
 	char	*beg;		/* beginning of the string */
 	ulong	len,		/* length of the string */
 		all;		/* length of allocated memory */
+	int	flags;		/* ENC_* flags for the encoder */
 } strBuff;
 
 static	char		*chompStr(char **cp, char *ep, ulong *lines);
@@ -36,14 +44,38 @@ static	PyObject	*syntaxErr(ulong line);
 static	PyObject	*eosErr(void);
 static	bool		buildInt(char *cp, int slen, int *ip);
 static	PyObject	*unescapeString(char *bp, char *ep);
-static PyObject		*escapeString(PyObject *oldStr);
+static	bool		unescapeEntity(char **bpp, char *ep, char *cp);
 
-static	strBuff		*newBuff(void);
+static	strBuff		*newBuff(int flags);
 static	strBuff		*growBuff(strBuff *sp, ulong moreBytes);
 static	void		freeBuff(strBuff *sp);
+static	PyObject	*buffString(strBuff *sp);
 static	strBuff		*buffConcat(strBuff *sp, char *cp);
 static	strBuff		*buffAppend(strBuff *sp, char *cp, ulong len);
 static	strBuff		*buffRepeat(strBuff *sp, char c, uint reps);
+static	strBuff		*buffEscape(strBuff *sp, char *cp, char *ep);
+static	strBuff		*buffLong(strBuff *sp, long l);
+static	strBuff		*buffDigits(
+				strBuff		*sp,
+				char		*dp,
+				long		ndig,
+				long		point,
+				bool		neg
+			);
+static	char		*shortestDigits(
+				double		d,
+				int		*point,
+				int		*neg,
+				char		**ep
+			);
+static	void		freeDigits(char *dp);
+static	bool		fewDigits(
+				double		d,
+				char		*buff,
+				int		*point,
+				int		*neg,
+				char		**ep
+			);
 
 static	strBuff		*encodeValue(strBuff *sp, PyObject *value, uint tabs);
 static	strBuff		*encodeBool(strBuff *sp, PyObject *value);
@@ -55,55 +87,82 @@ static	strBuff		*encodeBase64(strBuff *sp, PyObject *value);
 static	strBuff		*encodeDate(strBuff *sp, PyObject *value);
 static	strBuff		*encodeArray(strBuff *sp, PyObject *value, uint tabs);
 static	strBuff		*encodeStruct(strBuff *sp, PyObject *value, uint tabs);
+static	strBuff		*arrayHead(strBuff *sp, uint tabs);
+static	strBuff		*arrayTail(strBuff *sp, uint tabs);
+static	strBuff		*structHead(strBuff *sp, uint tabs);
+static	strBuff		*structTail(strBuff *sp, uint tabs);
+static	strBuff		*memberHead(strBuff *sp, PyObject *name, uint tabs);
+static	strBuff		*memberTail(strBuff *sp, uint tabs);
 
 static	PyObject	*decodeValue(char **cp, char *ep, ulong *lines);
 static	PyObject	*decodeInt(char **cp, char *ep, ulong *lines);
 static	PyObject	*decodeI4(char **cp, char *ep, ulong *lines);
+static	PyObject	*decodeInteger(
+				char		**cp,
+				char		*ep,
+				ulong		*lines,
+				char		*tag
+			);
 static	PyObject	*decodeDate(char **cp, char *eq, ulong *lines);
 static	PyObject	*decodeDouble(char **cp, char *ep, ulong *lines);
 static	PyObject	*decodeString(char **cp, char *ep, ulong *lines);
 static	PyObject	*decodeTaglessString(char **cp, char *ep, ulong *lines);
+static	bool		scanString(
+				char		*tag,
+				char		**cp,
+				char		*ep,
+				ulong		*lines,
+				bool		*esc
+			);
 static	PyObject	*decodeBool(char **cp, char *ep, ulong *lines);
 static	PyObject	*decodeNone(char **cp, char *ep, ulong *lines);
 static	PyObject	*decodeBase64(char **cp, char *ep, ulong *lines);
 static	PyObject	*decodeArray(char **cp, char *ep, ulong *lines);
 static	PyObject	*decodeStruct(char **cp, char *ep, ulong *lines);
 
-static	strBuff		*buildHeader(
+static	bool		buildHeader(
+				strBuff		*header,
 				int		reqType,
 				char		*url,
 				PyObject	*addInfo,
-				long		len
+				ulong		*lpos
 			);
+static	bool		setLength(strBuff *sp, ulong lpos);
 static	PyObject	*parseFault(char *cp, char *ep, ulong lines);
+static	bool		raiseFault(PyObject *errDict);
+static	PyObject	*findMethodName(char **cpp, char *ep, ulong *lines);
 static	PyObject	*parseHeader(
 				char	**cpp,
 				char	*ep,
 				ulong	*lines,
 				int	reqType
 			);
-static	bool		parseHeaderLine(
-				PyObject	*addInfo,
-				char		**cp,
-				char		 *ep,
-				ulong		 *lines
+static	PyObject	*parseCallStr(char *cp, char *ep, ulong lines);
+static	PyObject	*parseResponseStr(
+				char		*cp,
+				char		*ep,
+				ulong		lines,
+				PyObject	*addInfo
 			);
 bool	parseParams	(char **cpp, char *ep, ulong *lines, PyObject *params);
 
 static strBuff *
-newBuff(void)
+newBuff(int flags)
 {
 	strBuff		*sp;
 
 	sp = alloc(sizeof(*sp));
 	if (sp == NULL)
 		return NULL;
+	sp->flags = flags;
 	sp->len = 0;
 	sp->all = BUFF_START;
-	sp->beg = alloc(sizeof(*sp->beg) * sp->all);
-	if (sp->beg == NULL)
+	sp->str = PyBytes_FromStringAndSize(NULL, sp->all);
+	if (sp->str == NULL) {
+		free(sp);
 		return NULL;
-	memset(sp->beg, 0, sp->all);
+	}
+	sp->beg = PyString_AS_STRING(sp->str);
 
 	return sp;
 }
@@ -120,11 +179,10 @@ growBuff(strBuff *sp, ulong moreBytes)
 		nBytes = sp->all * 2;
 	else
 		nBytes = sp->all + moreBytes + 1;
-	sp->all = nBytes;
-	sp->beg = ralloc(sp->beg, sp->all);
-	if (sp->beg == NULL)
+	if (_PyString_Resize(&sp->str, nBytes))
 		return NULL;
-	memset(sp->beg + sp->len, 0, sp->all - sp->len);
+	sp->all = nBytes;
+	sp->beg = PyString_AS_STRING(sp->str);
 
 	return sp;
 }
@@ -161,6 +219,12 @@ buffAppend(strBuff *sp, char *cp, ulong len)
 /* handy define to avoid useless calls to buffConcat when working with constant strings */
 #define buffConstant(sp, x)	buffAppend(sp, x, sizeof(x)-1)
 
+/* line ends and indentation, both of which are left out in compact mode */
+#define buffEol(sp)		(((sp)->flags & ENC_COMPACT) ? (sp) : \
+					buffConstant(sp, EOL))
+#define buffTabs(sp, n)		(((sp)->flags & ENC_COMPACT) ? (sp) : \
+					buffRepeat(sp, '\t', n))
+
 static strBuff *
 buffRepeat(strBuff *sp, char c, uint reps)
 {
@@ -174,31 +238,70 @@ buffRepeat(strBuff *sp, char c, uint reps)
 }
 
 
+/*
+ * append the decimal representation of l
+ */
+static strBuff *
+buffLong(strBuff *sp, long l)
+{
+	char		buff[24],
+			*cp;
+	ulong		u;
+
+	cp = buff + sizeof(buff);
+	u = (l < 0) ? 0UL - (ulong)l : (ulong)l;
+	do {
+		*--cp = '0' + (u % 10);
+		u /= 10;
+	} while (u);
+	if (l < 0)
+		*--cp = '-';
+
+	return buffAppend(sp, cp, buff + sizeof(buff) - cp);
+}
+
+
 static void
 freeBuff(strBuff *sp)
 {
-	if (sp->beg != NULL)
-		free(sp->beg);
+	Py_XDECREF(sp->str);
+	free(sp);
+}
+
+
+/*
+ * trim the buffer to size and return it as a python string
+ */
+static PyObject *
+buffString(strBuff *sp)
+{
+	PyObject	*res;
+
+	if (_PyString_Resize(&sp->str, sp->len)) {
+		free(sp);
+		return NULL;
+	}
+	res = sp->str;
 	free(sp);
+
+	return res;
 }
 
 
 PyObject *
-xmlEncode(PyObject *value)
+xmlEncode(PyObject *value, int flags)
 {
 	strBuff		*sp;
-	PyObject	*res;
 
-	sp = newBuff();
+	sp = newBuff(flags);
 	if (sp == NULL)
 		return NULL;
-	sp = encodeValue(sp, value, 0);
-	if (sp == NULL)
+	if (encodeValue(sp, value, 0) == NULL) {
+		freeBuff(sp);
 		return NULL;
-	res = PyString_FromStringAndSize(sp->beg, sp->len);
-	freeBuff(sp);
+	}
 
-	return res;
+	return buffString(sp);
 }
 
 
@@ -228,7 +331,6 @@ encodeValue(strBuff *sp, PyObject *value, uint tabs)
 	else {
 		PyObject	*str1,
 				*str2;
-		freeBuff(sp);
 		str1 = PyString_FromString("invalid object to encode: ");
 		str2 = PyObject_Repr(value);
 		if (str1 == NULL or str2 == NULL)
@@ -254,7 +356,6 @@ encodeValue(strBuff *sp, PyObject *value, uint tabs)
 static strBuff *
 encodeInt(strBuff *sp, PyObject *value)
 {
-	char		buff[256];
 	long		l;
 
 	if (PyInt_Check(value)) {
@@ -262,12 +363,11 @@ encodeInt(strBuff *sp, PyObject *value)
 	} else {
 		assert(PyLong_Check(value));
 		l = PyLong_AsLong(value);
+		if (l == -1 and PyErr_Occurred())
+			return NULL;	/* too big for an xmlrpc int */
 	}
-	snprintf(buff, sizeof(buff)-1, "%ld", l);
-	buff[sizeof(buff)-1] = EOS;
-
 	if ((buffConstant(sp, "<int>") == NULL)
-	or  (buffConcat(sp, buff) == NULL)
+	or  (buffLong(sp, l) == NULL)
 	or  (buffConstant(sp, "</int>") == NULL))
 		return NULL;
 
@@ -276,21 +376,183 @@ encodeInt(strBuff *sp, PyObject *value)
 
 
 /*
- * encode the double 4.0 (for example) as: "<double>4.0</double>"
- * i should fix the precision, but I'm not sure how to.
+ * Doubles are written with the fewest digits that read back as the
+ * same value, in plain positional notation since xmlrpc does not allow
+ * an exponent.
  */
 static strBuff *
 encodeDouble(strBuff *sp, PyObject *value)
 {
-	char		buff[256];
+	char		buff[24],
+			*dp,		/* the digits */
+			*ep;
+	int		point,		/* digits before the decimal point */
+			neg;
 	double		d;
 
 	d = PyFloat_AS_DOUBLE(value);
-	snprintf(buff, 255, "%.17f", d);
+	if (not Py_IS_FINITE(d)) {		/* not really xmlrpc */
+		if (Py_IS_NAN(d))
+			sp = buffConstant(sp, "<double>nan</double>");
+		else if (d > 0)
+			sp = buffConstant(sp, "<double>inf</double>");
+		else
+			sp = buffConstant(sp, "<double>-inf</double>");
+		return sp;
+	}
+	if (fewDigits(d, buff, &point, &neg, &ep)) {
+		if ((buffConstant(sp, "<double>") == NULL)
+		or  (buffDigits(sp, buff, ep - buff, point, neg) == NULL))
+			return NULL;
+		return buffConstant(sp, "</double>");
+	}
+	dp = shortestDigits(d, &point, &neg, &ep);
+	if (dp == NULL)
+		return NULL;
 	if ((buffConstant(sp, "<double>") == NULL)
-	or  (buffConcat(sp, buff) == NULL)
-	or  (buffConstant(sp, "</double>") == NULL))
+	or  (buffDigits(sp, dp, ep - dp, point, neg) == NULL)) {
+		freeDigits(dp);
+		return NULL;
+	}
+	freeDigits(dp);
+
+	return buffConstant(sp, "</double>");
+}
+
+
+/*
+ * Most doubles that people send are short decimals (12.5, 0.001) that
+ * are exactly m / 10^k for some small k and an m well below 2^53.  The
+ * smallest such k gives the shortest digits that read back as d, and
+ * finding it is a lot cheaper than the general algorithm.  Returns
+ * false if d is not one of those.
+ */
+static bool
+fewDigits(double d, char *buff, int *point, int *neg, char **ep)
+{
+	static const double	pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+		1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+	};
+	char		tmp[24],
+			*cp;
+	double		m;
+	PY_LONG_LONG	im;
+	int		k,
+			ndig;
+
+	*neg = (d < 0 or (d == 0 and copysign(1.0, d) < 0));
+	if (*neg)
+		d = -d;
+	for (k = 0; k < (int)(sizeof(pow10) / sizeof(*pow10)); ++k) {
+		m = d * pow10[k];
+		if (m >= 1e15)
+			return false;
+		im = (PY_LONG_LONG)m;
+		if ((double)im == m and (double)im / pow10[k] == d)
+			break;
+	}
+	if (k == (int)(sizeof(pow10) / sizeof(*pow10)))
+		return false;
+	cp = tmp + sizeof(tmp);
+	do {
+		*--cp = '0' + (int)(im % 10);
+		im /= 10;
+	} while (im);
+	ndig = tmp + sizeof(tmp) - cp;
+	memcpy(buff, cp, ndig);
+	*point = ndig - k;
+	*ep = buff + ndig;
+	while (*ep > buff + 1 and (*ep)[-1] == '0')
+		(*ep)--;
+
+	return true;
+}
+
+
+/*
+ * The shortest digits that read back as d, taken from its repr(); set
+ * *point as for buffDigits(), *neg and *ep to the end of the digits.
+ * Free them with freeDigits().
+ */
+static char *
+shortestDigits(double d, int *point, int *neg, char **ep)
+{
+	char		*rp,
+			*cp,
+			*wp;
+
+	rp = PyOS_double_to_string(d, 'r', 0, 0, NULL);
+	if (rp == NULL)
 		return NULL;
+	cp = rp;
+	*neg = (*cp == '-');
+	if (*neg)
+		cp++;
+	*point = -1;
+	for (wp = rp; ('0' <= *cp and *cp <= '9') or *cp == '.'; ++cp)
+		if (*cp == '.')
+			*point = wp - rp;
+		else
+			*wp++ = *cp;
+	if (*point < 0)
+		*point = wp - rp;
+	if (*cp == 'e')
+		*point += strtol(cp + 1, NULL, 10);
+	for (cp = rp; cp + 1 < wp and *cp == '0'; ++cp)
+		(*point)--;
+	memmove(rp, cp, wp - cp);
+	*ep = rp + (wp - cp);
+	while (*ep > rp + 1 and (*ep)[-1] == '0')
+		(*ep)--;
+
+	return rp;
+}
+
+
+static void
+freeDigits(char *dp)
+{
+	PyMem_Free(dp);
+}
+
+
+/*
+ * Append the ndig digits at dp with the decimal point after the first
+ * point of them (point may be negative or larger than ndig).
+ */
+static strBuff *
+buffDigits(strBuff *sp, char *dp, long ndig, long point, bool neg)
+{
+	char		*wp;
+
+	if (growBuff(sp, ndig + labs(point) + 4) == NULL)
+		return NULL;
+	wp = sp->beg + sp->len;
+	if (neg)
+		*wp++ = '-';
+	if (point <= 0) {
+		*wp++ = '0';
+		*wp++ = '.';
+		memset(wp, '0', -point);
+		wp += -point;
+		memcpy(wp, dp, ndig);
+		wp += ndig;
+	} else if (point >= ndig) {
+		memcpy(wp, dp, ndig);
+		wp += ndig;
+		memset(wp, '0', point - ndig);
+		wp += point - ndig;
+		*wp++ = '.';
+		*wp++ = '0';
+	} else {
+		memcpy(wp, dp, point);
+		wp += point;
+		*wp++ = '.';
+		memcpy(wp, dp + point, ndig - point);
+		wp += ndig - point;
+	}
+	sp->len = wp - sp->beg;
 
 	return sp;
 }
@@ -326,21 +588,14 @@ encodeBool(strBuff *sp, PyObject *value)
 static strBuff *
 encodeString(strBuff *sp, PyObject *value)
 {
-	PyObject	*escStr;
-	uint		len;
 	char		*cp;
 
-	escStr = escapeString(value);
-	if (escStr == NULL)
-		return NULL;
-	cp = PyString_AS_STRING(escStr);
-	len = PyObject_Length(escStr);
-
+	assert(PyString_Check(value));
+	cp = PyString_AS_STRING(value);
 	if ((buffConstant(sp, "<string>") == NULL)
-	or  (buffAppend(sp, cp, len) == NULL)
+	or  (buffEscape(sp, cp, cp + PyString_GET_SIZE(value)) == NULL)
 	or  (buffConstant(sp, "</string>") == NULL))
 		return NULL;
-	Py_DECREF(escStr);
 
 	return sp;
 }
@@ -432,9 +687,104 @@ encodeDate(strBuff *sp, PyObject *value)
 }
 
 
+/*
+ * the parts of an array or struct around its elements, which the
+ * streaming encoder needs one at a time
+ */
+static strBuff *
+arrayHead(strBuff *sp, uint tabs)
+{
+	if ((buffEol(sp) == NULL)
+	or  (buffTabs(sp, tabs + 1) == NULL)
+	or  (buffConstant(sp, "<array>") == NULL)
+	or  (buffEol(sp) == NULL)
+	or  (buffTabs(sp, tabs + 2) == NULL)
+	or  (buffConstant(sp, "<data>") == NULL)
+	or  (buffEol(sp) == NULL))
+		return NULL;
+
+	return sp;
+}
+
+
+static strBuff *
+arrayTail(strBuff *sp, uint tabs)
+{
+	if ((buffTabs(sp, tabs + 2) == NULL)
+	or  (buffConstant(sp, "</data>") == NULL)
+	or  (buffEol(sp) == NULL)
+	or  (buffTabs(sp, tabs + 1) == NULL)
+	or  (buffConstant(sp, "</array>") == NULL)
+	or  (buffEol(sp) == NULL)
+	or  (buffTabs(sp, tabs) == NULL))
+		return NULL;
+
+	return sp;
+}
+
+
+static strBuff *
+structHead(strBuff *sp, uint tabs)
+{
+	if ((buffEol(sp) == NULL)
+	or  (buffTabs(sp, tabs + 1) == NULL)
+	or  (buffConstant(sp, "<struct>") == NULL)
+	or  (buffEol(sp) == NULL))
+		return NULL;
+
+	return sp;
+}
+
+
+static strBuff *
+structTail(strBuff *sp, uint tabs)
+{
+	if ((buffTabs(sp, tabs + 1) == NULL)
+	or  (buffConstant(sp, "</struct>") == NULL)
+	or  (buffEol(sp) == NULL)
+	or  (buffTabs(sp, tabs) == NULL))
+		return NULL;
+
+	return sp;
+}
+
+
+/*
+ * everything in a member before its value; name must be a string
+ */
+static strBuff *
+memberHead(strBuff *sp, PyObject *name, uint tabs)
+{
+	if ((buffTabs(sp, tabs + 2) == NULL)
+	or  (buffConstant(sp, "<member>") == NULL)
+	or  (buffEol(sp) == NULL)
+	or  (buffTabs(sp, tabs + 3) == NULL)
+	or  (buffConstant(sp, "<name>") == NULL)
+	or  (buffConcat(sp, PyString_AS_STRING(name)) == NULL)
+	or  (buffConstant(sp, "</name>") == NULL)
+	or  (buffEol(sp) == NULL)
+	or  (buffTabs(sp, tabs + 3) == NULL))
+		return NULL;
+
+	return sp;
+}
+
+
+static strBuff *
+memberTail(strBuff *sp, uint tabs)
+{
+	if ((buffEol(sp) == NULL)
+	or  (buffTabs(sp, tabs + 2) == NULL)
+	or  (buffConstant(sp, "</member>") == NULL)
+	or  (buffEol(sp) == NULL))
+		return NULL;
+
+	return sp;
+}
+
+
 /*
  * encode an array in xml
- * this could REALLY be optimized
  */
 static strBuff *
 encodeArray(strBuff *sp, PyObject *value, uint tabs)
@@ -442,32 +792,20 @@ encodeArray(strBuff *sp, PyObject *value, uint tabs)
 	PyObject	*elem;
 	int		i;
 
-	if ((buffConstant(sp, EOL) == NULL)
-	or  (buffRepeat(sp, '\t', tabs + 1) == NULL)
-	or  (buffConstant(sp, "<array>") == NULL)
-	or  (buffConstant(sp, EOL) == NULL)
-	or  (buffRepeat(sp, '\t', tabs + 2) == NULL)
-	or  (buffConstant(sp, "<data>") == NULL)
-	or  (buffConstant(sp, EOL) == NULL))
+	if (arrayHead(sp, tabs) == NULL)
 		return NULL;
 	for (i = 0; i < PyObject_Length(value); ++i) {
 		elem = PySequence_GetItem(value, i);
 		if ((elem == NULL)
-		or  (buffRepeat(sp, '\t', tabs + 3) == NULL))
+		or  (buffTabs(sp, tabs + 3) == NULL))
 			return NULL;
 		if  (encodeValue(sp, elem, tabs + 3) == NULL)
 			return NULL;
-		if ((buffConstant(sp, EOL) == NULL))
+		if ((buffEol(sp) == NULL))
 			return NULL;
 		Py_DECREF(elem);
 	}
-	if ((buffRepeat(sp, '\t', tabs + 2) == NULL)
-	or  (buffConstant(sp, "</data>") == NULL)
-	or  (buffConstant(sp, EOL) == NULL)
-	or  (buffRepeat(sp, '\t', tabs + 1) == NULL)
-	or  (buffConstant(sp, "</array>") == NULL)
-	or  (buffConstant(sp, EOL) == NULL)
-	or  (buffRepeat(sp, '\t', tabs) == NULL))
+	if (arrayTail(sp, tabs) == NULL)
 		return NULL;
 
 	return sp;
@@ -475,8 +813,7 @@ encodeArray(strBuff *sp, PyObject *value, uint tabs)
 
 
 /*
- * encode an array in xml
- * this could REALLY be optimized
+ * encode a struct in xml
  */
 static strBuff *
 encodeStruct(strBuff *sp, PyObject *value, uint tabs)
@@ -489,10 +826,7 @@ encodeStruct(strBuff *sp, PyObject *value, uint tabs)
 
 	items = PyMapping_Items(value);
 	if ((items == NULL)
-	or  (buffConstant(sp, EOL) == NULL)
-	or  (buffRepeat(sp, '\t', tabs + 1) == NULL)
-	or  (buffConstant(sp, "<struct>") == NULL)
-	or  (buffConstant(sp, EOL) == NULL))
+	or  (structHead(sp, tabs) == NULL))
 		return NULL;
 	for (i = 0; i < PyObject_Length(items); ++i) {
 		tup = PySequence_GetItem(items, i);
@@ -505,152 +839,439 @@ encodeStruct(strBuff *sp, PyObject *value, uint tabs)
 			return setPyErr("dictionary keys must be strings");
 		}
 		if ((tup == NULL || name == NULL || val == NULL)
-		or  (buffRepeat(sp, '\t', tabs + 2) == NULL)
-		or  (buffConstant(sp, "<member>") == NULL)
-		or  (buffConstant(sp, EOL) == NULL)
-		or  (buffRepeat(sp, '\t', tabs + 3) == NULL)
-		or  (buffConstant(sp, "<name>") == NULL)
-		or  (buffConcat(sp, PyString_AS_STRING(name)) == NULL)
-		or  (buffConstant(sp, "</name>") == NULL)
-		or  (buffConstant(sp, EOL) == NULL)
-		or  (buffRepeat(sp, '\t', tabs + 3) == NULL)
+		or  (memberHead(sp, name, tabs) == NULL)
 		or  (encodeValue(sp, val, tabs + 3) == NULL)
-		or  (buffConstant(sp, EOL) == NULL)
-		or  (buffRepeat(sp, '\t', tabs + 2) == NULL)
-		or  (buffConstant(sp, "</member>") == NULL)
-		or  (buffConstant(sp, EOL) == NULL))
+		or  (memberTail(sp, tabs) == NULL))
 			return NULL;
 		Py_DECREF(tup);
 		Py_DECREF(name);
 		Py_DECREF(val);
 	}
 	Py_DECREF(items);
-	if ((buffRepeat(sp, '\t', tabs + 1) == NULL)
-	or  (buffConstant(sp, "</struct>") == NULL)
-	or  (buffConstant(sp, EOL) == NULL)
-	or  (buffRepeat(sp, '\t', tabs) == NULL))
+	if (structTail(sp, tabs) == NULL)
 		return NULL;
 
 	return sp;
 }
 
 
-PyObject *
-xmlDecode(PyObject *sp)
-{
-	PyObject	*res,
-			*tup;
-	char		*cp,
-			*ep;
-	ulong		lines;
+/*
+ * The streaming encoder.  A response is encoded a piece at a time, each
+ * piece being an HTTP chunk of roughly the size asked for, so a huge
+ * result never has to be held as one string.  Arrays and structs that
+ * are being worked through are kept on a stack of their own rather than
+ * on the C stack, which lets the encoder stop anywhere and pick up again
+ * on the next call.
+ */
+typedef struct {
+	PyObject	*seq;		/* the list or tuple, or a dict's items */
+	int		next;		/* next element to encode */
+	uint		tabs;
+	bool		isStruct;
+} encFrame;
 
-	lines = 0;
-	cp = PyString_AS_STRING(sp);
-	ep = cp + PyObject_Length(sp);
-	res = decodeValue(&cp, ep, &lines);
-	if (res == NULL)
-		return NULL;
-	tup = Py_BuildValue("(O, s#)", res, cp, ep - cp);
-	Py_DECREF(res);
+typedef struct {
+	int		flags,
+			state,		/* STREAM_* */
+			depth,		/* frames in use */
+			all;		/* frames allocated */
+	PyObject	*result,
+			*addInfo;
+	encFrame	*stack;
+} encStream;
 
-	return tup;
-}
+#define	STREAM_HEAD	0		/* nothing written yet */
+#define	STREAM_BODY	1		/* in the middle of the result */
+#define	STREAM_DONE	2		/* the last chunk has been returned */
 
+#define	STREAM_NAME	"xmlrpc.stream"
+#define	CHUNK_WIDTH	8		/* hex digits for a chunk size */
 
-static PyObject *
-decodeValue(char **cp, char *ep, ulong *lines)
+
+static void
+streamFree(PyObject *capsule)
 {
-	PyObject	*res;
-	char		*tp;
+	encStream	*es;
+
+	es = PyCapsule_GetPointer(capsule, STREAM_NAME);
+	while (es->depth > 0) {
+		es->depth--;
+		Py_DECREF(es->stack[es->depth].seq);
+	}
+	if (es->stack)
+		free(es->stack);
+	Py_XDECREF(es->result);
+	Py_XDECREF(es->addInfo);
+	free(es);
+}
 
-	if (chompStr(cp, ep, lines) >= ep)
-		return eosErr();
-	tp = *cp + strlen("<value>");		/* HACK!! */
-	unless (findTag("<value>", cp, ep, lines, true))
-		return NULL;
-	if (chompStr(cp, ep, lines) >= ep)
-		return eosErr();
 
-	if (strncmp(*cp, "<int>", 5) == 0)
-		res = decodeInt(cp, ep, lines);
-	else if (strncmp(*cp, "<i4>", 4) == 0)
-		res = decodeI4(cp, ep, lines);
-	else if (strncmp(*cp, "<boolean>", 9) == 0)
-		res = decodeBool(cp, ep, lines);
-	else if (strncmp(*cp, "<double>", 8) == 0)
-		res = decodeDouble(cp, ep, lines);
-	else if (strncmp(*cp, "<string>", 8) == 0)
-		res = decodeString(cp, ep, lines);
-	else if (strncmp(*cp, "<string/>", 9) == 0)
-		res = decodeString(cp, ep, lines);
-	else if (strncmp(*cp, "<string />", 10) == 0)
-		res = decodeString(cp, ep, lines);
-	else if (strncmp(*cp, "<array>", 7) == 0)
-		res = decodeArray(cp, ep, lines);
-	else if (strncmp(*cp, "<struct>", 8) == 0)
-		res = decodeStruct(cp, ep, lines);
-	else if (strncmp(*cp, "<struct/>", 9) == 0)
-		res = decodeStruct(cp, ep, lines);
-	else if (strncmp(*cp, "<struct />", 10) == 0)
-		res = decodeStruct(cp, ep, lines);
-	else if (strncmp(*cp, "<dateTime.iso8601>", 18) == 0)
-		res = decodeDate(cp, ep, lines);
-	else if (strncmp(*cp, "<base64>", 8) == 0)
-		res = decodeBase64(cp, ep, lines);
-        else if (strncmp(*cp, "<nil/>", 6) == 0)
-                res = decodeNone(cp, ep, lines);
-	else {		/* it must be a string */
-		*cp = tp;
-		res = decodeTaglessString(cp, ep, lines);
+/*
+ * start on a value: containers are opened and pushed, anything else is
+ * encoded right away
+ */
+static strBuff *
+streamValue(encStream *es, strBuff *sp, PyObject *value, uint tabs)
+{
+	encFrame	*fp;
+	PyObject	*seq;
+	bool		isStruct;
+
+	if (PyList_Check(value) or PyTuple_Check(value)) {
+		isStruct = false;
+		seq = value;
+		Py_INCREF(seq);
+	} else if (PyDict_Check(value)) {
+		isStruct = true;
+		seq = PyMapping_Items(value);
+		if (seq == NULL)
+			return NULL;
+	} else
+		return encodeValue(sp, value, tabs);
+	if (es->depth == es->all) {
+		fp = ralloc(es->stack, 2 * (es->all + 4) * sizeof(*fp));
+		if (fp == NULL) {
+			Py_DECREF(seq);
+			return NULL;
+		}
+		es->stack = fp;
+		es->all = 2 * (es->all + 4);
 	}
-	if (res == NULL)
-		return NULL;
-
-	unless (findTag("</value>", cp, ep, lines, false)) {
-		Py_DECREF(res);
+	fp = &es->stack[es->depth++];
+	fp->seq = seq;
+	fp->next = 0;
+	fp->tabs = tabs;
+	fp->isStruct = isStruct;
+	if ((buffConstant(sp, "<value>") == NULL)
+	or  ((isStruct ? structHead(sp, tabs) : arrayHead(sp, tabs)) == NULL))
 		return NULL;
-	}
-	chompStr(cp, ep, lines);
 
-	return res;
+	return sp;
 }
 
 
-static PyObject *
-decodeInt(char **cp, char *ep, ulong *lines)
+/*
+ * encode the next element of the innermost open container, or close it
+ * if it has none left
+ */
+static strBuff *
+streamStep(encStream *es, strBuff *sp)
 {
-	long	i;
-
-	*cp += strlen("<int>");
-	unless (decodeActLong(cp, ep, &i)) {
-		char errBuff[256]; 
-		sprintf(errBuff, "Illegal integer: %.10s", *cp);
-		return setPyErr(errBuff);
+	encFrame	*fp;
+	PyObject	*elem,
+			*name;
+	uint		tabs;
+
+	fp = &es->stack[es->depth - 1];
+	tabs = fp->tabs;
+	if (fp->next > 0) {		/* finish off the previous element */
+		if (((fp->isStruct) ? memberTail(sp, tabs) : buffEol(sp)) == NULL)
+			return NULL;
 	}
-	if (*cp >= ep)
-		return eosErr();
-	unless (findTag("</int>", cp, ep, lines, true))
+	if (fp->next >= PyObject_Length(fp->seq)) {
+		if (((fp->isStruct) ? structTail(sp, tabs)
+		                    : arrayTail(sp, tabs)) == NULL)
+			return NULL;
+		Py_DECREF(fp->seq);
+		es->depth--;
+		return buffConstant(sp, "</value>");
+	}
+	elem = PySequence_GetItem(fp->seq, fp->next++);
+	if (elem == NULL)
 		return NULL;
-	return PyInt_FromLong(i);
+	if (fp->isStruct) {
+		name = PyTuple_GET_ITEM(elem, 0);
+		unless (PyString_Check(name)) {
+			Py_DECREF(elem);
+			return setPyErr("dictionary keys must be strings");
+		}
+		if ((memberHead(sp, name, tabs) == NULL)
+		or  (streamValue(es, sp, PyTuple_GET_ITEM(elem, 1),
+					tabs + 3) == NULL)) {
+			Py_DECREF(elem);
+			return NULL;
+		}
+	} else if ((buffTabs(sp, tabs + 3) == NULL)
+	       or  (streamValue(es, sp, elem, tabs + 3) == NULL)) {
+		Py_DECREF(elem);
+		return NULL;
+	}
+	Py_DECREF(elem);
+
+	return sp;
+}
+
+
+/*
+ * Start streaming a response.  The object returned is handed to
+ * streamNext() until it says the response is finished.
+ */
+PyObject *
+streamResponse(PyObject *result, PyObject *addInfo, int flags)
+{
+	encStream	*es;
+	PyObject	*res;
+
+	assert(PyDict_Check(addInfo));
+	es = alloc(sizeof(*es));
+	if (es == NULL)
+		return NULL;
+	es->flags = flags;
+	es->state = STREAM_HEAD;
+	es->depth = 0;
+	es->all = 0;
+	es->stack = NULL;
+	es->result = result;
+	es->addInfo = addInfo;
+	Py_INCREF(result);
+	Py_INCREF(addInfo);
+	res = PyCapsule_New(es, STREAM_NAME, streamFree);
+	if (res == NULL) {
+		Py_DECREF(result);
+		Py_DECREF(addInfo);
+		free(es);
+	}
+
+	return res;
+}
+
+
+/*
+ * Return the next piece of a streamed response: the header along with
+ * the first chunk, then a chunk of at least size bytes of xml (unless
+ * the response runs out first) at a time, the last piece ending with
+ * the zero length chunk.  Py_None is returned once it is all done.
+ *
+ * As with Content-length, the chunk size is written after the chunk;
+ * the space left for it is filled with leading zeros.
+ */
+PyObject *
+streamNext(PyObject *stream, long size)
+{
+	encStream	*es;
+	strBuff		*sp;
+	ulong		cpos,
+			bpos,
+			clen;
+	char		*cp;
+
+	es = PyCapsule_GetPointer(stream, STREAM_NAME);
+	if (es == NULL)
+		return NULL;
+	if (es->state == STREAM_DONE) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	sp = newBuff(es->flags);
+	if (sp == NULL)
+		return NULL;
+	if (es->state == STREAM_HEAD) {
+		unless (buildHeader(sp, TYPE_RESP, NULL, es->addInfo, NULL)) {
+			freeBuff(sp);
+			return NULL;
+		}
+		Py_CLEAR(es->addInfo);
+	}
+	cpos = sp->len;
+	if ((buffRepeat(sp, '0', CHUNK_WIDTH) == NULL)
+	or  (buffConstant(sp, EOL) == NULL)) {
+		freeBuff(sp);
+		return NULL;
+	}
+	bpos = sp->len;
+	if (es->state == STREAM_HEAD) {
+		es->state = STREAM_BODY;
+		unless ((buffConstant(sp, "<?xml version=\"1.0\"?>") != NULL)
+		and     (buffEol(sp) != NULL)
+		and     (buffConstant(sp, "<methodResponse>") != NULL)
+		and     (buffEol(sp) != NULL)
+		and     (buffTabs(sp, 1) != NULL)
+		and     (buffConstant(sp, "<params>") != NULL)
+		and     (buffEol(sp) != NULL)
+		and     (buffTabs(sp, 2) != NULL)
+		and     (buffConstant(sp, "<param>") != NULL)
+		and     (buffEol(sp) != NULL)
+		and     (buffTabs(sp, 3) != NULL)
+		and     (streamValue(es, sp, es->result, 3) != NULL)) {
+			freeBuff(sp);
+			return NULL;
+		}
+	}
+	while (es->depth > 0 and sp->len - bpos < (ulong)size) {
+		if (streamStep(es, sp) == NULL) {
+			freeBuff(sp);
+			return NULL;
+		}
+	}
+	if (es->depth == 0) {
+		es->state = STREAM_DONE;
+		unless ((buffEol(sp) != NULL)
+		and     (buffTabs(sp, 2) != NULL)
+		and     (buffConstant(sp, "</param>") != NULL)
+		and     (buffEol(sp) != NULL)
+		and     (buffTabs(sp, 1) != NULL)
+		and     (buffConstant(sp, "</params>") != NULL)
+		and     (buffEol(sp) != NULL)
+		and     (buffConstant(sp, "</methodResponse>") != NULL)
+		and     (buffEol(sp) != NULL)) {
+			freeBuff(sp);
+			return NULL;
+		}
+	}
+	clen = sp->len - bpos;
+	if (clen > 0xffffffffUL) {		/* CHUNK_WIDTH hex digits */
+		freeBuff(sp);
+		return setPyErr("chunk too long");
+	}
+	for (cp = sp->beg + cpos + CHUNK_WIDTH; clen; clen >>= 4)
+		*--cp = "0123456789abcdef"[clen & 0xf];
+	if ((buffConstant(sp, EOL) == NULL)
+	or  ((es->state == STREAM_DONE)
+	     and (buffConstant(sp, "0" EOL EOL) == NULL))) {
+		freeBuff(sp);
+		return NULL;
+	}
+
+	return buffString(sp);
+}
+
+
+PyObject *
+xmlDecode(PyObject *sp)
+{
+	PyObject	*res,
+			*tup;
+	char		*cp,
+			*ep;
+	ulong		lines;
+
+	lines = 0;
+	cp = PyString_AS_STRING(sp);
+	ep = cp + PyObject_Length(sp);
+	res = decodeValue(&cp, ep, &lines);
+	if (res == NULL)
+		return NULL;
+	tup = Py_BuildValue("(O, s#)", res, cp, ep - cp);
+	Py_DECREF(res);
+
+	return tup;
 }
 
 
 static PyObject *
-decodeI4(char **cp, char *ep, ulong *lines)
+decodeValue(char **cp, char *ep, ulong *lines)
+{
+	PyObject	*res;
+	char		*tp;
+
+	if (chompStr(cp, ep, lines) >= ep)
+		return eosErr();
+	tp = *cp + strlen("<value>");		/* HACK!! */
+	unless (findTag("<value>", cp, ep, lines, true))
+		return NULL;
+	if (chompStr(cp, ep, lines) >= ep)
+		return eosErr();
+
+	if (strncmp(*cp, "<int>", 5) == 0)
+		res = decodeInt(cp, ep, lines);
+	else if (strncmp(*cp, "<i4>", 4) == 0)
+		res = decodeI4(cp, ep, lines);
+	else if (strncmp(*cp, "<boolean>", 9) == 0)
+		res = decodeBool(cp, ep, lines);
+	else if (strncmp(*cp, "<double>", 8) == 0)
+		res = decodeDouble(cp, ep, lines);
+	else if (strncmp(*cp, "<string>", 8) == 0)
+		res = decodeString(cp, ep, lines);
+	else if (strncmp(*cp, "<string/>", 9) == 0)
+		res = decodeString(cp, ep, lines);
+	else if (strncmp(*cp, "<string />", 10) == 0)
+		res = decodeString(cp, ep, lines);
+	else if (strncmp(*cp, "<array>", 7) == 0)
+		res = decodeArray(cp, ep, lines);
+	else if (strncmp(*cp, "<struct>", 8) == 0)
+		res = decodeStruct(cp, ep, lines);
+	else if (strncmp(*cp, "<struct/>", 9) == 0)
+		res = decodeStruct(cp, ep, lines);
+	else if (strncmp(*cp, "<struct />", 10) == 0)
+		res = decodeStruct(cp, ep, lines);
+	else if (strncmp(*cp, "<dateTime.iso8601>", 18) == 0)
+		res = decodeDate(cp, ep, lines);
+	else if (strncmp(*cp, "<base64>", 8) == 0)
+		res = decodeBase64(cp, ep, lines);
+        else if (strncmp(*cp, "<nil/>", 6) == 0)
+                res = decodeNone(cp, ep, lines);
+	else {		/* it must be a string */
+		*cp = tp;
+		res = decodeTaglessString(cp, ep, lines);
+	}
+	if (res == NULL)
+		return NULL;
+
+	unless (findTag("</value>", cp, ep, lines, false)) {
+		Py_DECREF(res);
+		return NULL;
+	}
+	chompStr(cp, ep, lines);
+
+	return res;
+}
+
+
+static PyObject *
+decodeInt(char **cp, char *ep, ulong *lines)
 {
-	long	i;
+	*cp += strlen("<int>");
+	return decodeInteger(cp, ep, lines, "</int>");
+}
 
+
+static PyObject *
+decodeI4(char **cp, char *ep, ulong *lines)
+{
 	*cp += strlen("<i4>");
-	unless (decodeActLong(cp, ep, &i)) {
-		char errBuff[256];
-		sprintf(errBuff, "Illegal integer: %.10s", *cp);
+	return decodeInteger(cp, ep, lines, "</i4>");
+}
+
+
+/*
+ * the body of an <int> or <i4>; numbers too big for a C long become
+ * python longs
+ */
+static PyObject *
+decodeInteger(char **cp, char *ep, ulong *lines, char *tag)
+{
+	PyObject	*res;
+	char		errBuff[256],
+			*tp,
+			*dp;
+	long		i;
+
+	tp = *cp;
+	if (decodeActLong(cp, ep, &i))
+		res = PyInt_FromLong(i);
+	else if (*cp > tp and '0' <= (*cp)[-1] and (*cp)[-1] <= '9') {
+		dp = alloc(*cp - tp + 1);
+		if (dp == NULL)
+			return NULL;
+		memcpy(dp, tp, *cp - tp);
+		dp[*cp - tp] = EOS;
+		res = PyLong_FromString(dp, NULL, 10);
+		free(dp);
+	} else {
+		snprintf(errBuff, sizeof(errBuff), "Illegal integer: %.10s", tp);
 		return setPyErr(errBuff);
 	}
-	if (*cp >= ep)
+	if (res == NULL)
+		return NULL;
+	if (*cp >= ep) {
+		Py_DECREF(res);
 		return eosErr();
-	unless (findTag("</i4>", cp, ep, lines, true))
+	}
+	unless (findTag(tag, cp, ep, lines, true)) {
+		Py_DECREF(res);
 		return NULL;
-	return PyInt_FromLong(i);
+	}
+	return res;
 }
 
 
@@ -833,6 +1454,7 @@ decodeString(char **cp, char *ep, ulong *lines)
 {
 	PyObject	*res;
 	char		*tp;
+	bool		esc;
 
 	if (strncmp(*cp, "<string/>", 9) == 0) {
 		*cp += strlen("<string/>");
@@ -845,15 +1467,13 @@ decodeString(char **cp, char *ep, ulong *lines)
 	} else
 		*cp += strlen("<string>");
 	tp = *cp;
-	while (strncmp(*cp, "</string>", 8)) {
-		if (**cp == '\n')
-			(*lines)++;
-		if (*cp >= ep)
-			return eosErr();
-		(*cp)++;
-	}
+	unless (scanString("</string>", cp, ep, lines, &esc))
+		return eosErr();
 
-	res = unescapeString(tp, *cp);
+	if (esc)
+		res = unescapeString(tp, *cp);
+	else
+		res = PyString_FromStringAndSize(tp, *cp - tp);
 	if (res == NULL)
 		return NULL;
 	unless (findTag("</string>", cp, ep, lines, true)) {
@@ -868,23 +1488,43 @@ decodeString(char **cp, char *ep, ulong *lines)
 static PyObject *
 decodeTaglessString(char **cp, char *ep, ulong *lines)
 {
-	PyObject	*res;
 	char		*tp;
+	bool		esc;
 
 	tp = *cp;
-	while (strncmp(*cp, "</value>", 8)) {
-		if (**cp == '\n')
-			(*lines)++;
-		if (*cp >= ep)
-			return eosErr();
-		(*cp)++;
-	}
+	unless (scanString("</value>", cp, ep, lines, &esc))
+		return eosErr();
 
-	res = unescapeString(tp, *cp);
-	if (res == NULL)
-		return NULL;
+	if (esc)
+		return unescapeString(tp, *cp);
+	return PyString_FromStringAndSize(tp, *cp - tp);
+}
 
-	return res;
+
+/*
+ * Move *cp to the closing tag of a string, counting lines and noting
+ * whether there are any escape sequences to undo.
+ */
+static bool
+scanString(char *tag, char **cp, char *ep, ulong *lines, bool *esc)
+{
+	char		*tp;
+	long		len;
+
+	len = strlen(tag);
+	*esc = false;
+	for (tp = *cp; (tp = rpcScanMarkup(tp, ep)) < ep; ++tp) {
+		if (*tp == '\n')
+			(*lines)++;
+		else if (*tp == '&')
+			*esc = true;
+		else if (ep - tp >= len and strncmp(tp, tag, len) == 0) {
+			*cp = tp;
+			return true;
+		}
+	}
+	*cp = ep;
+	return false;
 }
 
 
@@ -1023,44 +1663,48 @@ decodeStruct(char **cp, char *ep, ulong *lines)
 
 /* build the methodcall xmlrpc string that is used by several functions */
 static strBuff *
-xmlMethod(char *method, PyObject *params)
+xmlMethod(strBuff *body, char *method, PyObject *params)
 {
-	strBuff 	*body;
 	int		i;
 
 	assert(PySequence_Check(params));
 	assert((method != NULL));
-	body = newBuff();
-	if ((body == NULL)
-	or  (buffConstant(body, "<?xml version=\"1.0\"?>") == NULL)
-	or  (buffConstant(body, EOL) == NULL)
+	if ((buffConstant(body, "<?xml version=\"1.0\"?>") == NULL)
+	or  (buffEol(body) == NULL)
 	or  (buffConstant(body, "<methodCall>") == NULL)
-	or  (buffConstant(body, EOL) == NULL)
-	or  (buffConstant(body, "\t<methodName>") == NULL)
+	or  (buffEol(body) == NULL)
+	or  (buffTabs(body, 1) == NULL)
+	or  (buffConstant(body, "<methodName>") == NULL)
 	or  (buffConcat(body, method) == NULL)
 	or  (buffConstant(body, "</methodName>") == NULL)
-	or  (buffConstant(body, EOL) == NULL))
+	or  (buffEol(body) == NULL))
 		return NULL;
-	if ((buffConstant(body, "\t<params>") == NULL)
-	or  (buffConstant(body, EOL) == NULL))
+	if ((buffTabs(body, 1) == NULL)
+	or  (buffConstant(body, "<params>") == NULL)
+	or  (buffEol(body) == NULL))
 		return NULL;
 	for (i = 0; i < PyObject_Length(params); ++i) {
 	    PyObject 	*elem;
 	    elem = PySequence_GetItem(params, i);
 	    if (elem == NULL)
 		return NULL;
-	    if ((buffConstant(body, "\t\t<param>") == NULL)
-		or  (buffConstant(body, EOL) == NULL)
-		or  (buffRepeat(body, '\t', 3) == NULL)
+	    if ((buffTabs(body, 2) == NULL)
+		or  (buffConstant(body, "<param>") == NULL)
+		or  (buffEol(body) == NULL)
+		or  (buffTabs(body, 3) == NULL)
 		or  (encodeValue(body, elem, 3) == NULL)
-		or  (buffConstant(body, EOL) == NULL)
-		or  (buffConstant(body, "\t\t</param>") == NULL)
-		or  (buffConstant(body, EOL) == NULL))
+		or  (buffEol(body) == NULL)
+		or  (buffTabs(body, 2) == NULL)
+		or  (buffConstant(body, "</param>") == NULL)
+		or  (buffEol(body) == NULL)) {
+		Py_DECREF(elem);
 		return NULL;
+	    }
 	    Py_DECREF(elem);
 	}
-	if ((buffConstant(body, "\t</params>") == NULL)
-	or  (buffConstant(body, EOL) == NULL))
+	if ((buffTabs(body, 1) == NULL)
+	or  (buffConstant(body, "</params>") == NULL)
+	or  (buffEol(body) == NULL))
 		return NULL;
 	if (buffConstant(body, "</methodCall>") == NULL)
 		return NULL;
@@ -1073,44 +1717,52 @@ xmlMethod(char *method, PyObject *params)
  * build the xmlrpc method call for the remote procedure call
  */
 PyObject *
-buildCall(char *method, PyObject *params)
+buildCall(char *method, PyObject *params, int flags)
 {
     strBuff 	*body;
-    PyObject	*res;
     
-    body = xmlMethod(method, params);
+    body = newBuff(flags);
     if (body == NULL)
 	return NULL;
-    res = PyString_FromStringAndSize(body->beg, body->len);
-    freeBuff(body);
+    if (xmlMethod(body, method, params) == NULL) {
+	freeBuff(body);
+	return NULL;
+    }
 
-    return res;
+    return buffString(body);
 }    
 	
 
 /*
  * build a request for a remote procedure call
+ *
+ * The header is written first, with room left for the Content-length
+ * which is filled in once the body is done, so the whole request is
+ * put together in place in the string that is returned.
  */
 PyObject *
-buildRequest(char *url, char *method, PyObject *params, PyObject *addInfo)
+buildRequest(
+	char		*url,
+	char		*method,
+	PyObject	*params,
+	PyObject	*addInfo,
+	int		flags
+)
 {
-    PyObject	*res;
-    strBuff 	*header,
-		*body;
+    strBuff 	*sp;
+    ulong	lpos;
 
-    body = xmlMethod(method, params);
-    if (body == NULL)
+    sp = newBuff(flags);
+    if (sp == NULL)
 	return NULL;
-    
-    header = buildHeader(TYPE_REQ, url, addInfo, body->len);
-    if ((header == NULL)
-	or (buffAppend(header, body->beg, body->len) == NULL))
+    unless ((buildHeader(sp, TYPE_REQ, url, addInfo, &lpos))
+	and (xmlMethod(sp, method, params) != NULL)
+	and (setLength(sp, lpos))) {
+	freeBuff(sp);
 	return NULL;
-    res = PyString_FromStringAndSize(header->beg, header->len);
-    freeBuff(header);
-    freeBuff(body);
+    }
 
-    return res;
+    return buffString(sp);
 }
 
 
@@ -1118,42 +1770,42 @@ buildRequest(char *url, char *method, PyObject *params, PyObject *addInfo)
  * build a response to a remote procedure call
  */
 PyObject *
-buildResponse(PyObject *result, PyObject *addInfo)
+buildResponse(PyObject *result, PyObject *addInfo, int flags)
 {
-	PyObject	*res;
-	strBuff		*header,
-			*body;
-
-	body = newBuff();
-	if ((body == NULL)
-	or  (buffConstant(body, "<?xml version=\"1.0\"?>") == NULL)
-	or  (buffConstant(body, EOL) == NULL)
-	or  (buffConstant(body, "<methodResponse>") == NULL)
-	or  (buffConstant(body, EOL) == NULL)
-	or  (buffConstant(body, "\t<params>") == NULL)
-	or  (buffConstant(body, EOL) == NULL)
-	or  (buffConstant(body, "\t\t<param>") == NULL)
-	or  (buffConstant(body, EOL) == NULL)
-	or  (buffRepeat(body, '\t', 3) == NULL)
-	or  (encodeValue(body, result, 3) == NULL)
-	or  (buffConstant(body, EOL) == NULL)
-	or  (buffConstant(body, "\t\t</param>") == NULL)
-	or  (buffConstant(body, EOL) == NULL)
-	or  (buffConstant(body, "\t</params>") == NULL)
-	or  (buffConstant(body, EOL) == NULL)
-	or  (buffConstant(body, "</methodResponse>") == NULL)
-	or  (buffConstant(body, EOL) == NULL))
-		return NULL;
-
-	header = buildHeader(TYPE_RESP, NULL, addInfo, body->len);
-	if ((header == NULL)
-	or  (buffAppend(header, body->beg, body->len) == NULL))
-		return NULL;
-	res = PyString_FromStringAndSize(header->beg, header->len);
-	freeBuff(header);
-	freeBuff(body);
-
-	return res;
+	strBuff		*body;
+	ulong		lpos;
+
+	body = newBuff(flags);
+	if (body == NULL)
+		return NULL;
+	unless ((buildHeader(body, TYPE_RESP, NULL, addInfo, &lpos))
+	and     (buffConstant(body, "<?xml version=\"1.0\"?>") != NULL)
+	and     (buffEol(body) != NULL)
+	and     (buffConstant(body, "<methodResponse>") != NULL)
+	and     (buffEol(body) != NULL)
+	and     (buffTabs(body, 1) != NULL)
+	and     (buffConstant(body, "<params>") != NULL)
+	and     (buffEol(body) != NULL)
+	and     (buffTabs(body, 2) != NULL)
+	and     (buffConstant(body, "<param>") != NULL)
+	and     (buffEol(body) != NULL)
+	and     (buffTabs(body, 3) != NULL)
+	and     (encodeValue(body, result, 3) != NULL)
+	and     (buffEol(body) != NULL)
+	and     (buffTabs(body, 2) != NULL)
+	and     (buffConstant(body, "</param>") != NULL)
+	and     (buffEol(body) != NULL)
+	and     (buffTabs(body, 1) != NULL)
+	and     (buffConstant(body, "</params>") != NULL)
+	and     (buffEol(body) != NULL)
+	and     (buffConstant(body, "</methodResponse>") != NULL)
+	and     (buffEol(body) != NULL)
+	and     (setLength(body, lpos))) {
+		freeBuff(body);
+		return NULL;
+	}
+
+	return buffString(body);
 }
 
 
@@ -1161,63 +1813,69 @@ buildResponse(PyObject *result, PyObject *addInfo)
  * build a fault response
  */
 PyObject *
-buildFault(int errCode, char *errStr, PyObject *addInfo)
+buildFault(int errCode, char *errStr, PyObject *addInfo, int flags)
 {
-	PyObject	*error,
-			*res;
-	strBuff		*header,
-			*body;
+	PyObject	*error;
+	strBuff		*body;
+	ulong		lpos;
 
 	error = Py_BuildValue("{s: i, s: s}",
 			"faultCode", errCode,
 			"faultString", errStr);
 	if (error == NULL)
 		return NULL;
-	body = newBuff();
-	if ((body == NULL)
-	or  (buffConstant(body, "<?xml version=\"1.0\"?>") == NULL)
-	or  (buffConstant(body, EOL) == NULL)
-	or  (buffConstant(body, "<methodResponse>") == NULL)
-	or  (buffConstant(body, EOL) == NULL)
-	or  (buffConstant(body, "\t<fault>") == NULL)
-	or  (buffConstant(body, EOL) == NULL)
-	or  (buffRepeat(body, '\t', 2) == NULL)
-	or  (encodeValue(body, error, 2) == NULL)
-	or  (buffConstant(body, EOL) == NULL)
-	or  (buffConstant(body, "\t</fault>") == NULL)
-	or  (buffConstant(body, EOL) == NULL)
-	or  (buffConstant(body, "</methodResponse>") == NULL))
+	body = newBuff(flags);
+	if (body == NULL) {
+		Py_DECREF(error);
+		return NULL;
+	}
+	unless ((buildHeader(body, TYPE_RESP, NULL, addInfo, &lpos))
+	and     (buffConstant(body, "<?xml version=\"1.0\"?>") != NULL)
+	and     (buffEol(body) != NULL)
+	and     (buffConstant(body, "<methodResponse>") != NULL)
+	and     (buffEol(body) != NULL)
+	and     (buffTabs(body, 1) != NULL)
+	and     (buffConstant(body, "<fault>") != NULL)
+	and     (buffEol(body) != NULL)
+	and     (buffTabs(body, 2) != NULL)
+	and     (encodeValue(body, error, 2) != NULL)
+	and     (buffEol(body) != NULL)
+	and     (buffTabs(body, 1) != NULL)
+	and     (buffConstant(body, "</fault>") != NULL)
+	and     (buffEol(body) != NULL)
+	and     (buffConstant(body, "</methodResponse>") != NULL)
+	and     (setLength(body, lpos))) {
+		Py_DECREF(error);
+		freeBuff(body);
 		return NULL;
+	}
 	Py_DECREF(error);
 
-	header = buildHeader(TYPE_RESP, NULL, addInfo, body->len);
-	if ((header == NULL)
-	or  (buffAppend(header, body->beg, body->len) == NULL))
-		return NULL;
-	res = PyString_FromStringAndSize(header->beg, header->len);
-	freeBuff(header);
-	freeBuff(body);
-
-	return res;
+	return buffString(body);
 }
 
 
-
-static strBuff *
-buildHeader(int reqType, char *url, PyObject *addInfo, long bodyLen)
+/*
+ * Write the header into the (empty) buffer.  The Content-length value is
+ * left as LEN_WIDTH blanks at *lpos for setLength() to fill in; without
+ * lpos the body is sent chunked instead.
+ */
+static bool
+buildHeader(
+	strBuff		*header,
+	int		reqType,
+	char		*url,
+	PyObject	*addInfo,
+	ulong		*lpos
+)
 {
 	PyObject	*items,
 			*tup,
 			*key,
 			*val;
-	strBuff		*header;
-	char		buffLen[110];
 	int		i;
 
 	assert(PyDict_Check(addInfo));
-	header = newBuff();
-	if (header == NULL)
-		return NULL;
 	switch (reqType) {
 	case TYPE_REQ:
 		if ((buffConstant(header, "POST ") == NULL)
@@ -1227,7 +1885,7 @@ buildHeader(int reqType, char *url, PyObject *addInfo, long bodyLen)
 		or  (buffConstant(header, "User-Agent: ") == NULL)
 		or  (buffConcat(header, XMLRPC_LIB_STR) == NULL)
 		or  (buffConstant(header, EOL) == NULL))
-			return NULL;
+			return false;
 		break;
 	case TYPE_RESP:
 		if ((buffConstant(header, "HTTP/1.1 200 OK") == NULL)
@@ -1235,77 +1893,105 @@ buildHeader(int reqType, char *url, PyObject *addInfo, long bodyLen)
 		or  (buffConstant(header, "Server: ") == NULL)
 		or  (buffConcat(header, XMLRPC_LIB_STR) == NULL)
 		or  (buffConstant(header, EOL) == NULL))
-			return NULL;
+			return false;
 		break;
 	}
 	items = PyDict_Items(addInfo);
 	if (items == NULL)
-		return NULL;
-	for (i = 0; i < PyObject_Length(items); ++i) {
-		tup = PySequence_GetItem(items, i);
-		assert(PyObject_Length(tup) == 2);
-		key = PySequence_GetItem(tup, 0);
-		val = PySequence_GetItem(tup, 1);
-		if (not PyString_Check(key) || not PyString_Check(val))
-			return setPyErr("header info keys and values must be strings");
+		return false;
+	for (i = 0; i < PyList_GET_SIZE(items); ++i) {
+		tup = PyList_GET_ITEM(items, i);
+		assert(PyTuple_GET_SIZE(tup) == 2);
+		key = PyTuple_GET_ITEM(tup, 0);
+		val = PyTuple_GET_ITEM(tup, 1);
+		if (not PyString_Check(key) || not PyString_Check(val)) {
+			Py_DECREF(items);
+			setPyErr("header info keys and values must be strings");
+			return false;
+		}
 		if ((buffConcat(header, PyString_AS_STRING(key)) == NULL)
 		or  (buffConstant(header, ": ") == NULL)
 		or  (buffConcat(header, PyString_AS_STRING(val)) == NULL)
-		or  (buffConstant(header, EOL) == NULL))
-			return NULL;
-		Py_DECREF(tup);
-		Py_DECREF(key);
-		Py_DECREF(val);
+		or  (buffConstant(header, EOL) == NULL)) {
+			Py_DECREF(items);
+			return false;
+		}
 	}
 	Py_DECREF(items);
-	sprintf(buffLen, "Content-length: %ld%s", bodyLen, EOL);
 	if ((buffConstant(header, "Content-Type: text/xml") == NULL)
+	or  (buffConstant(header, EOL) == NULL))
+		return false;
+	if (lpos == NULL) {
+		if ((buffConstant(header, "Transfer-Encoding: chunked") == NULL)
+		or  (buffConstant(header, EOL) == NULL)
+		or  (buffConstant(header, EOL) == NULL))
+			return false;
+		return true;
+	}
+	if ((buffConstant(header, "Content-length: ") == NULL)
+	or  (buffRepeat(header, ' ', LEN_WIDTH) == NULL)
 	or  (buffConstant(header, EOL) == NULL)
-	or  (buffConcat(header, buffLen) == NULL)
 	or  (buffConstant(header, EOL) == NULL))
-		return NULL;
+		return false;
+	*lpos = header->len - TAG_LEN(EOL EOL) - LEN_WIDTH;
 
-	return header;
+	return true;
 }
 
 
-/* parse the xmlrpc call without the header section */
+/*
+ * Fill in the Content-length left blank by buildHeader(), right aligned
+ * so the blanks in front of it are just leading white space.
+ */
+static bool
+setLength(strBuff *sp, ulong lpos)
+{
+	char		*cp;
+	ulong		blen;
+	int		n;
+
+	blen = sp->len - (lpos + LEN_WIDTH + TAG_LEN(EOL EOL));
+	cp = sp->beg + lpos + LEN_WIDTH;
+	for (n = 0; n == 0 or blen; ++n) {
+		if (n == LEN_WIDTH) {
+			setPyErr("message too long");
+			return false;
+		}
+		*--cp = '0' + (blen % 10);
+		blen /= 10;
+	}
+
+	return true;
+}
+
+
+/* parse the xmlrpc call without the header section */
 PyObject *
 parseCall(PyObject *request)
 {
-	PyObject	*method,
-			*params,
-			*tuple;
-	ulong		lines;
-	char		*cp,
-			*ep,
-			*tp;
+	char		*cp;
 
 	unless (PyString_Check(request))
 	    return NULL;
-	
-	lines = 1;
 	cp = PyString_AS_STRING(request);
-	ep = cp + PyObject_Length(request);
+
+	return parseCallStr(cp, cp + PyString_GET_SIZE(request), 1);
+}
+
+
+static PyObject *
+parseCallStr(char *cp, char *ep, ulong lines)
+{
+	PyObject	*method,
+			*params,
+			*tuple;
+
 	unless ((findXmlVersion(&cp, ep, &lines))
-	and     (findTag("<methodCall>", &cp, ep, &lines, true))
-	and     (findTag("<methodName>", &cp, ep, &lines, false)))
+	and     (findTag("<methodCall>", &cp, ep, &lines, true)))
 		return NULL;
-	tp = cp;
-	for (; cp < ep; ++cp)
-		if (*cp == '\n')
-			lines++;
-		else if (strncmp("</methodName>", cp, 13) == 0)
-			break;
-	if (cp >= ep)
-		return eosErr();
-	method = PyString_FromStringAndSize(tp, cp - tp);
+	method = findMethodName(&cp, ep, &lines);
 	if (method == NULL)
 		return NULL;
-	unless (findTag("</methodName>", &cp, ep, &lines, true)) {
-		Py_DECREF(method);
-		return NULL;
-	}
 	params = PyList_New(0);
 	if (params == NULL) {
 		Py_DECREF(method);
@@ -1339,60 +2025,69 @@ parseCall(PyObject *request)
 	return tuple;
 }
 
+/*
+ * <methodName>...</methodName>
+ */
+static PyObject *
+findMethodName(char **cpp, char *ep, ulong *lines)
+{
+	PyObject	*method;
+	char		*cp,
+			*tp;
+
+	cp = *cpp;
+	unless (findTag("<methodName>", &cp, ep, lines, false))
+		return NULL;
+	tp = cp;
+	for (; cp < ep; ++cp)
+		if (*cp == '\n')
+			(*lines)++;
+		else if (strncmp("</methodName>", cp, 13) == 0)
+			break;
+	if (cp >= ep)
+		return eosErr();
+	method = PyString_FromStringAndSize(tp, cp - tp);
+	if (method == NULL)
+		return NULL;
+	unless (findTag("</methodName>", &cp, ep, lines, true)) {
+		Py_DECREF(method);
+		return NULL;
+	}
+	*cpp = cp;
+
+	return method;
+}
+
+
 /* Parse an incoming request with the header. The heavy lifting is done
- * by parseCall()
+ * by parseCallStr()
  */
 PyObject *
 parseRequest(PyObject *request)
 {
-	PyObject	*method,
-			*addInfo,
-			*params,
-			*tuple;
+	PyObject	*addInfo,
+			*tuple,
+			*res;
 	ulong		lines;
 	char		*cp, *ep;
-			
 
 	lines = 1;
 	cp = PyString_AS_STRING(request);
-	ep = cp + PyObject_Length(request);
+	ep = cp + PyString_GET_SIZE(request);
 	addInfo = parseHeader(&cp, ep, &lines, TYPE_REQ);
 	if (addInfo == NULL)
 		return NULL;
-	/* prepare a string object to call parseCall() */
-	method = PyString_FromStringAndSize(cp, ep - cp);
-	if (method == NULL) {
-	    Py_DECREF(addInfo);
-	    return NULL;
-	}
-	tuple = parseCall(method);
-	if ( (tuple == NULL) or
-	     !PySequence_Check(tuple) or
-	     (PyObject_Length(tuple) != 2) ) {
-	    Py_DECREF(method);
-	    Py_DECREF(addInfo);
-	    return NULL;
-	}
-	/* go the tuple back, piece it together */
-	Py_DECREF(method);	/* no longer needed */
-	
-	/* decode the tuple */
-	method = PySequence_GetItem(tuple, 0);
-	params = PySequence_GetItem(tuple, 1);
-	if ((method == NULL) or (params == NULL)) {
-	    Py_DECREF(addInfo);
-	    Py_DECREF(tuple);
-	    Py_XDECREF(method);
-	    Py_XDECREF(params);
-	    return NULL;
+	tuple = parseCallStr(cp, ep, lines);
+	if (tuple == NULL) {
+		Py_DECREF(addInfo);
+		return NULL;
 	}
-	Py_DECREF(tuple);	/* this older tuple is no longer required */
-	tuple = Py_BuildValue("(O, O, O)", method, params, addInfo);
-	Py_DECREF(method);
-	Py_DECREF(params);
+	res = Py_BuildValue("(O,O,O)", PyTuple_GET_ITEM(tuple, 0),
+				PyTuple_GET_ITEM(tuple, 1), addInfo);
+	Py_DECREF(tuple);
 	Py_DECREF(addInfo);
 
-	return tuple;
+	return res;
 }
 
 
@@ -1467,21 +2162,16 @@ doKeepAliveFromDict(PyObject *addInfo)
 bool
 doKeepAlive(PyObject *header, int reqType)
 {
-	char		*cp;
-	ulong		lines;
-	PyObject	*addInfo;
-	bool		keepAlive;
+	rpcHttpHead	head;
 
-	cp = PyString_AsString(header);
-	lines = 0;
-	addInfo = parseHeader(&cp, cp+PyString_GET_SIZE(header),
-				&lines, reqType);
-	if (addInfo == NULL)
+	rpcHttpInit(&head, reqType);
+	if (rpcHttpParse(&head, PyString_AS_STRING(header),
+			PyString_GET_SIZE(header)) != HTTP_DONE) {
+		PyErr_Clear();
 		return false;
-	keepAlive = doKeepAliveFromDict(addInfo);
-	Py_DECREF(addInfo);
+	}
 
-	return keepAlive;
+	return head.keepAlive;
 }
 
 
@@ -1491,232 +2181,88 @@ doKeepAlive(PyObject *header, int reqType)
 static PyObject *
 parseHeader(char **cpp, char *ep, ulong *lines, int reqType)
 {
-	PyObject	*addInfo,
-			*pyUri,
-			*pyVersion;
-	char 		*cp,
-			*tp,
-			method[256],
-			error[512];
-	double		version;
+	rpcHttpHead	head;
+	PyObject	*addInfo;
+	char 		*cp;
 
 	cp = *cpp;
-	pyUri = NULL;
-	version = 0.0;
-
-	switch (reqType) {
-	case TYPE_REQ:
-		tp = cp;
-		for (tp = cp; *tp != ' '; ++tp) {
-			if (*tp == '\n')
-				return setPyErr("illegal Request-Line");
-			if (tp + 1 == ep)
-				return setPyErr("EOS reached early");
-		}
-		if (tp - cp > 255)
-			return setPyErr("HTTP Method too long");
-		strncpy(method, cp, tp-cp);
-		method[tp-cp] = EOS;		/* get rid of the space */
-		if (strcasecmp(method, "POST") != 0) {
-			snprintf(error, sizeof(error) - 1, "unsupported HTTP Method: '%s'",
-				method);
-			return setPyErr(error);
-		}
-		cp = tp + 1;
-		for (tp = cp; *tp != ' '; ++tp) {
-			if (*tp == '\n')
-				return setPyErr("illegal Request-Line");
-			if (tp + 1 == ep)
-				return setPyErr("EOS reached early");
-		}
-		pyUri = PyString_FromStringAndSize(cp, tp-cp);
-		if (pyUri == NULL)
-			return NULL;
-		cp = tp + 1;
-		if (strncmp(cp, "HTTP/1.0", 8) == 0)
-			version = 1.0;
-		else if (strncmp(cp, "HTTP/1.1", 8) == 0)
-			version = 1.1;
-		else {
-			Py_XDECREF(pyUri);
-			return setPyErr("illegal HTTP Version");
-		}
-		cp += 11;
-		break;
-	case TYPE_RESP:
-		if (strncmp(cp, "HTTP/1.0 ", 9) == 0)
-			version = 1.0;
-		else if (strncmp(cp, "HTTP/1.1 ", 9) == 0)
-			version = 1.1;
-		else
-			return setPyErr("illegal HTTP version");
-		cp += 9;
-		break;
-	}
-	while (cp <= ep and *cp != '\n')
-		cp++;
-	cp++;
-	(*lines)++;
-	if (cp > ep) {
-		Py_XDECREF(pyUri);
-		return eosErr();
-	}
-	addInfo = PyDict_New();
-	if (addInfo == NULL) {
-		Py_XDECREF(pyUri);
-		return NULL;
-	}
-	pyVersion = PyFloat_FromDouble(version);
-	if (pyVersion == NULL) {
-		Py_XDECREF(addInfo);
-		Py_XDECREF(pyUri);
+	rpcHttpInit(&head, reqType);
+	switch (rpcHttpParse(&head, cp, ep - cp)) {
+	case HTTP_ERR:
 		return NULL;
+	case HTTP_AGAIN:
+		return eosErr();
 	}
-	if (PyDict_SetItemString(addInfo, "HTTP Version", pyVersion)) {
-		Py_XDECREF(addInfo);
-		Py_XDECREF(pyUri);
+	addInfo = rpcHttpDict(&head, cp);
+	if (addInfo == NULL)
 		return NULL;
-	}
-	Py_DECREF(pyVersion);
-	if (pyUri != NULL) {
-		if (PyDict_SetItemString(addInfo, "URI", pyUri))
-			return NULL;
-		Py_DECREF(pyUri);
-	}
-	while (cp <= ep)
-		if (*cp == '\n') {
-			cp++;
-			(*lines)++;
-			break;
-		} else if (cp[0] == '\r' && cp[1] == '\n') {
-			cp += 2;
-			(*lines)++;
-			break;
-		} else unless (parseHeaderLine(addInfo, &cp, ep, lines))
-			return NULL;
-	if (chompStr(&cp, ep, lines) > ep)
+	*lines += head.lines;
+	cp += head.hlen;
+	if (chompStr(&cp, ep, lines) > ep) {
+		Py_DECREF(addInfo);
 		return eosErr();
+	}
 	*cpp = cp;
 
 	return addInfo;
 }
 
 
-static bool
-parseHeaderLine(PyObject *addInfo, char **cpp, char *ep, ulong *lines)
-{
-	PyObject	*name,
-			*value;
-	char		*cp,
-			*sp,
-			*tp;
-
-	value = NULL;		/* to appease the compiler */
-	cp = *cpp;
-	tp = cp;
-	while (*cp != ':' and cp <= ep)
-		cp++;
-	if (cp > ep) {
-		(void)eosErr();
-		return false;
-	}
-	name = PyString_FromStringAndSize(tp, cp - tp);
-	sp = PyString_AS_STRING(name);
-	tp = sp + PyString_GET_SIZE(name);
-	for (; sp < tp; ++sp) {				/* capitalize */
-		if (sp == PyString_AS_STRING(name)) {
-			if ('a' <= *sp && *sp <= 'z')
-				*sp -= 'a' - 'A';
-		} else
-			if ('A' <= *sp && *sp <= 'Z')
-				*sp += 'a' - 'A';
-	}
-	cp++;
-	while ((cp <= ep)
-	and    (*cp == '\t' || *cp == ' '))
-		cp++;
-	if (cp > ep) {
-		(void)eosErr();
-		return false;
-	}
-	tp = cp;
-	for (;cp <= ep; ++cp)
-		if (*cp == '\n') {
-			value = PyString_FromStringAndSize(tp, cp - tp);
-			cp += 1;
-			break;
-		} else if (cp[0] == '\r' && cp[1] == '\n') {
-			value = PyString_FromStringAndSize(tp, cp - tp);
-			cp += 2;
-			break;
-		}
-	if (cp > ep) {
-		(void)eosErr();
-		return false;
-	}
-	if (value == NULL)
-		return false;
-	if (PyDict_SetItem(addInfo, name, value))
-		return false;
-	Py_DECREF(name);
-	Py_DECREF(value);
-	*cpp = cp;
-	return true;
-}
-
-
 PyObject *
 parseResponse(PyObject *request)
 {
-	PyObject	*tuple,
-			*addInfo,
-			*result;
+	PyObject	*addInfo,
+			*tuple;
 	ulong		lines;
 	char		*cp,
 			*ep;
 
 	lines = 1;
 	cp = PyString_AS_STRING(request);
-	ep = cp + PyObject_Length(request);
+	ep = cp + PyString_GET_SIZE(request);
 	addInfo = parseHeader(&cp, ep, &lines, TYPE_RESP);
 	if (addInfo == NULL)
 		return NULL;
+	tuple = parseResponseStr(cp, ep, lines, addInfo);
+	Py_DECREF(addInfo);
+
+	return tuple;
+}
+
+
+/*
+ * parse the body of a response; the result is paired with addInfo
+ */
+static PyObject *
+parseResponseStr(char *cp, char *ep, ulong lines, PyObject *addInfo)
+{
+	PyObject	*tuple,
+			*result;
+
 	unless ((findXmlVersion(&cp, ep, &lines))
-	and     (findTag("<methodResponse>", &cp, ep, &lines, true))) {
-		Py_DECREF(addInfo);
+	and     (findTag("<methodResponse>", &cp, ep, &lines, true)))
 		return NULL;
-	}
-	if (strncmp("<fault>", cp, 7) == 0) {
-		Py_DECREF(addInfo);
+	if (strncmp("<fault>", cp, 7) == 0)
 		return parseFault(cp, ep, lines);
-	}
 	unless ((findTag("<params>", &cp, ep, &lines, true))
-	and     (findTag("<param>", &cp, ep, &lines, true))) {
-		Py_DECREF(addInfo);
+	and     (findTag("<param>", &cp, ep, &lines, true)))
 		return NULL;
-	}
 	result = decodeValue(&cp, ep, &lines);
-	if (result == NULL) {
-		Py_DECREF(addInfo);
+	if (result == NULL)
 		return NULL;
-	}
 	unless ((findTag("</param>", &cp, ep, &lines, true))
 	and     (findTag("</params>", &cp, ep, &lines, true))
 	and     (findTag("</methodResponse>", &cp, ep, &lines, false))) {
-		Py_DECREF(addInfo);
 		Py_DECREF(result);
 		return NULL;
 	}
 	chompStr(&cp, ep, &lines);
 	if (cp != ep) {
-		Py_DECREF(addInfo);
 		Py_DECREF(result);
 		return setPyErr("unused data when parsing response");
 	}
-
 	tuple = Py_BuildValue("(O, O)", result, addInfo);
 	Py_DECREF(result);
-	Py_DECREF(addInfo);
 
 	return tuple;
 }
@@ -1725,41 +2271,613 @@ parseResponse(PyObject *request)
 static PyObject *
 parseFault(char *cp, char *ep, ulong lines)
 {
-	PyObject	*errDict,
-			*errStr,
-			*errCode;
+	PyObject	*errDict;
 
 	unless (findTag("<fault>", &cp, ep, &lines, true))
 		return NULL;
 	errDict = decodeValue(&cp, ep, &lines);
 	if (errDict == NULL)
 		return NULL;
+	unless (raiseFault(errDict)) {
+		Py_DECREF(errDict);
+		return NULL;
+	}
+	Py_DECREF(errDict);
+	unless ((findTag("</fault>", &cp, ep, &lines, true))
+	and     (findTag("</methodResponse>", &cp, ep, &lines, false))) {
+		return NULL;
+	}
+	chompStr(&cp, ep, &lines);
+	if (cp != ep) {
+		return setPyErr("unused data when parsing response");
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Raise the fault described by the value of a fault response.  Returns
+ * false if the value is not a proper fault.
+ */
+static bool
+raiseFault(PyObject *errDict)
+{
+	PyObject	*errStr,
+			*errCode;
+
 	unless ((PyDict_Check(errDict))
 	and     (PyMapping_HasKeyString(errDict, "faultCode"))
 	and     (PyMapping_HasKeyString(errDict, "faultString"))) {
-		Py_DECREF(errDict);
-		return setPyErr("illegal fault value");
+		setPyErr("illegal fault value");
+		return false;
 	}
 	errCode = PyDict_GetItemString(errDict, "faultCode");
 	errStr = PyDict_GetItemString(errDict, "faultString");
 	if (errCode == NULL || errStr == NULL)
-		return NULL;
+		return false;
 	unless (PyInt_Check(errCode) && PyString_Check(errStr)) {
-		Py_DECREF(errDict);
-		return setPyErr("illegal fault value");
+		setPyErr("illegal fault value");
+		return false;
 	}
 	rpcFaultRaise(errCode, errStr);
-	Py_DECREF(errDict);
-	unless ((findTag("</fault>", &cp, ep, &lines, true))
-	and     (findTag("</methodResponse>", &cp, ep, &lines, false))) {
+
+	return true;
+}
+
+
+/*
+ * The incremental decoder.  It is fed the body of a request or response
+ * as it comes in and decodes whatever is complete, so the text can be
+ * dropped as soon as it has been decoded.  Arrays and structs that are
+ * still open are kept on a stack of their own; a leaf value (a string,
+ * an int, ...) is decoded by decodeValue() once its </value> is in.
+ *
+ * A step works on a copy of the position and only moves it on when it
+ * is done, so a step that runs out of data just starts over once more
+ * has arrived.  Its one long search remembers how far it got.
+ */
+typedef struct {
+	PyObject	*obj,		/* the list or dict being filled */
+			*key;		/* name of the member being decoded */
+	bool		isStruct,
+			inMember;	/* member decoded, </member> to come */
+} decFrame;
+
+typedef struct {
+	int		type,		/* TYPE_REQ or TYPE_RESP */
+			state,		/* DS_* */
+			depth,		/* frames in use */
+			all;		/* frames allocated */
+	bool		fault;		/* is the response a fault? */
+	long		scan;		/* bytes already searched in vain */
+	ulong		lines;
+	decFrame	*stack;
+	PyObject	*method,	/* name of a call */
+			*params;	/* the top level values */
+} rpcDecoder;
+
+#define	DS_PROLOG	0		/* up to the first <value> */
+#define	DS_VALUE	1		/* at a <value> */
+#define	DS_INNER	2		/* in an array or struct */
+#define	DS_NEXT		3		/* after a top level value */
+#define	DS_DONE		4
+
+#define	DECODER_NAME	"xmlrpc.decoder"
+
+/* is the tag at cp all there? */
+#define	TAG_IN(cp, ep)	(memchr(cp, '>', (ep) - (cp)) != NULL)
+
+static	char		*decFind(
+				rpcDecoder	*dp,
+				char		*cp,
+				char		*ep,
+				char		*str,
+				long		len
+			);
+static	int		decChomp(
+				rpcDecoder	*dp,
+				char		**cpp,
+				char		*ep,
+				bool		final
+			);
+static	int		decPush(rpcDecoder *dp, bool isStruct);
+static	int		decAdd(rpcDecoder *dp, PyObject *value);
+static	int		decProlog(rpcDecoder *dp, char **cpp, char *ep, bool final);
+static	int		decValue(rpcDecoder *dp, char **cpp, char *ep, bool final);
+static	int		decInner(rpcDecoder *dp, char **cpp, char *ep, bool final);
+static	int		decNext(rpcDecoder *dp, char **cpp, char *ep, bool final);
+
+
+static void
+decoderFree(PyObject *capsule)
+{
+	rpcDecoder	*dp;
+
+	dp = PyCapsule_GetPointer(capsule, DECODER_NAME);
+	while (dp->depth > 0) {
+		dp->depth--;
+		Py_DECREF(dp->stack[dp->depth].obj);
+		Py_XDECREF(dp->stack[dp->depth].key);
+	}
+	if (dp->stack)
+		free(dp->stack);
+	Py_XDECREF(dp->method);
+	Py_XDECREF(dp->params);
+	free(dp);
+}
+
+
+/*
+ * a new decoder for a request (TYPE_REQ) or response (TYPE_RESP) body
+ */
+PyObject *
+decoderNew(int type)
+{
+	rpcDecoder	*dp;
+	PyObject	*res;
+
+	dp = alloc(sizeof(*dp));
+	if (dp == NULL)
+		return NULL;
+	dp->type = type;
+	dp->state = DS_PROLOG;
+	dp->depth = 0;
+	dp->all = 0;
+	dp->fault = false;
+	dp->scan = 0;
+	dp->lines = 1;
+	dp->stack = NULL;
+	dp->method = NULL;
+	dp->params = PyList_New(0);
+	if (dp->params == NULL) {
+		free(dp);
 		return NULL;
 	}
-	chompStr(&cp, ep, &lines);
+	res = PyCapsule_New(dp, DECODER_NAME, decoderFree);
+	if (res == NULL) {
+		Py_DECREF(dp->params);
+		free(dp);
+	}
+
+	return res;
+}
+
+
+/*
+ * Decode as much of [bp, ep) as is complete.  final says that ep is the
+ * end of the body.  *used is set to the number of bytes that are done
+ * with; the rest must be passed in again, with more behind it, next
+ * time.  Returns DEC_DONE once the whole body has been decoded,
+ * DEC_AGAIN if more is needed or DEC_ERR with a python error set.
+ */
+int
+decoderFeed(PyObject *decoder, char *bp, char *ep, bool final, long *used)
+{
+	rpcDecoder	*dp;
+	char		*cp,
+			*tp;
+	ulong		lines;
+	int		r;
+
+	dp = PyCapsule_GetPointer(decoder, DECODER_NAME);
+	if (dp == NULL)
+		return DEC_ERR;
+	cp = bp;
+	r = DEC_DONE;
+	while (dp->state != DS_DONE) {
+		lines = dp->lines;
+		tp = cp;
+		switch (dp->state) {
+		case DS_PROLOG:
+			r = decProlog(dp, &tp, ep, final);
+			break;
+		case DS_VALUE:
+			r = decValue(dp, &tp, ep, final);
+			break;
+		case DS_INNER:
+			r = decInner(dp, &tp, ep, final);
+			break;
+		case DS_NEXT:
+			r = decNext(dp, &tp, ep, final);
+			break;
+		}
+		if (r != DEC_DONE) {
+			dp->lines = lines;
+			break;
+		}
+		cp = tp;
+		dp->scan = 0;
+	}
+	*used = cp - bp;
+	if (r == DEC_ERR)
+		return DEC_ERR;
+	if (dp->state == DS_DONE)
+		return DEC_DONE;
+	assert(not final);
+
+	return DEC_AGAIN;
+}
+
+
+/*
+ * the method and params of a decoded call, borrowed from the decoder
+ */
+bool
+decoderCall(PyObject *decoder, PyObject **methodp, PyObject **paramsp)
+{
+	rpcDecoder	*dp;
+
+	dp = PyCapsule_GetPointer(decoder, DECODER_NAME);
+	if (dp == NULL)
+		return false;
+	assert(dp->state == DS_DONE and dp->type == TYPE_REQ);
+	*methodp = dp->method;
+	*paramsp = dp->params;
+
+	return true;
+}
+
+
+/*
+ * search for str from cp, skipping what an earlier call found wanting
+ */
+static char *
+decFind(rpcDecoder *dp, char *cp, char *ep, char *str, long len)
+{
+	char		*tp;
+
+	tp = rpcScanStr(cp + dp->scan, ep, str, len);
+	if (tp == NULL)
+		dp->scan = max(0, (ep - cp) - (len - 1));
+
+	return tp;
+}
+
+
+/*
+ * chompStr() that waits for the end of a comment
+ */
+static int
+decChomp(rpcDecoder *dp, char **cpp, char *ep, bool final)
+{
+	char		*cp,
+			*tp;
+
+	cp = *cpp;
+	while ((cp = rpcScanSpace(cp, ep, &dp->lines)) < ep) {
+		if (ep - cp < TAG_LEN(COM_BEG)) {
+			if (not final and strncmp(cp, COM_BEG, ep - cp) == 0)
+				return DEC_AGAIN;
+			break;
+		}
+		if (strncmp(cp, COM_BEG, TAG_LEN(COM_BEG)))
+			break;
+		tp = rpcScanStr(cp, ep, COM_END, TAG_LEN(COM_END));
+		if (tp == NULL) {
+			unless (final)
+				return DEC_AGAIN;
+			(void)eosErr();
+			return DEC_ERR;
+		}
+		for (; cp < tp; ++cp)
+			if (*cp == '\n')
+				dp->lines++;
+		cp += TAG_LEN(COM_END);
+	}
+	*cpp = cp;
+
+	return DEC_DONE;
+}
+
+
+/*
+ * start an array or struct
+ */
+static int
+decPush(rpcDecoder *dp, bool isStruct)
+{
+	decFrame	*fp;
+
+	if (dp->depth == dp->all) {
+		fp = ralloc(dp->stack, 2 * (dp->all + 4) * sizeof(*fp));
+		if (fp == NULL)
+			return DEC_ERR;
+		dp->stack = fp;
+		dp->all = 2 * (dp->all + 4);
+	}
+	fp = &dp->stack[dp->depth];
+	fp->obj = isStruct ? PyDict_New() : PyList_New(0);
+	if (fp->obj == NULL)
+		return DEC_ERR;
+	fp->key = NULL;
+	fp->isStruct = isStruct;
+	fp->inMember = false;
+	dp->depth++;
+	dp->state = DS_INNER;
+
+	return DEC_DONE;
+}
+
+
+/*
+ * a value is complete; put it where it belongs (this steals it)
+ */
+static int
+decAdd(rpcDecoder *dp, PyObject *value)
+{
+	decFrame	*fp;
+	int		r;
+
+	if (dp->depth == 0) {
+		r = PyList_Append(dp->params, value);
+		dp->state = DS_NEXT;
+	} else {
+		fp = &dp->stack[dp->depth - 1];
+		if (fp->isStruct) {
+			r = PyDict_SetItem(fp->obj, fp->key, value);
+			Py_CLEAR(fp->key);
+			fp->inMember = true;
+		} else
+			r = PyList_Append(fp->obj, value);
+		dp->state = DS_INNER;
+	}
+	Py_DECREF(value);
+
+	return r ? DEC_ERR : DEC_DONE;
+}
+
+
+/*
+ * Everything in front of the first value.  A body without any value (a
+ * call without params, or something broken) is left for the ordinary
+ * parser once it is all in.
+ */
+static int
+decProlog(rpcDecoder *dp, char **cpp, char *ep, bool final)
+{
+	PyObject	*tuple;
+	char		*cp,
+			*vp;
+	int		r;
+
+	cp = *cpp;
+	vp = decFind(dp, cp, ep, "<value>", 7);
+	if (vp == NULL) {
+		unless (final)
+			return DEC_AGAIN;
+		if (dp->type == TYPE_REQ)
+			tuple = parseCallStr(cp, ep, dp->lines);
+		else
+			tuple = parseResponseStr(cp, ep, dp->lines, Py_None);
+		if (tuple == NULL)
+			return DEC_ERR;
+		if (dp->type == TYPE_REQ) {
+			dp->method = PyTuple_GET_ITEM(tuple, 0);
+			Py_INCREF(dp->method);
+			Py_DECREF(dp->params);
+			dp->params = PyTuple_GET_ITEM(tuple, 1);
+			Py_INCREF(dp->params);
+			r = 0;
+		} else
+			r = PyList_Append(dp->params, PyTuple_GET_ITEM(tuple, 0));
+		Py_DECREF(tuple);
+		if (r)
+			return DEC_ERR;
+		*cpp = ep;
+		dp->state = DS_DONE;
+		return DEC_DONE;
+	}
+	unless (findXmlVersion(&cp, vp, &dp->lines))
+		return DEC_ERR;
+	if (dp->type == TYPE_REQ) {
+		unless (findTag("<methodCall>", &cp, vp, &dp->lines, true))
+			return DEC_ERR;
+		dp->method = findMethodName(&cp, vp, &dp->lines);
+		if (dp->method == NULL)
+			return DEC_ERR;
+	} else {
+		unless (findTag("<methodResponse>", &cp, vp, &dp->lines, true))
+			return DEC_ERR;
+		dp->fault = (strncmp("<fault>", cp, 7) == 0);
+	}
+	if (dp->fault) {
+		unless (findTag("<fault>", &cp, vp, &dp->lines, true))
+			return DEC_ERR;
+	} else unless ((findTag("<params>", &cp, vp, &dp->lines, true))
+		and    (findTag("<param>", &cp, vp, &dp->lines, true)))
+		return DEC_ERR;
+	if (cp != vp) {
+		(void)syntaxErr(dp->lines);
+		return DEC_ERR;
+	}
+	*cpp = cp;
+	dp->state = DS_VALUE;
+
+	return DEC_DONE;
+}
+
+
+/*
+ * At a <value>.  Arrays and structs are opened, anything else is
+ * decoded whole once its </value> has arrived.
+ */
+static int
+decValue(rpcDecoder *dp, char **cpp, char *ep, bool final)
+{
+	PyObject	*value;
+	char		*cp,
+			*tp,
+			*te;
+	ulong		lines;
+	int		r;
+
+	cp = *cpp;
+	lines = dp->lines;
+	tp = cp + TAG_LEN("<value>");
+	if ((r = decChomp(dp, &tp, ep, final)) != DEC_DONE)
+		return r;
+	unless (final or TAG_IN(tp, ep))
+		return DEC_AGAIN;
+	if (strncmp(tp, "<struct>", 8) == 0) {
+		*cpp = tp + 8;
+		return decPush(dp, true);
+	} else if (strncmp(tp, "<array>", 7) == 0) {
+		tp += 7;
+		if ((r = decChomp(dp, &tp, ep, final)) != DEC_DONE)
+			return r;
+		unless (final or TAG_IN(tp, ep))
+			return DEC_AGAIN;
+		if (strncmp(tp, "<data>", 6) == 0) {
+			*cpp = tp + 6;
+			return decPush(dp, false);
+		}
+	}
+	te = decFind(dp, cp, ep, "</value>", 8);
+	if (te == NULL) {
+		unless (final)
+			return DEC_AGAIN;
+		(void)eosErr();
+		return DEC_ERR;
+	}
+	dp->lines = lines;
+	value = decodeValue(&cp, te + 8, &dp->lines);
+	if (value == NULL)
+		return DEC_ERR;
+	*cpp = cp;
+
+	return decAdd(dp, value);
+}
+
+
+/*
+ * In an array or struct: the next element, the end of a member or the
+ * end of the container.
+ */
+static int
+decInner(rpcDecoder *dp, char **cpp, char *ep, bool final)
+{
+	decFrame	*fp;
+	PyObject	*value;
+	char		*cp,
+			*tp;
+	int		r;
+
+	fp = &dp->stack[dp->depth - 1];
+	cp = *cpp;
+	if ((r = decChomp(dp, &cp, ep, final)) != DEC_DONE)
+		return r;
+	unless (final or TAG_IN(cp, ep))
+		return DEC_AGAIN;
+	if (fp->inMember) {
+		unless (findTag("</member>", &cp, ep, &dp->lines, false))
+			return DEC_ERR;
+		fp->inMember = false;
+		*cpp = cp;
+		return DEC_DONE;
+	}
+	if (fp->isStruct and fp->key == NULL
+	and strncmp(cp, "<member>", 8) == 0) {
+		tp = decFind(dp, cp, ep, "</name>", 7);
+		if (tp == NULL) {
+			unless (final)
+				return DEC_AGAIN;
+			(void)eosErr();
+			return DEC_ERR;
+		}
+		unless ((findTag("<member>", &cp, tp, &dp->lines, true))
+		and     (findTag("<name>", &cp, tp, &dp->lines, false)))
+			return DEC_ERR;
+		fp->key = PyString_FromStringAndSize(cp, tp - cp);
+		if (fp->key == NULL)
+			return DEC_ERR;
+		for (; cp < tp; ++cp)
+			if (*cp == '\n')
+				dp->lines++;
+		*cpp = tp + TAG_LEN("</name>");
+		return DEC_DONE;
+	}
+	if (fp->isStruct ? fp->key != NULL : strncmp(cp, "<value>", 7) == 0) {
+		unless (strncmp(cp, "<value>", 7) == 0) {
+			(void)findTag("<value>", &cp, ep, &dp->lines, false);
+			return DEC_ERR;
+		}
+		*cpp = cp;
+		dp->state = DS_VALUE;
+		return DEC_DONE;
+	}
+	tp = decFind(dp, cp, ep, "</value>", 8);
+	if (tp == NULL) {
+		unless (final)
+			return DEC_AGAIN;
+		(void)eosErr();
+		return DEC_ERR;
+	}
+	tp += TAG_LEN("</value>");
+	if (fp->isStruct) {
+		unless (findTag("</struct>", &cp, tp, &dp->lines, true))
+			return DEC_ERR;
+	} else unless ((findTag("</data>", &cp, tp, &dp->lines, true))
+		and    (findTag("</array>", &cp, tp, &dp->lines, true)))
+		return DEC_ERR;
+	unless (findTag("</value>", &cp, tp, &dp->lines, false))
+		return DEC_ERR;
+	value = fp->obj;
+	dp->depth--;
+	*cpp = cp;
+
+	return decAdd(dp, value);
+}
+
+
+/*
+ * After a top level value: the next param of a call, or the end
+ */
+static int
+decNext(rpcDecoder *dp, char **cpp, char *ep, bool final)
+{
+	char		*cp,
+			*vp;
+
+	cp = *cpp;
+	if (dp->type == TYPE_REQ
+	and (vp = decFind(dp, cp, ep, "<value>", 7)) != NULL) {
+		chompStr(&cp, vp, &dp->lines);
+		unless ((findTag("</param>", &cp, vp, &dp->lines, true))
+		and     (findTag("<param>", &cp, vp, &dp->lines, true)))
+			return DEC_ERR;
+		if (cp != vp) {
+			(void)syntaxErr(dp->lines);
+			return DEC_ERR;
+		}
+		*cpp = cp;
+		dp->state = DS_VALUE;
+		return DEC_DONE;
+	}
+	unless (final)
+		return DEC_AGAIN;
+	chompStr(&cp, ep, &dp->lines);
+	if (dp->fault) {
+		unless (findTag("</fault>", &cp, ep, &dp->lines, true))
+			return DEC_ERR;
+	} else unless ((findTag("</param>", &cp, ep, &dp->lines, true))
+		and    (findTag("</params>", &cp, ep, &dp->lines, true)))
+		return DEC_ERR;
+	unless (findTag((dp->type == TYPE_REQ) ? "</methodCall>"
+	                                       : "</methodResponse>",
+	                &cp, ep, &dp->lines, false))
+		return DEC_ERR;
+	chompStr(&cp, ep, &dp->lines);
 	if (cp != ep) {
-		return setPyErr("unused data when parsing response");
+		setPyErr((dp->type == TYPE_REQ)
+			? "unused data when parsing request"
+			: "unused data when parsing response");
+		return DEC_ERR;
 	}
+	*cpp = cp;
+	dp->state = DS_DONE;
 
-	return NULL;
+	return DEC_DONE;
 }
 
 
@@ -1784,27 +2902,22 @@ syntaxErr(ulong line)
 static char *
 chompStr(char **cp, char *ep, ulong *lines)
 {
-	for (; *cp < ep; ++(*cp)) {
-		if (**cp == '\t' or **cp == ' ' or **cp == '\r')
-			continue;
-		else if (**cp == '\n')
-			(*lines)++;
-		else if ((ep - *cp >= TAG_LEN(COM_BEG))
-		and      (strncmp(*cp, COM_BEG, TAG_LEN(COM_BEG)) == 0)) {
-			*cp += TAG_LEN(COM_BEG);
-			while (true) {
-				if (ep - *cp < TAG_LEN(COM_END)) {
-					*cp = ep;
-					return ep;		/* no matches */
-				}
-				if (strncmp(*cp, COM_END, TAG_LEN(COM_END)) == 0) {
-					*cp += TAG_LEN(COM_END);
-					break;
-				}
-				(*cp)++;
-			}
-		} else
+	char		*tp;
+
+	while ((*cp = rpcScanSpace(*cp, ep, lines)) < ep) {
+		unless ((ep - *cp >= TAG_LEN(COM_BEG))
+		and     (strncmp(*cp, COM_BEG, TAG_LEN(COM_BEG)) == 0))
 			return *cp;
+		*cp += TAG_LEN(COM_BEG);
+		tp = rpcScanStr(*cp, ep, COM_END, TAG_LEN(COM_END));
+		if (tp == NULL) {
+			*cp = ep;
+			return ep;			/* no matches */
+		}
+		for (; *cp < tp; ++(*cp))		/* comments may span lines */
+			if (**cp == '\n')
+				(*lines)++;
+		*cp += TAG_LEN(COM_END);
 	}
 	return *cp;
 }
@@ -1869,147 +2982,143 @@ findTag(char *tag, char **cpp, char *ep, ulong *lines, bool chomp)
 }
 
 
+/*
+ * Undo the escape sequences in [bp, ep).  The result can only be shorter
+ * than the source, so it is written straight into a python string which
+ * is trimmed at the end.  Runs of text between escapes are memcpy()'d.
+ * Under python 3 that string is bytes, and the str is made from it.
+ */
 static PyObject *
 unescapeString(char *bp, char *ep)
 {
-	PyObject	*res;
-	char		*newStr,
-			*tp;
-	int		remLen;
-	long		tmp;
+	PyObject	*buf,
+			*res;
+	char		*np,
+			*tp,
+			*cp;
 
 	if (ep == bp)
 		return PyString_FromString("");
 	assert(ep > bp);
-	newStr = alloc(sizeof(*bp) * (ep - bp + 1));
-	tp = newStr;
+	buf = PyBytes_FromStringAndSize(NULL, ep - bp);
+	if (buf == NULL)
+		return NULL;
+	np = PyBytes_AS_STRING(buf);
+	tp = np;
 	while (bp < ep) {
-		if (*bp == '&') {
-			remLen = ep - bp;
-			if ((remLen >= 4)
-			and (strncmp(bp, "&lt;", 4) == 0)) {
-				*(tp++) = '<';
-				bp += 4;
-				continue;
-			}
-			if ((remLen >= 4)
-			and (strncmp(bp, "&gt;", 4) == 0)) {
-				*(tp++) = '>';
-				bp += 4;
-				continue;
-			}
-			if ((remLen >= 3)
-			and (strncmp(bp, "&&;", 3) == 0)) {
-				*(tp++) = '&';
-				bp += 3;
-				continue;
-			}
-			if ((remLen >= 5)
-			and (strncmp(bp, "&amp;", 5) == 0)) {
-				*(tp++) = '&';
-				bp += 5;
-				continue;
-			}
-			if ((remLen >= 6)
-			and (strncmp(bp, "&apos;", 6) == 0)) {
-				*(tp++) = '\'';
-				bp += 6;
-				continue;
-			}
-			if ((remLen >= 6)
-			and (strncmp(bp, "&quot;", 6) == 0)) {
-				*(tp++) = '"';
-				bp += 6;
-				continue;
-			}
-			if ((remLen > 4)
-			and (strncasecmp(bp, "&#x", 3) == 0)) {
-				bp += 3;
-				if (!decodeActLongHex(&bp, ep, &tmp))
-					return setPyErr("Illegal quoted sequence");
-				if (*bp++ != ';')
-					return setPyErr("Illegal quoted sequence");
-				*(tp++) = tmp;
-				continue;
-			}
-			if ((remLen > 3)
-			and (strncmp(bp, "&#", 2) == 0)) {
-				bp += 2;
-				if (!decodeActLong(&bp, ep, &tmp))
-					return setPyErr("Illegal quoted sequence");
-				if (*bp++ != ';')
-					return setPyErr("Illegal quoted sequence");
-				*(tp++) = tmp;
-				continue;
- 			}
+		cp = memchr(bp, '&', ep - bp);
+		if (cp == NULL)
+			cp = ep;
+		memcpy(tp, bp, cp - bp);
+		tp += cp - bp;
+		bp = cp;
+		if ((bp < ep)
+		and (not unescapeEntity(&bp, ep, tp++))) {
+			Py_DECREF(buf);
 			return setPyErr("Illegal quoted sequence");
-		} else
-			*(tp++) = *(bp++);
+		}
 	}
 	*tp = EOS;
-	res = PyString_FromStringAndSize(newStr, tp-newStr);
-	free(newStr);
+#if PY_MAJOR_VERSION > 2
+	res = PyUnicode_FromStringAndSize(np, tp - np);
+	Py_DECREF(buf);
+#else
+	if (tp - np < PyString_GET_SIZE(buf))
+		_PyString_Resize(&buf, tp - np);
+	res = buf;
+#endif /* PY_MAJOR_VERSION > 2 */
 
 	return res;
 }
 
 
-static PyObject *
-escapeString(PyObject *oldStr)
+/*
+ * decode the escape sequence at *bpp into *cp
+ */
+static bool
+unescapeEntity(char **bpp, char *ep, char *cp)
 {
-	PyObject	*newStr;
-	int		newLen, oldLen;
-	char		*np,
-			*op,
-			*ep;
+	char		*bp;
+	int		remLen;
+	long		tmp;
 
-	assert(PyString_Check(oldStr));
-	newLen = 0;
-	oldLen = PyString_GET_SIZE(oldStr);
-	ep = PyString_AS_STRING(oldStr) + oldLen;
-	op = PyString_AS_STRING(oldStr);
-	for (; op < ep; ++op) {
-		switch (*op) {
-		case '<' :
-			newLen += 4;
-			break;
-		case '&' :
-			newLen += 5;
-			break;
-		default	 :
-			newLen++;
-			break;
-		}
-	}
-	/* check if we really need to work on this string */
-	if (newLen <= oldLen) {
-	    Py_INCREF(oldStr);	/* the calling function expects this to be a new object
-				 * and calls Py_DECREF on it */
-	    return oldStr;	/* avoid extra work because it is not necessary */
-	}
-	
-	newStr = PyString_FromStringAndSize(NULL, newLen);
-	if (newStr == NULL)
-		return NULL;
-	op = PyString_AS_STRING(oldStr);
-	np = PyString_AS_STRING(newStr);
-	for (; op < ep; ++op) {
-		switch (*op) {
-		case '<' :
-			strncpy(np, "&lt;", 4);
-			np += 4;
-			break;
-		case '&' :
-			strncpy(np, "&amp;", 5);
-			np += 5;
-			break;
-		default	 :
-			*(np++) = *op;
+	bp = *bpp;
+	remLen = ep - bp;
+	if ((remLen >= 4)
+	and (strncmp(bp, "&lt;", 4) == 0)) {
+		*cp = '<';
+		*bpp += 4;
+	} else if ((remLen >= 4)
+	and (strncmp(bp, "&gt;", 4) == 0)) {
+		*cp = '>';
+		*bpp += 4;
+	} else if ((remLen >= 3)
+	and (strncmp(bp, "&&;", 3) == 0)) {
+		*cp = '&';
+		*bpp += 3;
+	} else if ((remLen >= 5)
+	and (strncmp(bp, "&amp;", 5) == 0)) {
+		*cp = '&';
+		*bpp += 5;
+	} else if ((remLen >= 6)
+	and (strncmp(bp, "&apos;", 6) == 0)) {
+		*cp = '\'';
+		*bpp += 6;
+	} else if ((remLen >= 6)
+	and (strncmp(bp, "&quot;", 6) == 0)) {
+		*cp = '"';
+		*bpp += 6;
+	} else if ((remLen > 4)
+	and (strncasecmp(bp, "&#x", 3) == 0)) {
+		bp += 3;
+		unless ((decodeActLongHex(&bp, ep, &tmp))
+		and     (bp < ep)
+		and     (*bp++ == ';'))
+			return false;
+		*cp = tmp;
+		*bpp = bp;
+	} else if ((remLen > 3)
+	and (strncmp(bp, "&#", 2) == 0)) {
+		bp += 2;
+		unless ((decodeActLong(&bp, ep, &tmp))
+		and     (bp < ep)
+		and     (*bp++ == ';'))
+			return false;
+		*cp = tmp;
+		*bpp = bp;
+	} else
+		return false;
+
+	return true;
+}
+
+
+/*
+ * Append [cp, ep) to the buffer, escaping '<' and '&'.  Most strings
+ * have nothing to escape and take a single copy.
+ */
+static strBuff *
+buffEscape(strBuff *sp, char *cp, char *ep)
+{
+	char		*tp;
+
+	sp = growBuff(sp, ep - cp);
+	if (sp == NULL)
+		return NULL;
+	while (cp < ep) {
+		tp = rpcScanEscape(cp, ep);
+		if (buffAppend(sp, cp, tp - cp) == NULL)
+			return NULL;
+		if (tp == ep)
 			break;
-		}
+		if (*tp == '<')
+			sp = buffConstant(sp, "&lt;");
+		else
+			sp = buffConstant(sp, "&amp;");
+		if (sp == NULL)
+			return NULL;
+		cp = tp + 1;
 	}
-	assert(np == (PyString_AS_STRING(newStr) + newLen));
-	*np = EOS;	/* probably unnecessary (python already does it) */
 
-	return newStr;
+	return sp;
 }
@@ -17,22 +17,45 @@
 #define TYPE_REQ	0
 #define TYPE_RESP	1
 
+#define	ENC_COMPACT	0x01		/* no indentation or line ends */
 
-PyObject	*xmlEncode(PyObject *value);
+#define	DEC_ERR		0		/* decoderFeed() results */
+#define	DEC_AGAIN	1
+#define	DEC_DONE	2
+
+
+PyObject	*xmlEncode(PyObject *value, int flags);
 PyObject	*xmlDecode(PyObject *string);
-PyObject	*buildCall(char *method, PyObject *params);
+PyObject	*buildCall(char *method, PyObject *params, int flags);
 PyObject	*buildRequest(
 			char *url,
 			char *method,
 			PyObject *params,
-			PyObject *addInfo
+			PyObject *addInfo,
+			int flags
 		);
 PyObject	*buildFault(
 			int errCode,
 			char *errStr,
-			PyObject *addInfo
+			PyObject *addInfo,
+			int flags
+		);
+PyObject	*buildResponse(PyObject *result, PyObject *addInfo, int flags);
+PyObject	*streamResponse(PyObject *result, PyObject *addInfo, int flags);
+PyObject	*streamNext(PyObject *stream, long size);
+PyObject	*decoderNew(int type);
+int		decoderFeed(
+			PyObject *decoder,
+			char *bp,
+			char *ep,
+			bool final,
+			long *used
+		);
+bool		decoderCall(
+			PyObject *decoder,
+			PyObject **methodp,
+			PyObject **paramsp
 		);
-PyObject	*buildResponse(PyObject *result, PyObject *addInfo);
 PyObject	*parseCall(PyObject *request);
 PyObject	*parseRequest(PyObject *request);
 PyObject	*parseResponse(PyObject *request);
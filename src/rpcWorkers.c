@@ -0,0 +1,473 @@
+/*
+ * Copyright (C) 2001, Shilad Sen, Sourcelight Technologies, Inc.
+ * See xmlrpc.h or the README for more copyright information.
+ */
+
+
+#include "xmlrpc.h"
+#include "rpcInternal.h"
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+
+#ifndef MSWINDOWS
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif /* MSWINDOWS */
+
+
+#ifndef MSWINDOWS
+static	void		workersJoin(rpcWorkers *wp);
+static	void		*workersMain(void *arg);
+static	void		workersPush(rpcWorkers *wp, rpcJob *jp);
+static	void		workersPoke(rpcWorkers *wp);
+static	void		workersTake(rpcWorkers *wp);
+static	void		workersDrop(rpcJob *jp);
+static	bool		workersFinish(rpcJob *jp);
+static	int		workersOnErr(rpcSource *sp);
+static	bool		workersWake(
+				rpcDisp		*dp,
+				rpcSource	*sp,
+				int		actions,
+				PyObject	*params
+			);
+#endif /* MSWINDOWS */
+
+
+#ifdef MSWINDOWS
+
+rpcWorkers *
+rpcWorkersNew(rpcDisp *dp, int nthreads)
+{
+	return setPyErr("worker threads are not supported on this platform");
+}
+
+
+bool
+rpcWorkersStop(rpcWorkers *wp)
+{
+	return true;
+}
+
+
+void
+rpcWorkersFree(rpcWorkers *wp)
+{
+}
+
+
+bool
+rpcWorkersSubmit(
+	rpcWorkers	*wp,
+	PyObject	*(*run)(PyObject *arg),
+	bool		(*finish)(PyObject *arg, PyObject *result),
+	PyObject	*arg
+)
+{
+	setPyErr("worker threads are not supported on this platform");
+	return false;
+}
+
+
+bool
+rpcWorkersOnWorker(rpcWorkers *wp)
+{
+	return false;
+}
+
+#else /* MSWINDOWS */
+
+/*
+ * Start nthreads workers whose jobs are finished by dp
+ */
+rpcWorkers *
+rpcWorkersNew(rpcDisp *dp, int nthreads)
+{
+	rpcWorkers	*wp;
+	int		i;
+
+	wp = alloc(sizeof(*wp));
+	if (wp == NULL)
+		return NULL;
+	memset(wp, 0, sizeof(*wp));
+	wp->disp = dp;
+	wp->wfd[0] = -1;
+	wp->wfd[1] = -1;
+	pthread_mutex_init(&wp->lock, NULL);
+	pthread_cond_init(&wp->cond, NULL);
+	if ((pipe(wp->wfd) != 0)
+	or  (fcntl(wp->wfd[0], F_SETFL, O_NONBLOCK) != 0)
+	or  (fcntl(wp->wfd[1], F_SETFL, O_NONBLOCK) != 0)
+	or  (fcntl(wp->wfd[0], F_SETFD, FD_CLOEXEC) != 0)
+	or  (fcntl(wp->wfd[1], F_SETFD, FD_CLOEXEC) != 0)) {
+		PyErr_SetFromErrno(rpcError);
+		rpcWorkersFree(wp);
+		return NULL;
+	}
+	wp->wake = rpcSourceNew(wp->wfd[0]);
+	if (wp->wake == NULL) {
+		rpcWorkersFree(wp);
+		return NULL;
+	}
+	wp->wake->desc = alloc(strlen("workers") + 1);
+	if (wp->wake->desc == NULL) {
+		rpcWorkersFree(wp);
+		return NULL;
+	}
+	strcpy(wp->wake->desc, "workers");
+	rpcSourceSetOnErr(wp->wake, ONERR_TYPE_C, workersOnErr);
+	wp->wake->actImp = ACT_INPUT;
+	wp->wake->func = workersWake;
+	wp->wake->params = PyCapsule_New(wp, NULL, NULL);
+	if ((wp->wake->params == NULL)
+	or  (not rpcDispAddSource(dp, wp->wake))) {
+		rpcWorkersFree(wp);
+		return NULL;
+	}
+#if PY_VERSION_HEX < 0x03070000
+	PyEval_InitThreads();
+#endif
+	wp->threads = alloc(nthreads * sizeof(*wp->threads));
+	if (wp->threads == NULL) {
+		rpcWorkersFree(wp);
+		return NULL;
+	}
+	for (i = 0; i < nthreads; ++i) {
+		errno = pthread_create(&wp->threads[i], NULL, workersMain, wp);
+		if (errno != 0) {
+			PyErr_SetFromErrno(rpcError);
+			rpcWorkersFree(wp);
+			return NULL;
+		}
+		wp->nthreads++;
+	}
+	rpcLogSrc(3, wp->wake, "started %d worker threads", nthreads);
+
+	return wp;
+}
+
+
+/*
+ * Stop the workers, waiting for the jobs they are running, and finish
+ * every job that is left; the ones no worker got to are run here first.
+ * If finishing one fails the rest are still finished and the first
+ * error is left set.
+ */
+bool
+rpcWorkersStop(rpcWorkers *wp)
+{
+	rpcJob		*jp,
+			**tail;
+	bool		ok;
+	PyObject	*exc,
+			*v,
+			*tb;
+
+	workersJoin(wp);
+	(void)rpcDispDelSource(wp->disp, wp->wake);
+	wp->finishing = true;
+	workersTake(wp);
+	for (jp = wp->todo; jp != NULL; jp = jp->next) {
+		jp->result = jp->run(jp->arg);
+		if (jp->result == NULL)
+			PyErr_Fetch(&jp->exc, &jp->v, &jp->tb);
+	}
+	for (tail = &wp->ready; *tail != NULL; tail = &(*tail)->next)
+		;
+	*tail = wp->todo;
+	wp->todo = NULL;
+	wp->last = NULL;
+	ok = true;
+	exc = v = tb = NULL;
+	while ((jp = wp->ready) != NULL) {
+		wp->ready = jp->next;
+		if (workersFinish(jp))
+			continue;
+		if (ok)
+			PyErr_Fetch(&exc, &v, &tb);
+		else
+			PyErr_Clear();
+		ok = false;
+	}
+	wp->finishing = false;
+	unless (ok)
+		PyErr_Restore(exc, v, tb);
+
+	return ok;
+}
+
+
+/*
+ * Stop the workers if they are still running and free them; any job
+ * which has not been finished is dropped
+ */
+void
+rpcWorkersFree(rpcWorkers *wp)
+{
+	rpcJob		*jp;
+
+	workersJoin(wp);
+	if (wp->wake) {
+		(void)rpcDispDelSource(wp->disp, wp->wake);
+		Py_DECREF(wp->wake);
+	}
+	workersTake(wp);
+	while ((jp = wp->todo) != NULL) {
+		wp->todo = jp->next;
+		workersDrop(jp);
+	}
+	while ((jp = wp->ready) != NULL) {
+		wp->ready = jp->next;
+		workersDrop(jp);
+	}
+	if (wp->wfd[0] >= 0)
+		close(wp->wfd[0]);
+	if (wp->wfd[1] >= 0)
+		close(wp->wfd[1]);
+	pthread_mutex_destroy(&wp->lock);
+	pthread_cond_destroy(&wp->cond);
+	if (wp->threads)
+		free(wp->threads);
+	free(wp);
+}
+
+
+/*
+ * Queue a job for the next free worker; arg is kept until finish()
+ */
+bool
+rpcWorkersSubmit(
+	rpcWorkers	*wp,
+	PyObject	*(*run)(PyObject *arg),
+	bool		(*finish)(PyObject *arg, PyObject *result),
+	PyObject	*arg
+)
+{
+	rpcJob		*jp;
+
+	jp = alloc(sizeof(*jp));
+	if (jp == NULL)
+		return false;
+	memset(jp, 0, sizeof(*jp));
+	jp->run = run;
+	jp->finish = finish;
+	jp->arg = arg;
+	Py_INCREF(arg);
+	pthread_mutex_lock(&wp->lock);
+	if (wp->last)
+		wp->last->next = jp;
+	else
+		wp->todo = jp;
+	wp->last = jp;
+	pthread_cond_signal(&wp->cond);
+	pthread_mutex_unlock(&wp->lock);
+
+	return true;
+}
+
+
+/*
+ * is the calling thread one of the workers?
+ */
+bool
+rpcWorkersOnWorker(rpcWorkers *wp)
+{
+	int		i;
+
+	for (i = 0; i < wp->nthreads; ++i)
+		if (pthread_equal(wp->threads[i], pthread_self()))
+			return true;
+	return false;
+}
+
+
+/*
+ * tell the workers to exit and wait for them
+ */
+static void
+workersJoin(rpcWorkers *wp)
+{
+	int		i;
+
+	pthread_mutex_lock(&wp->lock);
+	wp->stop = true;
+	pthread_cond_broadcast(&wp->cond);
+	pthread_mutex_unlock(&wp->lock);
+	Py_BEGIN_ALLOW_THREADS
+	for (i = 0; i < wp->nthreads; ++i)
+		pthread_join(wp->threads[i], NULL);
+	Py_END_ALLOW_THREADS
+	wp->nthreads = 0;
+}
+
+
+static void *
+workersMain(void *arg)
+{
+	rpcWorkers		*wp;
+	rpcJob			*jp;
+	PyGILState_STATE	gil;
+
+	wp = arg;
+	pthread_mutex_lock(&wp->lock);
+	while (true) {
+		while (wp->todo == NULL and not wp->stop)
+			pthread_cond_wait(&wp->cond, &wp->lock);
+		if (wp->stop)
+			break;
+		jp = wp->todo;
+		wp->todo = jp->next;
+		if (wp->todo == NULL)
+			wp->last = NULL;
+		pthread_mutex_unlock(&wp->lock);
+		gil = PyGILState_Ensure();
+		jp->result = jp->run(jp->arg);
+		if (jp->result == NULL)
+			PyErr_Fetch(&jp->exc, &jp->v, &jp->tb);
+		PyGILState_Release(gil);
+		workersPush(wp, jp);
+		pthread_mutex_lock(&wp->lock);
+	}
+	pthread_mutex_unlock(&wp->lock);
+
+	return NULL;
+}
+
+
+/*
+ * Push a finished job onto wp->done.  Only the push that finds the list
+ * empty wakes the dispatcher; it takes the whole list at once.
+ */
+static void
+workersPush(rpcWorkers *wp, rpcJob *jp)
+{
+	rpcJob		*old,
+			*prev;
+
+	old = wp->done;
+	while (true) {
+		jp->next = old;
+		prev = __sync_val_compare_and_swap(&wp->done, old, jp);
+		if (prev == old)
+			break;
+		old = prev;
+	}
+	if (old == NULL)
+		workersPoke(wp);
+}
+
+
+static void
+workersPoke(rpcWorkers *wp)
+{
+	/* if the pipe is full a wakeup is pending anyway */
+	if (write(wp->wfd[1], "", 1) < 0)
+		return;
+}
+
+
+/*
+ * move the finished jobs onto the end of wp->ready, oldest first
+ */
+static void
+workersTake(rpcWorkers *wp)
+{
+	rpcJob		*jp,
+			*next,
+			*list,
+			**tail;
+
+	jp = __sync_lock_test_and_set(&wp->done, NULL);
+	for (list = NULL; jp != NULL; jp = next) {
+		next = jp->next;
+		jp->next = list;
+		list = jp;
+	}
+	for (tail = &wp->ready; *tail != NULL; tail = &(*tail)->next)
+		;
+	*tail = list;
+}
+
+
+static void
+workersDrop(rpcJob *jp)
+{
+	Py_DECREF(jp->arg);
+	Py_XDECREF(jp->result);
+	Py_XDECREF(jp->exc);
+	Py_XDECREF(jp->v);
+	Py_XDECREF(jp->tb);
+	free(jp);
+}
+
+
+/*
+ * finish a job and free it
+ */
+static bool
+workersFinish(rpcJob *jp)
+{
+	bool		ok;
+
+	if (jp->result == NULL)
+		PyErr_Restore(jp->exc, jp->v, jp->tb);
+	ok = jp->finish(jp->arg, jp->result);
+	Py_DECREF(jp->arg);
+	free(jp);
+
+	return ok;
+}
+
+
+/*
+ * A job's error has been through its own source's handler already, so
+ * it goes out of work() as it is.
+ */
+static int
+workersOnErr(rpcSource *sp)
+{
+	return 0;
+}
+
+
+/*
+ * The wakeup pipe is readable: finish the jobs the workers are done
+ * with.  If finishing one fails, its connection's onErr handler has
+ * chosen to pass the error on; it goes out of work() and the rest are
+ * finished on the next round.
+ */
+static bool
+workersWake(rpcDisp *dp, rpcSource *sp, int actions, PyObject *params)
+{
+	rpcWorkers	*wp;
+	rpcJob		*jp;
+	char		buff[64];
+	bool		ok;
+
+	wp = PyCapsule_GetPointer(params, NULL);
+	if (wp == NULL)
+		return false;
+	while (read(wp->wfd[0], buff, sizeof(buff)) > 0)
+		;
+	sp->actImp = ACT_INPUT;
+	sp->func = workersWake;
+	sp->params = params;
+	Py_INCREF(params);
+	unless (rpcDispAddSource(dp, sp))
+		return false;
+	workersTake(wp);
+	wp->finishing = true;
+	ok = true;
+	while (ok and (jp = wp->ready) != NULL) {
+		wp->ready = jp->next;
+		ok = workersFinish(jp);
+	}
+	wp->finishing = false;
+	if (wp->ready != NULL)
+		workersPoke(wp);
+
+	return ok;
+}
+
+#endif /* MSWINDOWS */
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2001, Shilad Sen, Sourcelight Technologies, Inc.
+ * See xmlrpc.h or the README for more copyright information.
+ *
+ * A pool of threads which run jobs for a dispatcher.
+ *
+ * Jobs are handed to the pool from the dispatcher's thread and run on
+ * a worker with the interpreter lock held, so a job that blocks with
+ * the lock released (sleeping, waiting on a socket or a database)
+ * holds up nobody but its own worker.  A finished job is pushed onto
+ * a list without taking any lock and the dispatcher is woken through a
+ * pipe that it watches like any other source; the job is then
+ * finished on the dispatcher's thread.
+ */
+
+
+#ifndef _RPCWORKERS_H_
+#define _RPCWORKERS_H_
+
+
+#include "rpcInclude.h"
+#include "rpcDispatch.h"
+
+#ifndef MSWINDOWS
+	#include <pthread.h>
+#endif /* MSWINDOWS */
+
+
+/*
+ * run() is called on a worker; finish() is called on the dispatcher's
+ * thread with what run() returned, or with NULL and run()'s error set.
+ * finish() owns the result.
+ */
+typedef struct _job {
+	struct _job	*next;
+	PyObject	*(*run)(PyObject *arg);
+	bool		(*finish)(PyObject *arg, PyObject *result);
+	PyObject	*arg,
+			*result,	/* what run() returned */
+			*exc,		/* or what it raised */
+			*v,
+			*tb;
+} rpcJob;
+
+
+typedef struct {
+	int		nthreads,	/* number of workers */
+			wfd[2];		/* the wakeup pipe */
+	bool		stop,		/* should the workers exit? */
+			finishing;	/* are jobs being finished? */
+	rpcJob		*todo,		/* jobs waiting for a worker */
+			*last,		/* the end of todo */
+			*done,		/* finished jobs, newest first */
+			*ready;		/* taken from done, oldest first */
+	rpcSource	*wake;		/* the read end of the wakeup pipe */
+	rpcDisp		*disp;		/* the dispatcher watching wake */
+#ifndef MSWINDOWS
+	pthread_t	*threads;
+	pthread_mutex_t	lock;		/* guards todo and stop */
+	pthread_cond_t	cond;		/* signalled when todo grows */
+#endif /* MSWINDOWS */
+} rpcWorkers;
+
+
+rpcWorkers	*rpcWorkersNew(rpcDisp *dp, int nthreads);
+bool		rpcWorkersStop(rpcWorkers *wp);
+void		rpcWorkersFree(rpcWorkers *wp);
+bool		rpcWorkersSubmit(
+			rpcWorkers	*wp,
+			PyObject	*(*run)(PyObject *arg),
+			bool		(*finish)(PyObject *arg,
+						PyObject *result),
+			PyObject	*arg
+		);
+bool		rpcWorkersOnWorker(rpcWorkers *wp);
+
+
+#endif /* _RPCWORKERS_H_ */
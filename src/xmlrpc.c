@@ -55,6 +55,7 @@ xmlrpcInit(void)
 	Py_TYPE(&rpcDateType) = &PyType_Type;
 	Py_TYPE(&rpcBase64Type) = &PyType_Type;
 	Py_TYPE(&rpcClientType) = &PyType_Type;
+	Py_TYPE(&rpcPoolType) = &PyType_Type;
 	Py_TYPE(&rpcServerType) = &PyType_Type;
 	Py_TYPE(&rpcSourceType) = &PyType_Type;
 	rpcError = PyString_FromString("turbo_xmlrpc.error");
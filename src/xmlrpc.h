@@ -49,11 +49,16 @@
 #include "rpcDate.h"
 #include "rpcDispatch.h"
 #include "rpcFault.h"
+#include "rpcHttp.h"
 #include "rpcInclude.h"
+#include "rpcMethods.h"
+#include "rpcPoller.h"
+#include "rpcPool.h"
 #include "rpcPostpone.h"
 #include "rpcServer.h"
 #include "rpcSource.h"
 #include "rpcUtils.h"
+#include "rpcWorkers.h"
 
 
 extern	PyObject	*rpcError;
@@ -49,6 +49,7 @@
 #define PyString_ConcatAndDel PyBytes_ConcatAndDel
 #define _PyString_Resize _PyBytes_Resize
 #define PyString_Check PyUnicode_Check
+#define PyString_InternInPlace PyUnicode_InternInPlace
 #define PyObject_Compare(inst, obj) ((inst) == (obj))
 
 static inline PyObject *
@@ -61,5 +62,11 @@ Py_FindMethod(PyMethodDef *ml, PyObject *self, const char *name) {
 	return NULL;
 }
 
+static inline int
+PyString_AsStringAndSize(PyObject *obj, char **buf, Py_ssize_t *len) {
+	*buf = (char *)PyUnicode_AsUTF8AndSize(obj, len);
+	return *buf == NULL ? -1 : 0;
+}
+
 
 #endif /* _XMLRPC2TO3_H_ */
@@ -62,6 +62,11 @@ static PyObject		*makeXmlrpcClientFromServe(
 				PyObject *self,
 				PyObject *args
 			);
+static PyObject		*makeXmlrpcPool(PyObject *self, PyObject *args);
+static PyObject		*makeXmlrpcPoolFromServer(
+				PyObject *self,
+				PyObject *args
+			);
 static PyObject		*makeXmlrpcServer(PyObject *self, PyObject *args);
 static PyObject		*makeXmlrpcSource(PyObject *self, PyObject *args);
 static PyObject		*rpcEncode(PyObject *self, PyObject *args);
@@ -85,6 +90,8 @@ static PyMethodDef rpcModuleMethods[] = {
         /* client-server */
 	{ "client",		(PyCFunction)makeXmlrpcClient,		1, },
 	{ "clientFromServer",	(PyCFunction)makeXmlrpcClientFromServe,	1, },
+	{ "pool",		(PyCFunction)makeXmlrpcPool,		1, },
+	{ "poolFromServer",	(PyCFunction)makeXmlrpcPoolFromServer,	1, },
 	{ "server",		(PyCFunction)makeXmlrpcServer,		1, },
 	/* encoders */
 	{ "boolean",		(PyCFunction)makeXmlrpcBool,		1, },
@@ -331,6 +338,45 @@ makeXmlrpcClientFromServe(PyObject *self, PyObject *args)
 }
 
 
+/*
+ * module procedure: create a pool of clients
+ */
+static PyObject *
+makeXmlrpcPool(PyObject *self, PyObject *args)
+{
+	char		*host,
+			*url;
+	int		port,
+			nclients;
+
+	unless (PyArg_ParseTuple(args, "sisi", &host, &port, &url, &nclients))
+		return NULL;
+
+	return (PyObject *)rpcPoolNew(host, port, url, nclients);
+}
+
+
+/*
+ * module procedure: create a pool of clients run by a server
+ */
+static PyObject *
+makeXmlrpcPoolFromServer(PyObject *self, PyObject *args)
+{
+	rpcServer	*servp;
+	char		*host,
+			*url;
+	int		port,
+			nclients;
+
+	unless (PyArg_ParseTuple(args, "sisiO!", &host, &port, &url,
+				&nclients, &rpcServerType, &servp))
+		return NULL;
+
+	return (PyObject *)rpcPoolNewFromServer(host, port, url, nclients,
+						servp);
+}
+
+
 /*
  * module procedure: create a server object
  */
@@ -359,6 +405,29 @@ makeXmlrpcSource(PyObject *self, PyObject *args)
 }
 
 
+/*
+ * The encoders build their xml in a bytes object; python 3 callers get
+ * it back as a str.
+ */
+#if PY_MAJOR_VERSION > 2
+static PyObject *
+pyXml(PyObject *bytes)
+{
+	PyObject	*res;
+
+	if (bytes == NULL)
+		return NULL;
+	res = PyUnicode_FromStringAndSize(PyBytes_AS_STRING(bytes),
+					PyBytes_GET_SIZE(bytes));
+	Py_DECREF(bytes);
+
+	return res;
+}
+#else
+#define	pyXml(bytes)	(bytes)
+#endif /* PY_MAJOR_VERSION > 2 */
+
+
 /*
  * module procedure: encode an object in xml
  */
@@ -366,11 +435,13 @@ static PyObject *
 rpcEncode(PyObject *self, PyObject *args)
 {
 	PyObject	*value;
+	int		compact;
 
-	unless (PyArg_ParseTuple(args, "O", &value))
+	compact = 0;
+	unless (PyArg_ParseTuple(args, "O|i", &value, &compact))
 		return NULL;
 
-	return xmlEncode(value);
+	return pyXml(xmlEncode(value, compact ? ENC_COMPACT : 0));
 }
 
 
@@ -397,12 +468,14 @@ rpcBuildCall(PyObject *self, PyObject *args)
 {
     char 	*method;
     PyObject	*params;
+    int		compact;
 
-    unless (PyArg_ParseTuple(args, "sO", &method, &params))
+    compact = 0;
+    unless (PyArg_ParseTuple(args, "sO|i", &method, &params, &compact))
 	return NULL;	
     unless (PySequence_Check(params))
 	return setPyErr("build request params must be a sequence");
-    return buildCall(method, params);
+    return pyXml(buildCall(method, params, compact ? ENC_COMPACT : 0));
 }
 
 /*
@@ -415,15 +488,18 @@ rpcBuildRequest(PyObject *self, PyObject *args)
 			*url;
 	PyObject	*params,
 			*addInfo;
+	int		compact;
 
-	unless (PyArg_ParseTuple(args, "ssOO",
-				&url, &method, &params, &addInfo))
+	compact = 0;
+	unless (PyArg_ParseTuple(args, "ssOO|i",
+				&url, &method, &params, &addInfo, &compact))
 		return NULL;
 	unless (PyDict_Check(addInfo))
 		return setPyErr("additional info must be a dictonary");
 	unless (PySequence_Check(params))
 		return setPyErr("build request params must be a sequence");
-	return buildRequest(url, method, params, addInfo);
+	return pyXml(buildRequest(url, method, params, addInfo,
+				compact ? ENC_COMPACT : 0));
 }
 
 
@@ -435,13 +511,15 @@ rpcBuildResponse(PyObject *self, PyObject *args)
 {
 	PyObject	*result,
 			*addInfo;
+	int		compact;
 
-	unless (PyArg_ParseTuple(args, "OO", &result, &addInfo))
+	compact = 0;
+	unless (PyArg_ParseTuple(args, "OO|i", &result, &addInfo, &compact))
 		return NULL;
 	unless (PyDict_Check(addInfo))
 		return setPyErr("additional info must be a dictonary");
 
-	return buildResponse(result, addInfo);
+	return pyXml(buildResponse(result, addInfo, compact ? ENC_COMPACT : 0));
 }
 
 
@@ -452,15 +530,19 @@ static PyObject *
 rpcBuildFault(PyObject *self, PyObject *args)
 {
 	PyObject	*addInfo;
-	int		errCode;
+	int		errCode,
+			compact;
 	char		*errStr;
 
-	unless (PyArg_ParseTuple(args, "isO", &errCode, &errStr, &addInfo))
+	compact = 0;
+	unless (PyArg_ParseTuple(args, "isO|i",
+				&errCode, &errStr, &addInfo, &compact))
 		return NULL;
 	unless (PyDict_Check(addInfo))
 		return setPyErr("additional info must be a dictonary");
 
-	return buildFault(errCode, errStr, addInfo);
+	return pyXml(buildFault(errCode, errStr, addInfo,
+				compact ? ENC_COMPACT : 0));
 }
 
 /*
@@ -62,6 +62,13 @@ DATE_FORMAT_EUROPE	= _xmlrpc.DATE_FORMAT_EUROPE
 #		this client implementation) raise the same error.  Note that the
 #		the server can delay responding until a later time by raising
 #		a xmlrpc.postpone error.  See queueResponse and queueFault.
+#		The handlers are called straight from the C server.
+#
+# dispatch(serv, src, uri, method, params):
+#		Calls the handler registered for method, as found in the
+#		comtab dictionary.  It is only kept for code that calls it
+#		directly: requests no longer go through it, so a subclass
+#		that overrides it does not change how they are handled.
 #
 # activeFds():
 #		Returns a 3-tuple of the active file descriptor sets for
@@ -100,6 +107,55 @@ DATE_FORMAT_EUROPE	= _xmlrpc.DATE_FORMAT_EUROPE
 #		domain the authentication should apply to.  Note that the
 #		domain is not currently used.
 #
+# setCompact(compact):
+#		If compact is true, responses are encoded without any
+#		indentation or line breaks between the xml elements.
+#
+# setStreaming(size):
+#		If size is not 0, results are sent to HTTP/1.1 clients
+#		with chunked encoding, about size bytes at a time, each
+#		chunk being encoded only when the last one has been
+#		written.  This keeps huge responses out of memory.
+#
+# setWorkers(nthreads):
+#		If nthreads is not 0, method handlers are run on a pool
+#		of that many threads, so a handler that blocks (sleeps,
+#		waits on a socket or a database) does not hold up the
+#		other requests.  Requests are still read and responses
+#		written by the thread that calls work().  0 runs the
+#		handlers on that thread again.  close() stops the pool.
+#		When the pool is changed or stopped, the requests it has
+#		are answered first; those no thread got to yet are run by
+#		the caller.
+#
+# setMaxConnections(maxConns):
+#		Stop accepting connections while maxConns of them are open;
+#		the rest wait in the listen queue until one is closed.  0,
+#		the default, means there is no limit.
+#
+# setAcceptBudget(budget):
+#		Accept at most budget connections (64 by default) each time
+#		the listening socket is ready, so that a storm of new ones
+#		can't hold up the connections which are already open.
+#
+# setReusePort(reusePort):
+#		If reusePort is true, bindAndListen() sets SO_REUSEPORT on
+#		the socket, so that processes made by fork() can each
+#		listen on a socket of their own.
+#
+# fork(nprocs):
+#		Fork nprocs - 1 more processes to serve the port the
+#		server is listening on.  Returns 0 in the parent and 1 to
+#		nprocs - 1 in the children.  With setReusePort(1) the
+#		kernel spreads connections over the processes; otherwise
+#		they all accept on the one socket.  Call it right after
+#		bindAndListen(), before work() and setWorkers().
+#
+# stats():
+#		A dictionary of counters ('connections', 'requests',
+#		'faults') added up over every process serving the port,
+#		with each process's own in a list under 'procs'.
+#
 # addSource(src):
 #		Monitor a source into the server's file descriptor event loop.
 #
@@ -120,11 +176,8 @@ class server:
 		self.comtab = {}
 
 	def addMethods(self, dict):
-		d = {}
-		for (name, func) in dict.items():
-			d[name] = self.dispatch
-			self.comtab[name] = func
-		self._o.addMethods(d)
+		self.comtab.update(dict)
+		self._o.addMethods(dict, self)
 
 	def dispatch(self, serv, src, uri, method, params):
 		return self.comtab[method](self, src, uri, method, params)
@@ -150,6 +203,30 @@ class server:
 	def setAuth(self, authFunc):
 		self._o.setAuth(authFunc)
 
+	def setCompact(self, compact):
+		self._o.setCompact(compact)
+
+	def setStreaming(self, size):
+		self._o.setStreaming(size)
+
+	def setWorkers(self, nthreads):
+		self._o.setWorkers(nthreads)
+
+	def setMaxConnections(self, maxConns):
+		self._o.setMaxConnections(maxConns)
+
+	def setAcceptBudget(self, budget):
+		self._o.setAcceptBudget(budget)
+
+	def setReusePort(self, reusePort):
+		self._o.setReusePort(reusePort)
+
+	def fork(self, nprocs):
+		return self._o.fork(nprocs)
+
+	def stats(self):
+		return self._o.stats()
+
 	def setOnErr(self, onErr):
 		self._o.setOnErr(onErr)
 
@@ -181,6 +258,22 @@ class server:
 #
 # nbExecute(method, params, pyfunc, extArgs):
 #		Queue up a command for execution when "work()" is called.
+#		pyfunc is called straight from the C client with three
+#		args: (client, response, extArgs).  Commands queued while
+#		others are outstanding are pipelined: their requests are
+#		written without waiting for the earlier responses, which
+#		come back in order.  execute() can't be used meanwhile.
+#		If the connection fails, or the server closes it, each
+#		call still waiting gets a fault response (faultCode -1).
+#
+# nbDispatch(src, response, (pyfunc, extArgs)):
+#		Calls pyfunc(client, response, extArgs).  It is only kept
+#		for code that calls it directly: nbExecute() callbacks no
+#		longer go through it, so overriding it has no effect.
+#
+# setCompact(compact):
+#		If compact is true, requests are encoded without any
+#		indentation or line breaks between the xml elements.
 #
 # setOnErr(onErr):
 #		Set an error handler for internal client errors (i.e. read
@@ -221,8 +314,8 @@ class client:
 
 	def nbExecute(self, method, params, pyfunc,
 	              extArgs=None, name=None, passw=None):
-		self._o.nbexecute(method, params, self.nbDispatch,
-				(pyfunc, extArgs), name, passw)
+		self._o.nbexecute(method, params, pyfunc, extArgs,
+				name, passw, self)
 
 	def nbDispatch(self, src, response, fapair):
 		pyfunc, extArgs = fapair
@@ -231,6 +324,64 @@ class client:
 	def work(self, timeout=-1.0):
 		self._o.work(timeout)
 
+	def setCompact(self, compact):
+		self._o.setCompact(compact)
+
+	def setOnErr(self, onErr):
+		self._o.setOnErr(onErr)
+
+
+# A pool of keep-alive connections to one xmlrpc server
+#
+# pool(host, port, url='/', nconns=4, serv=None):
+#		Up to nconns calls are in flight at once, each on a
+#		connection of its own; further calls wait in a queue.
+#
+# nbExecute(method, params, pyfunc, extArgs):
+#		Queue up a command to be sent on the next idle connection
+#		when "work()" is called.  pyfunc is called with three args:
+#		(pool, response, extArgs), as soon as the response is in.
+#		A call that cannot be sent, or whose connection fails, gets
+#		a fault (-1) response carrying the error instead.
+#
+# pending():
+#		The number of calls that are queued or in flight.
+#
+# work(timeout=-1.0):
+#		Process calls for some period of time, or until there are
+#		none left.
+#
+# activeFds(), close(), setCompact(compact), setOnErr(onErr):
+#		As for a client, applied to every connection of the pool.
+#
+class pool:
+	def __init__(self, host, port, url='/', nconns=4, serv=None):
+		if serv:
+			self._o = _xmlrpc.poolFromServer(
+				host, port, url, nconns, serv._o)
+		else:
+			self._o = _xmlrpc.pool(host, port, url, nconns)
+
+	def activeFds(self):
+		return self._o.activeFds()
+
+	def close(self):
+		self._o.close()
+
+	def nbExecute(self, method, params, pyfunc,
+	              extArgs=None, name=None, passw=None):
+		self._o.nbexecute(method, params, pyfunc, extArgs,
+				name, passw, self)
+
+	def pending(self):
+		return self._o.pending()
+
+	def work(self, timeout=-1.0):
+		self._o.work(timeout)
+
+	def setCompact(self, compact):
+		self._o.setCompact(compact)
+
 	def setOnErr(self, onErr):
 		self._o.setOnErr(onErr)
 
@@ -248,6 +399,16 @@ class client:
 #					dropping the client)
 #		ONERR_KEEP_WORK:	don't raise this exception any higher
 #
+# setCallback(func, actions, params):
+#		func is called straight from the C source with three args:
+#		(source, actions, params).
+#
+# marshaller(src, actions, args):
+#		Calls the func given to setCallback() with (source, actions,
+#		args).  It is only kept for code that calls it directly:
+#		callbacks no longer go through it, so overriding it has no
+#		effect.
+#
 class source:
 	def __init__(self, fd):
 		self._o = _xmlrpc.source(fd)
@@ -262,7 +423,7 @@ class source:
 		self._o.setOnErr(onErr)
 
 	def setCallback(self, func, actions, params):
-		self._o.setCallback(self.marshaller, actions, params)
+		self._o.setCallback(func, actions, params, self)
 		self._func = func
 
 	def marshaller(self, src, actions, args):
@@ -314,9 +475,10 @@ postpone = _xmlrpc.postpone
 
 
 # xml encode an xmlrpc data value
+# if compact is true, no indentation or line breaks are added
 #
-def encode(value):
-	return _xmlrpc.encode(value)
+def encode(value, compact=0):
+	return _xmlrpc.encode(value, compact)
 
 
 # decode xml representing an xmlrpc data value
@@ -330,26 +492,29 @@ def decode(xml):
 # method must be a string which is the name of the remote function
 # params must be a sequence of some sort
 # addInfo is a dictionary of additional header information
+# if compact is true, the xml has no indentation or line breaks
 #
-def buildRequest(uri, method, params, addInfo={}):
-	return _xmlrpc.buildRequest(uri, method, params, addInfo)
+def buildRequest(uri, method, params, addInfo={}, compact=0):
+	return _xmlrpc.buildRequest(uri, method, params, addInfo, compact)
 
 
 # build a string representing a xmlrpc response
 # result is the result object to be returned to the client
 # addInfo is a dictionary of additional header information
+# if compact is true, the xml has no indentation or line breaks
 #
-def buildResponse(result, addInfo={}):
-	return _xmlrpc.buildResponse(result, addInfo)
+def buildResponse(result, addInfo={}, compact=0):
+	return _xmlrpc.buildResponse(result, addInfo, compact)
 
 
 # build a string representing a xmlrpc fault
 # errCode is an integer representing the error
 # errStr is a string representing the error
 # addInfo is a dictionary of additional header information
+# if compact is true, the xml has no indentation or line breaks
 #
-def buildFault(errCode, errStr, addInfo={}):
-	return _xmlrpc.buildFault(errCode, errStr, addInfo)
+def buildFault(errCode, errStr, addInfo={}, compact=0):
+	return _xmlrpc.buildFault(errCode, errStr, addInfo, compact)
 
 
 # parse a string representing a xmlrpc response